@@ -0,0 +1,100 @@
+// Measures how long traversing a long list takes before and after the heap
+// is compacted. The pairs of the list are linked in a shuffled order, as
+// they end up once a program has long reused the memory of its garbage.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/compact.h"
+#include "../src/memory.h"
+#include "../src/state.h"
+#include "../src/value.h"
+#include "../src/vm.h"
+
+// Number of traversals, the fastest of which is reported.
+#define TRAVERSALS 5
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Builds a list of the given length, linking its pairs in the order given
+// by a fixed shuffle of their allocation order.
+static Value build_list(struct wisp_state *w, long length)
+{
+  struct obj_pair **pairs = malloc(sizeof(struct obj_pair *) * length);
+  if (pairs == NULL)
+    exit(1);
+
+  for (long i = 0; i < length; ++i)
+    pairs[i] = pair_new(w, NUM_VAL(i), NIL_VAL);
+
+  uint64_t seed = 0x9e3779b97f4a7c15;
+  for (long i = length - 1; i > 0; --i) {
+    seed = seed * 6364136223846793005 + 1442695040888963407;
+    long j = (long) ((seed >> 33) % (uint64_t) (i + 1));
+    struct obj_pair *pair = pairs[i];
+    pairs[i] = pairs[j];
+    pairs[j] = pair;
+  }
+
+  for (long i = 0; i + 1 < length; ++i)
+    pairs[i]->cdr = OBJ_VAL(pairs[i + 1]);
+
+  Value list = OBJ_VAL(pairs[0]);
+  free(pairs);
+  return list;
+}
+
+static void traverse(struct wisp_state *w, const char *when)
+{
+  double best = 0;
+  double sum = 0;
+
+  for (int i = 0; i < TRAVERSALS; ++i) {
+    double start = now();
+    sum = 0;
+
+    for (Value l = w->stack[0]; IS_PAIR(l); l = AS_PAIR(l)->cdr)
+      sum += AS_NUM(AS_PAIR(l)->car);
+
+    double elapsed = now() - start;
+    if (i == 0 || elapsed < best)
+      best = elapsed;
+  }
+
+  printf("%s: %.1f ms (sum %.0f)\n", when, best * 1e3, sum);
+}
+
+int main(int argc, char *argv[])
+{
+  long length = argc == 2 ? atol(argv[1]) : 0;
+  if (length < 1) {
+    fprintf(stderr, "Usage: %s length\n", argv[0]);
+    return 64;
+  }
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // Nothing is collected while the list is built, as it is not yet rooted.
+  w.next_gc = SIZE_MAX;
+  w.next_young_gc = SIZE_MAX;
+  vm_stack_push(&w, build_list(&w, length));
+  collect_garbage(&w);
+  traverse(&w, "scattered");
+
+  double start = now();
+  compact_heap(&w);
+  printf("compaction: %.1f ms\n", (now() - start) * 1e3);
+  traverse(&w, "compacted");
+
+  wisp_state_free(&w);
+  return 0;
+}
@@ -0,0 +1,83 @@
+// Measures how long a full collection of a large heap of pairs takes when
+// marking on different numbers of threads. The pairs form a balanced binary
+// tree, so that marking has plenty of work to share between the threads.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/memory.h"
+#include "../src/state.h"
+#include "../src/value.h"
+#include "../src/vm.h"
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Builds a tree of the given number of pairs, level by level, keeping the
+// current level on the stack.
+static Value build_tree(struct wisp_state *w, long pairs)
+{
+  Value *level = malloc(sizeof(Value) * (size_t) pairs);
+  if (level == NULL)
+    exit(1);
+
+  long count = 0;
+  for (; count < pairs / 2; ++count)
+    level[count] = OBJ_VAL(pair_new(w, NUM_VAL(count), NIL_VAL));
+
+  long allocated = count;
+  while (count > 1) {
+    long next = 0;
+
+    for (long i = 0; i + 1 < count; i += 2)
+      level[next++] = OBJ_VAL(pair_new(w, level[i], level[i + 1]));
+
+    if (count % 2 == 1)
+      level[next++] = level[count - 1];
+
+    allocated += next;
+    count = next;
+  }
+
+  Value root = level[0];
+  free(level);
+  printf("%ld pairs\n", allocated);
+  return root;
+}
+
+int main(int argc, char *argv[])
+{
+  long pairs = argc >= 3 ? atol(argv[1]) : 0;
+  if (pairs < 2) {
+    fprintf(stderr, "Usage: %s pairs threads...\n", argv[0]);
+    return 64;
+  }
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // Nothing is collected while the tree is built, as it is not yet rooted.
+  w.next_gc = SIZE_MAX;
+  w.next_young_gc = SIZE_MAX;
+  vm_stack_push(&w, build_tree(&w, pairs));
+
+  for (int arg = 2; arg < argc; ++arg) {
+    w.gc_threads = atoi(argv[arg]);
+    if (w.gc_threads <= 0)
+      continue;
+
+    double start = now();
+    collect_garbage(&w);
+    printf("%d threads: %.1f ms\n", w.gc_threads, (now() - start) * 1e3);
+  }
+
+  wisp_state_free(&w);
+  return 0;
+}
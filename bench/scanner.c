@@ -0,0 +1,123 @@
+// Measures the throughput of the scanner. The given source files are
+// concatenated and repeated up to a fixed size, and the result is scanned
+// a few times. The printed checksum of the tokens must not depend on whether
+// the scanner is built with SCANNER_SCALAR.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/scanner.h"
+
+#define SOURCE_SIZE (64 * 1024 * 1024)
+#define ROUNDS 5
+
+static char *read_file(const char *path, size_t *size)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return NULL;
+  }
+
+  char *buffer = NULL;
+  size_t capacity = 0;
+  *size = 0;
+
+  for (;;) {
+    if (*size == capacity) {
+      capacity = capacity < 4096 ? 4096 : 2 * capacity;
+      buffer = realloc(buffer, capacity);
+      if (buffer == NULL)
+        exit(1);
+    }
+
+    size_t bytes_read = fread(buffer + *size, 1, capacity - *size, f);
+    if (bytes_read == 0)
+      break;
+
+    *size += bytes_read;
+  }
+
+  fclose(f);
+  return buffer;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s path...\n", argv[0]);
+    return 64;
+  }
+
+  char *source = malloc(SOURCE_SIZE + 1);
+  if (source == NULL)
+    return 1;
+
+  size_t len = 0;
+
+  while (len < SOURCE_SIZE) {
+    size_t before = len;
+
+    for (int i = 1; i < argc && len < SOURCE_SIZE; ++i) {
+      size_t size;
+      char *file = read_file(argv[i], &size);
+      if (file == NULL)
+        return 74;
+
+      // Keep forms from being split between the copies.
+      if (len + size + 1 > SOURCE_SIZE) {
+        free(file);
+        len = SOURCE_SIZE;
+        break;
+      }
+
+      memcpy(source + len, file, size);
+      len += size;
+      source[len++] = '\n';
+      free(file);
+    }
+
+    if (len == before)
+      break;
+  }
+
+  source[len] = '\0';
+
+  double best = 0;
+  unsigned long tokens = 0;
+  unsigned long checksum = 0;
+
+  for (int round = 0; round < ROUNDS; ++round) {
+    struct scanner sc;
+    scanner_init(&sc, source);
+    tokens = 0;
+    checksum = 0;
+
+    clock_t start = clock();
+    struct token tok;
+
+    do {
+      tok = scanner_next(&sc);
+      tokens++;
+      // Error tokens start at their message rather than in the source.
+      size_t offset = tok.type == TOKEN_ERROR
+                    ? 0
+                    : (size_t) (tok.start - source);
+      checksum = checksum * 31 + offset * 7
+               + (unsigned long) tok.len * 3 + (unsigned long) tok.line
+               + tok.type;
+    } while (tok.type != TOKEN_EOF);
+
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    if (round == 0 || seconds < best)
+      best = seconds;
+  }
+
+  printf("%zu bytes, %lu tokens, checksum %lx: %.1f MB/s\n", len, tokens,
+      checksum, len / best / (1024 * 1024));
+
+  free(source);
+  return 0;
+}
@@ -0,0 +1,164 @@
+// Measures the throughput and latency of a server started by
+// 'wisp --serve'. The given source is sent as a request over one connection
+// the given number of times, each request waiting for the response to the
+// previous one. The printed percentiles are of the round-trip times.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// How long to wait for the server to start listening.
+#define CONNECT_ATTEMPTS 100
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+
+  strcpy(addr.sun_path, path);
+
+  for (int attempt = 0; attempt < CONNECT_ATTEMPTS; ++attempt) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+      return -1;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+      return fd;
+
+    close(fd);
+
+    struct timespec delay = {0, 10 * 1000 * 1000};
+    nanosleep(&delay, NULL);
+  }
+
+  return -1;
+}
+
+static int compare(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// Reads one response, returning whether it is successful, or -1 if the
+// connection ended.
+static int read_response(int fd, char **buffer, size_t *capacity)
+{
+  char header[32];
+  size_t len = 0;
+
+  // The header is read byte by byte, so nothing of the body is consumed.
+  while (len < sizeof(header) - 1) {
+    if (read(fd, header + len, 1) != 1)
+      return -1;
+    if (header[len++] == '\n')
+      break;
+  }
+
+  header[len] = '\0';
+
+  char status[8];
+  size_t size;
+  if (sscanf(header, "%7s %zu", status, &size) != 2)
+    return -1;
+
+  if (size > *capacity) {
+    *capacity = size;
+    *buffer = realloc(*buffer, *capacity);
+    if (*buffer == NULL)
+      exit(1);
+  }
+
+  for (size_t bytes_read = 0; bytes_read < size;) {
+    ssize_t n = read(fd, *buffer + bytes_read, size - bytes_read);
+    if (n <= 0)
+      return -1;
+
+    bytes_read += (size_t) n;
+  }
+
+  return strcmp(status, "ok") == 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int count = argc == 4 ? atoi(argv[2]) : 0;
+  if (count <= 0) {
+    fprintf(stderr, "Usage: %s socket requests source\n", argv[0]);
+    return 64;
+  }
+
+  int fd = connect_to(argv[1]);
+  if (fd == -1) {
+    fprintf(stderr, "Cannot connect to %s\n", argv[1]);
+    return 74;
+  }
+
+  size_t source_len = strlen(argv[3]);
+  char *request = malloc(source_len + 32);
+  if (request == NULL)
+    return 1;
+
+  int request_len = snprintf(request, source_len + 32, "%zu\n%s",
+      source_len, argv[3]);
+
+  double *latencies = malloc(sizeof(double) * count);
+  char *buffer = NULL;
+  size_t capacity = 0;
+  int errors = 0;
+  int served = 0;
+  double start = now();
+
+  for (; served < count; ++served) {
+    double sent = now();
+
+    if (write(fd, request, request_len) != request_len)
+      break;
+
+    int status = read_response(fd, &buffer, &capacity);
+    if (status == -1)
+      break;
+
+    errors += !status;
+    latencies[served] = now() - sent;
+  }
+
+  double seconds = now() - start;
+  close(fd);
+
+  if (served == 0) {
+    fprintf(stderr, "No response received\n");
+    return 74;
+  }
+
+  qsort(latencies, served, sizeof(double), compare);
+
+  printf("%d requests, %d errors: %.0f requests/s\n", served, errors,
+      served / seconds);
+  printf("latency p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+      latencies[served / 2] * 1e6, latencies[served * 9 / 10] * 1e6,
+      latencies[served * 99 / 100] * 1e6, latencies[served - 1] * 1e6);
+
+  free(latencies);
+  free(buffer);
+  free(request);
+  return served == count ? 0 : 74;
+}
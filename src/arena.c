@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Size of the first block. Every further block is twice as large as the
+// previous one, or as large as the allocation that did not fit.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// Alignment of all allocations, sufficient for any type stored in the arena.
+#define ARENA_ALIGNMENT 16
+
+#define ALIGN(size) \
+  (((size) + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1))
+
+struct arena_block {
+  // The block allocated before this one (or NULL).
+  struct arena_block *prev;
+
+  // Number of bytes available for allocations.
+  size_t size;
+
+  // Number of bytes already allocated.
+  size_t used;
+};
+
+// The allocations start right after the block header.
+#define BLOCK_DATA(block) ((unsigned char *) (block) + ALIGN(sizeof(*(block))))
+
+void arena_init(struct arena *a)
+{
+  a->block = NULL;
+  a->last = NULL;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+  size = ALIGN(size);
+
+  if (a->block == NULL || a->block->size - a->block->used < size) {
+    size_t block_size = a->block == NULL
+                      ? ARENA_BLOCK_SIZE
+                      : 2 * a->block->size;
+    if (block_size < size)
+      block_size = size;
+
+    struct arena_block *block =
+      malloc(ALIGN(sizeof(struct arena_block)) + block_size);
+    if (block == NULL)
+      exit(1);
+
+    block->prev = a->block;
+    block->size = block_size;
+    block->used = 0;
+    a->block = block;
+  }
+
+  a->last = BLOCK_DATA(a->block) + a->block->used;
+  a->block->used += size;
+  return a->last;
+}
+
+void *arena_grow(struct arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+  if (ptr != NULL && ptr == a->last) {
+    // The most recent allocation is extended in place if the block has room.
+    size_t offset = (unsigned char *) ptr - BLOCK_DATA(a->block);
+
+    if (a->block->size - offset >= ALIGN(new_size)) {
+      a->block->used = offset + ALIGN(new_size);
+      return ptr;
+    }
+  }
+
+  void *result = arena_alloc(a, new_size);
+  if (old_size > 0)
+    memcpy(result, ptr, old_size);
+
+  return result;
+}
+
+void arena_reset(struct arena *a)
+{
+  if (a->block == NULL)
+    return;
+
+  // Keep the last block, the largest one, for the allocations to come.
+  struct arena_block *prev = a->block->prev;
+  while (prev != NULL) {
+    struct arena_block *block = prev;
+    prev = block->prev;
+    free(block);
+  }
+
+  a->block->prev = NULL;
+  a->block->used = 0;
+  a->last = NULL;
+}
+
+void arena_free(struct arena *a)
+{
+  struct arena_block *block = a->block;
+  while (block != NULL) {
+    struct arena_block *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+
+  arena_init(a);
+}
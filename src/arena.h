@@ -0,0 +1,34 @@
+#ifndef WISP_ARENA_H
+#define WISP_ARENA_H
+
+#include "common.h"
+
+#define ARENA_ALLOCATE(a, type, count) arena_alloc(a, sizeof(type) * (count))
+
+#define ARENA_GROW_ARRAY(a, type, ptr, old_count, new_count) \
+  arena_grow(a, ptr, sizeof(type) * (old_count), sizeof(type) * (new_count))
+
+struct arena_block;
+
+// Bump allocator for short-lived buffers. Nothing is freed individually, all
+// allocations are released at once by resetting the arena. The memory is not
+// counted towards the state's allocated bytes, so it never triggers a GC.
+struct arena {
+  // The block allocations are made from, linked to the previous ones.
+  struct arena_block *block;
+
+  // The most recent allocation, which can be grown in place.
+  void *last;
+};
+
+void arena_init(struct arena *);
+
+void *arena_alloc(struct arena *, size_t);
+
+void *arena_grow(struct arena *, void *, size_t, size_t);
+
+void arena_reset(struct arena *);
+
+void arena_free(struct arena *);
+
+#endif
@@ -7,6 +7,10 @@
 #include <stdint.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+#define UINT24_MAX 0xFFFFFF
+#define UINT24_COUNT (UINT24_MAX + 1)
 
 #define XSTR(s) STR(s)
 #define STR(s) #s
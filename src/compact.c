@@ -0,0 +1,301 @@
+#include <string.h>
+
+#include "compact.h"
+#include "memory.h"
+#include "pool.h"
+#include "state.h"
+
+// Objects are moved by copying them into another pool, much like a copying
+// collector, except that the unreachable objects are freed beforehand by a
+// full collection. An object still marked in the old pages has not been
+// moved yet. A moved one is unmarked, and its new address follows its
+// header. Every reference is updated exactly once: those of the roots
+// directly, and those of the moved objects when the objects are scanned.
+// Number of pages the room left free on the pages must exceed for the heap
+// to be compacted, so that the few pages partially filled, which compaction
+// leaves as they are, do not trigger it on a small heap.
+#define COMPACT_MIN_ROOM 16
+
+struct compactor {
+  struct wisp_state *w;
+
+  // The pool the objects are moved out of.
+  struct pool from;
+
+  // Moved objects, and large objects, whose references still lead to the
+  // old addresses.
+  struct obj **unscanned;
+  size_t unscanned_count;
+  size_t unscanned_capacity;
+};
+
+static void unscanned_push(struct compactor *c, struct obj *obj)
+{
+  if (c->unscanned_count >= c->unscanned_capacity) {
+    c->unscanned_capacity = GROW_CAPACITY(c->unscanned_capacity);
+    c->unscanned = realloc(c->unscanned,
+        sizeof(struct obj *) * c->unscanned_capacity);
+
+    if (c->unscanned == NULL)
+      exit(1);
+  }
+
+  c->unscanned[c->unscanned_count++] = obj;
+}
+
+static size_t obj_size(struct obj *obj)
+{
+  switch (obj->type) {
+  case OBJ_ATOM:
+    return sizeof(struct obj_string);
+  case OBJ_CLOSURE:
+    return sizeof(struct obj_closure);
+  case OBJ_LAMBDA:
+    return sizeof(struct obj_lambda);
+  case OBJ_NATIVE:
+    return sizeof(struct obj_native);
+  case OBJ_UPVALUE:
+    return sizeof(struct obj_upvalue);
+  case OBJ_PAIR:
+    return sizeof(struct obj_pair);
+  case OBJ_MAPPING:
+    return sizeof(struct obj_mapping);
+  case OBJ_BYTES:
+    return sizeof(struct obj_bytes);
+  }
+
+  return 0;
+}
+
+static bool is_unmoved(struct obj *obj)
+{
+  return !obj->is_static && !obj->is_large && pool_is_marked(obj);
+}
+
+// Copies an object not moved yet into the new pages, leaving its new
+// address behind.
+static struct obj *copy(struct compactor *c, struct obj *obj)
+{
+  size_t size = obj_size(obj);
+  struct obj *moved = pool_alloc(&c->w->pool, size);
+  memcpy(moved, obj, size);
+
+  // A closed upvalue points to its own value.
+  if (obj->type == OBJ_UPVALUE) {
+    struct obj_upvalue *upvalue = (struct obj_upvalue *) obj;
+    if (upvalue->location == &upvalue->closed)
+      ((struct obj_upvalue *) moved)->location
+        = &((struct obj_upvalue *) moved)->closed;
+  }
+
+  size_t index = POOL_INDEX(obj);
+  POOL_PAGE_OF(obj)->marked[index / 64] &= ~((uint64_t) 1 << (index % 64));
+  memcpy(obj + 1, &moved, sizeof(moved));
+  return moved;
+}
+
+// Returns the new address of the object, moving it if needed. A large
+// object is scanned the first time it is found, and unmarked until the
+// compaction is done.
+static struct obj *relocate(struct compactor *c, struct obj *obj)
+{
+  if (obj == NULL || obj->is_static)
+    return obj;
+
+  if (obj->is_large) {
+    if (POOL_LARGE(obj)->is_marked) {
+      POOL_LARGE(obj)->is_marked = false;
+      unscanned_push(c, obj);
+    }
+
+    return obj;
+  }
+
+  if (!pool_is_marked(obj)) {
+    struct obj *moved;
+    memcpy(&moved, obj + 1, sizeof(moved));
+    return moved;
+  }
+
+  struct obj *moved = copy(c, obj);
+  unscanned_push(c, moved);
+  return moved;
+}
+
+static void relocate_value(struct compactor *c, Value *value)
+{
+  if (IS_OBJ(*value))
+    value->as.obj = relocate(c, AS_OBJ(*value));
+}
+
+// Updates the references of a pair. The rest of its list is moved first,
+// right after it, and only then the elements.
+static void scan_pair(struct compactor *c, struct obj_pair *pair)
+{
+  struct obj_pair *last = pair;
+
+  while (IS_PAIR(last->cdr) && is_unmoved(AS_OBJ(last->cdr))) {
+    struct obj *next = copy(c, AS_OBJ(last->cdr));
+    last->cdr.as.obj = next;
+    last = (struct obj_pair *) next;
+  }
+
+  relocate_value(c, &last->cdr);
+
+  for (;; pair = AS_PAIR(pair->cdr)) {
+    relocate_value(c, &pair->car);
+    if (pair == last)
+      break;
+  }
+}
+
+static void scan(struct compactor *c, struct obj *obj)
+{
+  switch (obj->type) {
+  case OBJ_ATOM:
+    break;
+  case OBJ_CLOSURE: {
+    struct obj_closure *closure = (struct obj_closure *) obj;
+    closure->lambda = (struct obj_lambda *) relocate(c,
+        (struct obj *) closure->lambda);
+
+    for (int i = 0; i < closure->upvalue_count; ++i)
+      closure->upvalues[i] = (struct obj_upvalue *) relocate(c,
+          (struct obj *) closure->upvalues[i]);
+    break;
+  }
+  case OBJ_LAMBDA: {
+    struct obj_lambda *lambda = (struct obj_lambda *) obj;
+
+    for (int i = 0; i < lambda->chunk.constants.count; ++i)
+      relocate_value(c, &lambda->chunk.constants.values[i]);
+
+    lambda->image = (struct obj_mapping *) relocate(c,
+        (struct obj *) lambda->image);
+    break;
+  }
+  case OBJ_NATIVE:
+    break;
+  case OBJ_UPVALUE:
+    relocate_value(c, &((struct obj_upvalue *) obj)->closed);
+    break;
+  case OBJ_PAIR:
+    scan_pair(c, (struct obj_pair *) obj);
+    break;
+  case OBJ_MAPPING:
+    break;
+  case OBJ_BYTES: {
+    struct obj_bytes *bytes = (struct obj_bytes *) obj;
+    bytes->mapping = (struct obj_mapping *) relocate(c,
+        (struct obj *) bytes->mapping);
+    break;
+  }
+  }
+}
+
+static void relocate_roots(struct compactor *c)
+{
+  struct wisp_state *w = c->w;
+
+  for (Value *slot = w->stack; slot < w->stack_top; ++slot)
+    relocate_value(c, slot);
+
+  for (int i = 0; i < w->globals.capacity; ++i) {
+    struct table_node *node = &w->globals.ht[i];
+    node->key = (struct obj_string *) relocate(c, (struct obj *) node->key);
+    relocate_value(c, &node->val);
+  }
+
+  w->pending_forms = (struct obj_lambda *) relocate(c,
+      (struct obj *) w->pending_forms);
+
+  // The interned atoms all survived the collection, and keep their slots,
+  // which only depend on their hashes.
+  if (w->str_pool.ht != NULL)
+    for (int i = 0; i < 1 << w->str_pool.exp; ++i)
+      w->str_pool.ht[i] = (struct obj_string *) relocate(c,
+          (struct obj *) w->str_pool.ht[i]);
+}
+
+// Whether C code of the state holds plain pointers to objects.
+static bool is_busy(struct wisp_state *w)
+{
+  return w->frame_count > 0 || w->open_upvalues != NULL
+    || w->compiler != NULL || w->reader != NULL;
+}
+
+// Whether the room left free on the pages, by the objects surviving the
+// collection just done, exceeds both their own size and a few pages.
+static bool is_fragmented(struct pool *p)
+{
+  size_t used = 0;
+  size_t capacity = 0;
+
+  for (struct pool_page *page = pool_next_page(p, NULL); page != NULL;
+      page = pool_next_page(p, page)) {
+    used += page->live * page->size;
+    capacity += POOL_PAGE_SIZE - sizeof(struct pool_page);
+  }
+
+  size_t room = capacity - used;
+  return room > used
+    && room > COMPACT_MIN_ROOM * (POOL_PAGE_SIZE - sizeof(struct pool_page));
+}
+
+// Moves the objects of a heap whose garbage has just been collected, so that
+// all objects left are marked, and none are remembered.
+static void compact(struct wisp_state *w)
+{
+  struct compactor c;
+  c.w = w;
+  c.from = w->pool;
+  c.unscanned = NULL;
+  c.unscanned_count = 0;
+  c.unscanned_capacity = 0;
+
+  pool_init(&w->pool);
+  w->pool.huge_pages = c.from.huge_pages;
+  w->pool.large = c.from.large;
+  c.from.large = NULL;
+
+  relocate_roots(&c);
+  while (c.unscanned_count > 0)
+    scan(&c, c.unscanned[--c.unscanned_count]);
+
+  // Nothing is left in the old pages, and the objects stay old.
+  pool_free(&c.from);
+
+  for (struct pool_page *page = pool_next_page(&w->pool, NULL);
+      page != NULL;
+      page = pool_next_page(&w->pool, page)) {
+    memcpy(page->marked, page->allocated, sizeof(page->marked));
+    page->has_young = false;
+  }
+
+  for (struct pool_large *large = w->pool.large; large != NULL;
+      large = large->next)
+    large->is_marked = true;
+
+  free(c.unscanned);
+}
+
+bool compact_heap(struct wisp_state *w)
+{
+  if (is_busy(w))
+    return false;
+
+  collect_garbage(w);
+  compact(w);
+  return true;
+}
+
+bool compact_if_fragmented(struct wisp_state *w)
+{
+  collect_garbage(w);
+
+  if (is_busy(w) || !is_fragmented(&w->pool))
+    return false;
+
+  compact(w);
+  return true;
+}
@@ -0,0 +1,22 @@
+#ifndef WISP_COMPACT_H
+#define WISP_COMPACT_H
+
+#include "common.h"
+#include "value.h"
+
+// Collects garbage, and moves the surviving objects of the pool pages to
+// fresh pages in depth-first order, the pairs of a list right after its
+// first one, so that traversing the lists walks memory sequentially. Large
+// and static objects stay in place. Only the objects reachable from the
+// state are moved, so the state must not be executing, compiling nor
+// reading anything, as the C code doing so holds plain pointers to objects.
+// Returns false, without doing anything, otherwise.
+bool compact_heap(struct wisp_state *);
+
+// Collects garbage, and then compacts the heap only if the objects surviving
+// the collection leave most of the room on their pages free, so that an
+// idle state is not compacted at the cost of copying the whole heap every
+// time. Returns whether the heap was compacted.
+bool compact_if_fragmented(struct wisp_state *);
+
+#endif
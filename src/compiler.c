@@ -2,28 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "compiler.h"
+#include "memory.h"
 #include "opcodes.h"
-#include "scanner.h"
+#include "state.h"
 #include "strpool.h"
 
-struct parser {
-  // Fetches tokens from the parsed string.
-  struct scanner *scanner;
-  
-  // The last consumed token.
-  struct token prev;
-
-  // The currently looked at but yet unconsumed token.
-  struct token curr;
-
-  // Is the parser currently in an error state?
-  bool panic_mode;
-
-  // Was there a parse error?
-  bool had_error;
-};
-
 struct local {
   // Token holding the local variable name.
   struct token name;
@@ -38,11 +23,29 @@ struct local {
 struct upvalue {
   // Index of the variable the upvalue closes over in the surrounding compiler
   // locals array (is_local == true) or upvalues array (is_local == false).
-  uint8_t index;
+  uint16_t index;
 
   // Does the upvalue close over a local variable in the surrounding scope or
   // over another upvalue?
   bool is_local;
+
+  // Name of the variable, needed to compile the lambda body lazily.
+  struct token name;
+};
+
+struct lazy_body {
+  // Start of the parameter list of the lambda, followed by its body.
+  const char *start;
+
+  // Line the parameter list starts at.
+  int line;
+
+  // Names of the variables the lambda closes over, in the order of its
+  // upvalues. They point to the source, just like tokens.
+  struct token *upvalue_names;
+
+  // Number of the upvalue names.
+  int upvalue_count;
 };
 
 struct compiler {
@@ -52,23 +55,63 @@ struct compiler {
   // The immediately surrounding compiler (or NULL if in global scope).
   struct compiler *enclosing;
 
+  // The compiler of the lambda being compiled inside this one (or NULL).
+  struct compiler *nested;
+
   // Parser object shared between all compilers.
   struct parser *parser;
 
   // Currently compiled lambda (or NULL if in global scope).
   struct obj_lambda *lambda;
 
+  // Bytecode of the currently compiled lambda. Like all the arrays below, it
+  // is allocated from the compile arena, and only copied into the lambda once
+  // complete, so that the lambda never holds a partially written chunk.
+  struct chunk chunk;
+
   // Local variables defined in the currently compiled lambda.
-  struct local locals[UINT8_COUNT];
+  struct local *locals;
+
+  // Capacity of the 'locals' array.
+  int local_capacity;
 
   // Upvalues defined in the currently compiled lambda.
-  struct upvalue upvalues[UINT8_COUNT];
+  struct upvalue *upvalues;
+
+  // Capacity of the 'upvalues' array.
+  int upvalue_capacity;
 
   // Number of local variables defined in the currently compiled lambda.
   int local_count;
 
+  // Open-addressed hash index of the lambda constants. Each slot holds
+  // a constant index plus one, so that zero marks an unoccupied slot.
+  int *constant_index;
+
+  // Capacity of the 'constant_index' array, always a power of two.
+  int constant_index_capacity;
+
   // How many scopes away from the global scope (= 0).
   int scope_depth;
+
+  // Number of values on the stack at the current point of the lambda body,
+  // counting the called closure and the arguments.
+  int stack_depth;
+
+  // Most values on the stack at any point of the lambda body so far.
+  int stack_size;
+
+  // Values of the quoted datum being read, kept reachable by the garbage
+  // collector while its pairs are allocated.
+  Value *data;
+
+  // Number of the values.
+  int data_count;
+
+  // If compiling a lazy lambda body, the lambda source. Variables that are
+  // not local are then resolved against its upvalue names instead of the
+  // (no longer existing) enclosing compilers.
+  struct lazy_body *lazy;
 };
 
 static void parser_init(struct parser *p, struct scanner *sc)
@@ -78,16 +121,77 @@ static void parser_init(struct parser *p, struct scanner *sc)
   p->had_error = false;
 }
 
+// Accounts for the values the instructions just emitted push onto the stack
+// (or pop off it, if negative).
+static void stack_effect(struct compiler *c, int effect)
+{
+  c->stack_depth += effect;
+
+  if (c->stack_depth > c->stack_size)
+    c->stack_size = c->stack_depth;
+}
+
+// Starts the body of the lambda, with the closure and the arguments on the
+// stack, as they are the first locals.
+static void stack_begin(struct compiler *c)
+{
+  c->stack_depth = 0;
+  stack_effect(c, c->local_count);
+}
+
 static void compiler_init(struct compiler *c, struct wisp_state *w,
-    struct compiler *enclosing, struct parser *p)
+    struct compiler *enclosing, struct parser *p, struct obj_lambda *lambda)
 {
   c->w = w;
   c->enclosing = enclosing;
+  c->nested = NULL;
   c->parser = p;
   c->lambda = NULL;
+  chunk_init(&c->chunk);
+  c->locals = NULL;
+  c->local_capacity = 0;
+  c->upvalues = NULL;
+  c->upvalue_capacity = 0;
   c->local_count = 0;
+  c->constant_index = NULL;
+  c->constant_index_capacity = 0;
   c->scope_depth = 0;
-  c->lambda = lambda_new(c->w);
+  c->stack_depth = 0;
+  c->stack_size = 0;
+  c->data = NULL;
+  c->data_count = 0;
+  c->lazy = NULL;
+
+  // Register the compiler before allocating anything, so that its lambda is
+  // reachable by the garbage collector for the whole compilation.
+  w->compiler = c;
+  if (enclosing != NULL)
+    enclosing->nested = c;
+  c->lambda = lambda != NULL ? lambda : lambda_new(c->w);
+
+  // The first slot of every call frame holds the called closure. Claim it
+  // with an unnamed local, so that the parameters start at slot 1.
+  c->local_capacity = GROW_CAPACITY(0);
+  c->locals = ARENA_ALLOCATE(&w->compile_arena, struct local,
+      c->local_capacity);
+
+  struct local *local = &c->locals[c->local_count++];
+  local->name.start = "";
+  local->name.len = 0;
+  local->depth = 0;
+  local->is_captured = false;
+  stack_begin(c);
+}
+
+static void compiler_free(struct compiler *c)
+{
+  c->w->compiler = c->enclosing;
+
+  if (c->enclosing != NULL)
+    c->enclosing->nested = NULL;
+  else
+    // The whole compilation is done, nothing in the arena is needed anymore.
+    arena_reset(&c->w->compile_arena);
 }
 
 static void error_at(struct parser *p, struct token tok, const char *msg)
@@ -157,7 +261,34 @@ static bool match(struct parser *p, enum token_type type)
 
 static void emit_byte(struct compiler *c, uint8_t byte)
 {
-  chunk_write(c->w, &c->lambda->chunk, byte, c->parser->prev.line);
+  struct chunk *chunk = &c->chunk;
+  struct arena *arena = &c->w->compile_arena;
+  int line = c->parser->prev.line;
+
+  if (chunk->count >= chunk->capacity) {
+    int old_capacity = chunk->capacity;
+    chunk->capacity = GROW_CAPACITY(old_capacity);
+    chunk->code = ARENA_GROW_ARRAY(arena, uint8_t, chunk->code, old_capacity,
+        chunk->capacity);
+  }
+
+  chunk->code[chunk->count] = byte;
+
+  if (chunk->line_count == 0
+      || chunk->lines[chunk->line_count - 1].line != line) {
+    if (chunk->line_count >= chunk->line_capacity) {
+      int old_capacity = chunk->line_capacity;
+      chunk->line_capacity = GROW_CAPACITY(old_capacity);
+      chunk->lines = ARENA_GROW_ARRAY(arena, struct line_run, chunk->lines,
+          old_capacity, chunk->line_capacity);
+    }
+
+    chunk->lines[chunk->line_count].offset = chunk->count;
+    chunk->lines[chunk->line_count].line = line;
+    chunk->line_count++;
+  }
+
+  chunk->count++;
 }
 
 static void emit_bytes(struct compiler *c, uint8_t byte1, uint8_t byte2)
@@ -166,21 +297,316 @@ static void emit_bytes(struct compiler *c, uint8_t byte1, uint8_t byte2)
   emit_byte(c, byte2);
 }
 
-static uint8_t make_constant(struct compiler *c, Value v)
+static void emit_short(struct compiler *c, uint16_t operand)
+{
+  emit_byte(c, (operand >> 8) & 0xFF);
+  emit_byte(c, operand & 0xFF);
+}
+
+static void emit_long(struct compiler *c, uint32_t operand)
+{
+  emit_byte(c, (operand >> 16) & 0xFF);
+  emit_byte(c, (operand >> 8) & 0xFF);
+  emit_byte(c, operand & 0xFF);
+}
+
+// Emits an instruction referencing the constant at the given index, choosing
+// the _LONG variant if the index does not fit in a byte.
+static void emit_constant_op(struct compiler *c, uint8_t op, uint8_t op_long,
+    int constant)
+{
+  if (constant <= UINT8_MAX)
+    emit_bytes(c, op, (uint8_t) constant);
+  else {
+    emit_byte(c, op_long);
+    emit_long(c, (uint32_t) constant);
+  }
+}
+
+// Emits an instruction referencing the upvalue slot at the given index,
+// choosing the _LONG variant if the index does not fit in a byte.
+static void emit_slot_op(struct compiler *c, uint8_t op, uint8_t op_long,
+    int slot)
+{
+  if (slot <= UINT8_MAX)
+    emit_bytes(c, op, (uint8_t) slot);
+  else {
+    emit_byte(c, op_long);
+    emit_short(c, (uint16_t) slot);
+  }
+}
+
+static uint64_t constant_hash(Value v)
+{
+  uint64_t bits = 0;
+
+  if (IS_NUM(v))
+    memcpy(&bits, &AS_NUM(v), sizeof(bits));
+  else if (IS_OBJ(v))
+    bits = (uint64_t) (uintptr_t) AS_OBJ(v);
+
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccd;
+  return bits ^ bits >> 33;
+}
+
+static bool constants_equal(Value a, Value b)
 {
-  int constant = chunk_add_constant(c->w, &c->lambda->chunk, v);
+  if (a.type != b.type)
+    return false;
 
-  if (constant > UINT8_MAX) {
+  switch (a.type) {
+  case VAL_NIL:
+    return true;
+  case VAL_NUM:
+    // Compare the representation, so that 0 and -0 stay distinct.
+    return memcmp(&AS_NUM(a), &AS_NUM(b), sizeof(double)) == 0;
+  case VAL_OBJ:
+    return AS_OBJ(a) == AS_OBJ(b);
+  }
+
+  return false;
+}
+
+// Returns the index slot where the constant is, or where it should be
+// inserted if it is not yet present.
+static int *find_constant(struct compiler *c, Value v)
+{
+  struct value_array *constants = &c->chunk.constants;
+  uint32_t mask = (uint32_t) c->constant_index_capacity - 1;
+
+  for (uint32_t i = constant_hash(v) & mask;; i = (i + 1) & mask) {
+    int *slot = &c->constant_index[i];
+
+    if (*slot == 0 || constants_equal(constants->values[*slot - 1], v))
+      return slot;
+  }
+}
+
+static void grow_constant_index(struct compiler *c)
+{
+  struct value_array *constants = &c->chunk.constants;
+
+  c->constant_index_capacity = GROW_CAPACITY(c->constant_index_capacity);
+  c->constant_index = ARENA_ALLOCATE(&c->w->compile_arena, int,
+      c->constant_index_capacity);
+  memset(c->constant_index, 0, sizeof(int) * c->constant_index_capacity);
+
+  for (int i = 0; i < constants->count; ++i)
+    *find_constant(c, constants->values[i]) = i + 1;
+}
+
+static int make_constant(struct compiler *c, Value v)
+{
+  struct value_array *constants = &c->chunk.constants;
+
+  if (2 * (constants->count + 1) > c->constant_index_capacity)
+    // Resize at 50% load.
+    grow_constant_index(c);
+
+  int *slot = find_constant(c, v);
+  int constant = *slot - 1;
+
+  if (*slot == 0) {
+    // Growing the arena never triggers a GC, and the value is reachable
+    // through the compiler from now on.
+    if (constants->count >= constants->capacity) {
+      int old_capacity = constants->capacity;
+      constants->capacity = GROW_CAPACITY(old_capacity);
+      constants->values = ARENA_GROW_ARRAY(&c->w->compile_arena, Value,
+          constants->values, old_capacity, constants->capacity);
+    }
+
+    constant = constants->count++;
+    constants->values[constant] = v;
+    WRITE_BARRIER(c->w, &c->lambda->obj);
+    *slot = constant + 1;
+  }
+
+  if (constant > UINT24_MAX) {
     error(c->parser, "Too many constants in one chunk");
     return 0;
   }
 
-  return (uint8_t) constant;
+  return constant;
 }
 
 static void emit_constant(struct compiler *c, Value v)
 {
-  emit_bytes(c, OP_CONSTANT, make_constant(c, v));
+  emit_constant_op(c, OP_CONSTANT, OP_CONSTANT_LONG, make_constant(c, v));
+}
+
+static int instruction_length(struct chunk *chunk, int offset)
+{
+  switch (chunk->code[offset]) {
+  case OP_NIL:
+  case OP_RETURN:
+  case OP_POP:
+  case OP_CONS:
+  case OP_CAR:
+  case OP_CDR:
+  case OP_CADR:
+  case OP_CDDR:
+    return 1;
+  case OP_CONSTANT:
+  case OP_CALL:
+  case OP_DOT_CALL:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL_CAR:
+  case OP_GET_LOCAL_CDR:
+  case OP_LIST:
+    return 2;
+  case OP_GET_UPVALUE_LONG:
+  case OP_GET_GLOBAL_CALL:
+    return 3;
+  case OP_CONSTANT_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_GLOBAL_LONG:
+    return 4;
+  case OP_CLOSURE: {
+    Value lambda = chunk->constants.values[chunk->code[offset + 1]];
+    return 2 + 3 * AS_LAMBDA(lambda)->upvalue_count;
+  }
+  case OP_CLOSURE_LONG: {
+    uint32_t constant = (chunk->code[offset + 1] << 16)
+                      | (chunk->code[offset + 2] << 8)
+                      | chunk->code[offset + 3];
+    Value lambda = chunk->constants.values[constant];
+    return 4 + 3 * AS_LAMBDA(lambda)->upvalue_count;
+  }
+  }
+
+  return 1;
+}
+
+// Rewrites the finished chunk in place, replacing opcode sequences with
+// the superinstructions they are equivalent to. As there are no jumps, no
+// offsets need to be patched, and since every superinstruction is shorter
+// than the sequence it replaces, the chunk only ever shrinks.
+static void fuse_superinstructions(struct chunk *chunk)
+{
+  uint8_t *code = chunk->code;
+  struct line_run *runs = chunk->lines;
+  int from = 0;
+  int to = 0;
+
+  // The line run containing 'from', and the number of rewritten line runs.
+  // A fused instruction takes the line of its first instruction. Rewritten
+  // runs never overtake the one being read, as there is at most one per
+  // original run.
+  int run = 0;
+  int run_count = 0;
+
+  while (from < chunk->count) {
+    int len = instruction_length(chunk, from);
+    int next = from + len;
+    uint8_t next_op = next < chunk->count ? code[next] : OP_RETURN;
+
+    while (run + 1 < chunk->line_count && runs[run + 1].offset <= from)
+      run++;
+
+    int line = runs[run].line;
+
+    if (run_count == 0 || runs[run_count - 1].line != line) {
+      runs[run_count].offset = to;
+      runs[run_count].line = line;
+      run_count++;
+    }
+
+    switch (code[from]) {
+    case OP_GET_LOCAL:
+      if (next_op != OP_CAR && next_op != OP_CDR)
+        break;
+
+      code[to + 1] = code[from + 1];
+      code[to] = next_op == OP_CAR ? OP_GET_LOCAL_CAR : OP_GET_LOCAL_CDR;
+      to += 2;
+      from = next + 1;
+      continue;
+    case OP_CDR:
+      if (next_op != OP_CAR && next_op != OP_CDR)
+        break;
+
+      code[to++] = next_op == OP_CAR ? OP_CADR : OP_CDDR;
+      from = next + 1;
+      continue;
+    case OP_GET_GLOBAL:
+      if (next_op != OP_CALL)
+        break;
+
+      code[to + 1] = code[from + 1];
+      code[to + 2] = code[next + 1];
+      code[to] = OP_GET_GLOBAL_CALL;
+      to += 3;
+      from = next + 2;
+      continue;
+    case OP_NIL: {
+      int count = 0;
+
+      while (count < UINT8_MAX && next + count < chunk->count
+          && code[next + count] == OP_CONS)
+        count++;
+
+      if (count == 0)
+        break;
+
+      code[to] = OP_LIST;
+      code[to + 1] = (uint8_t) count;
+      to += 2;
+      from = next + count;
+      continue;
+    }
+    }
+
+    // Not the start of a fused sequence, copy the instruction as it is.
+    memmove(&code[to], &code[from], len);
+    to += len;
+    from += len;
+  }
+
+  chunk->count = to;
+  chunk->line_count = run_count;
+}
+
+// Finishes the compilation of the current lambda body.
+static void end_lambda(struct compiler *c)
+{
+  emit_byte(c, OP_RETURN);
+
+#ifdef DEBUG_PROFILE_OPCODES
+  // Profile the plain instructions the superinstructions are selected from.
+  bool fuse = false;
+#else
+  bool fuse = !c->parser->had_error;
+#endif
+
+  if (fuse)
+    fuse_superinstructions(&c->chunk);
+
+  // Copy the complete chunk out of the arena at its exact size. Until it is
+  // in the lambda, its constants are kept reachable by the compiler.
+  struct chunk *from = &c->chunk;
+  uint8_t *code = ALLOCATE(c->w, uint8_t, from->count);
+  struct line_run *lines = ALLOCATE(c->w, struct line_run, from->line_count);
+  Value *values = ALLOCATE(c->w, Value, from->constants.count);
+
+  memcpy(code, from->code, from->count);
+  memcpy(lines, from->lines, sizeof(struct line_run) * from->line_count);
+  if (from->constants.count > 0)
+    memcpy(values, from->constants.values,
+        sizeof(Value) * from->constants.count);
+
+  struct chunk *chunk = &c->lambda->chunk;
+  chunk->code = code;
+  chunk->count = chunk->capacity = from->count;
+  chunk->lines = lines;
+  chunk->line_count = chunk->line_capacity = from->line_count;
+  chunk->constants.values = values;
+  chunk->constants.count = chunk->constants.capacity = from->constants.count;
+  c->lambda->stack_size = c->stack_size;
 }
 
 static void synchronize(struct parser *p)
@@ -195,7 +621,7 @@ static void synchronize(struct parser *p)
   }
 }
 
-static uint8_t atom(struct compiler *c, struct token *name)
+static int atom(struct compiler *c, struct token *name)
 {
   struct obj_string *atom = str_pool_intern(c->w, name->start, name->len);
   return make_constant(c, OBJ_VAL(atom));
@@ -213,11 +639,20 @@ static void scope_begin(struct compiler *c)
 
 static void add_local(struct compiler *c, struct token name)
 {
+  // The locals are the called closure and at most UINT8_MAX parameters, so
+  // their slots always fit in a byte.
   if (c->local_count == UINT8_COUNT) {
     error(c->parser, "Too many local variables in this function");
     return;
   }
 
+  if (c->local_count >= c->local_capacity) {
+    int old_capacity = c->local_capacity;
+    c->local_capacity = GROW_CAPACITY(old_capacity);
+    c->locals = ARENA_GROW_ARRAY(&c->w->compile_arena, struct local,
+        c->locals, old_capacity, c->local_capacity);
+  }
+
   struct local *local = &c->locals[c->local_count++];
   local->name = name;
   local->depth = -1;
@@ -246,7 +681,7 @@ static void declare_variable(struct compiler *c)
   add_local(c, *name);
 }
 
-static void define_variable(struct compiler *c, uint8_t global)
+static void define_variable(struct compiler *c, int global)
 {
   if (c->scope_depth > 0) {
     // Local scope.
@@ -254,10 +689,15 @@ static void define_variable(struct compiler *c, uint8_t global)
     return;
   }
 
-  emit_bytes(c, OP_DEFINE_GLOBAL, global);
+  emit_constant_op(c, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
+  stack_effect(c, -1);
+
+  // A global definition evaluates to nil.
+  emit_byte(c, OP_NIL);
+  stack_effect(c, 1);
 }
 
-static uint8_t read_identifier(struct compiler *c, const char *msg)
+static int read_identifier(struct compiler *c, const char *msg)
 {
   consume(c->parser, TOKEN_IDENTIFIER, msg);
   declare_variable(c);
@@ -268,14 +708,7 @@ static uint8_t read_identifier(struct compiler *c, const char *msg)
   return atom(c, &c->parser->prev);
 }
 
-static void sexp(struct compiler *, bool);
-
-static void define(struct compiler *c)
-{
-  uint8_t global = read_identifier(c, "Expect identifier after 'define'"); // a
-  sexp(c, false);  // b
-  define_variable(c, global);  // (define a b)
-}
+static void skip_body(struct compiler *);
 
 /*
  * TODO
@@ -287,152 +720,139 @@ static void define(struct compiler *c)
  * ((lambda (x y . z) (list x y z)) . '(1 2 3)) -> (1 2 (3))
  * ((lambda (x y . z) (list x y z)) 1 2 . '(3)) -> (1 2 (3))
  */
-static void lambda(struct compiler *c)
+static void parameters(struct compiler *inner)
 {
-  struct compiler inner;
-  compiler_init(&inner, c->w, c, c->parser);
-  scope_begin(&inner);
-
-  if (match(inner.parser, TOKEN_LEFT_PAREN)) {
+  if (match(inner->parser, TOKEN_LEFT_PAREN)) {
     // (lambda (p1 p2 ... pn) expr) or (lambda (p1 p2 ... pn . params) expr)
-    while (!check(inner.parser, TOKEN_RIGHT_PAREN)
-        && !check(inner.parser, TOKEN_DOT)
-        && !check(inner.parser, TOKEN_EOF)) {
-      inner.lambda->arity++;
+    while (!check(inner->parser, TOKEN_RIGHT_PAREN)
+        && !check(inner->parser, TOKEN_DOT)
+        && !check(inner->parser, TOKEN_EOF)) {
+      inner->lambda->arity++;
 
-      if (inner.lambda->arity > UINT8_MAX)
-        error_at_current(inner.parser,
+      if (inner->lambda->arity > UINT8_MAX)
+        error_at_current(inner->parser,
             "Can't have more than " XSTR(UINT8_MAX) " parameters");
 
-      uint8_t constant = read_identifier(&inner, "Expect parameter name");
-      define_variable(&inner, constant);
+      int constant = read_identifier(inner, "Expect parameter name");
+      define_variable(inner, constant);
     }
 
-    if (match(inner.parser, TOKEN_DOT)) {
+    if (match(inner->parser, TOKEN_DOT)) {
       // (lambda (p1 p2 ... pn . params) expr)
-      inner.lambda->arity++;
+      inner->lambda->arity++;
 
-      if (inner.lambda->arity > UINT8_MAX)
-        error_at_current(inner.parser,
+      if (inner->lambda->arity > UINT8_MAX)
+        error_at_current(inner->parser,
             "Can't have more than " XSTR(UINT8_MAX) " parameters, "
             "including the dotted one");
 
-      uint8_t constant = read_identifier(&inner, "Expect parameter list name");
-      define_variable(&inner, constant);
-      inner.lambda->has_param_list = true;
+      int constant = read_identifier(inner, "Expect parameter list name");
+      define_variable(inner, constant);
+      inner->lambda->has_param_list = true;
     }
 
-    consume(inner.parser, TOKEN_RIGHT_PAREN,
+    consume(inner->parser, TOKEN_RIGHT_PAREN,
         "Expect ')' at the end of a parameter list");
   } else {
     // (lambda params expr), equivalent to (lambda ( . params) expr)
-    inner.lambda->arity++;
-    uint8_t constant = read_identifier(&inner, "Expect parameter list name");
-    define_variable(&inner, constant);
-    inner.lambda->has_param_list = true;
+    inner->lambda->arity++;
+    int constant = read_identifier(inner, "Expect parameter list name");
+    define_variable(inner, constant);
+    inner->lambda->has_param_list = true;
   }
+}
 
-  // Compile function body.
-  sexp(&inner, false);
-
-  // Emit a return opcode.
-  emit_byte(&inner, OP_RETURN);
-
-  // At this point, the lambda is compiled and the 'inner' compiler done.
-  struct obj_lambda *lambda = inner.lambda;
+// Emits the closure of a lambda whose body is done into the enclosing
+// compiler, and frees the compiler of the body.
+static void closure(struct compiler *inner)
+{
+  struct compiler *c = inner->enclosing;
+  struct obj_lambda *lambda = inner->lambda;
 
-  emit_bytes(c, OP_CLOSURE, make_constant(c, OBJ_VAL(lambda)));
+  emit_constant_op(c, OP_CLOSURE, OP_CLOSURE_LONG,
+      make_constant(c, OBJ_VAL(lambda)));
+  stack_effect(c, 1);
 
   for (int i = 0; i < lambda->upvalue_count; ++i) {
-    emit_byte(c, inner.upvalues[i].is_local ? 1 : 0);
-    emit_byte(c, inner.upvalues[i].index);
+    emit_byte(c, inner->upvalues[i].is_local ? 1 : 0);
+    emit_short(c, inner->upvalues[i].index);
   }
-}
 
-static void cons(struct compiler *c)
-{
-  sexp(c, false);  // a
-  sexp(c, false);  // b
-  emit_byte(c, OP_CONS);  // (cons a b)
+  compiler_free(inner);
 }
 
-static void car(struct compiler *c)
+// Starts a lambda, returning the compiler of its body, or NULL if the body
+// is left to be compiled lazily and the lambda is already done.
+static struct compiler *lambda(struct compiler *c)
 {
-  sexp(c, false);  // a
-  emit_byte(c, OP_CAR);  // (car a)
-}
+  // Compiler frames live on the heap, so that the nesting depth of lambdas
+  // is not limited by the C stack.
+  struct compiler *inner = ARENA_ALLOCATE(&c->w->compile_arena,
+      struct compiler, 1);
+  compiler_init(inner, c->w, c, c->parser, NULL);
+  scope_begin(inner);
 
-static void cdr(struct compiler *c)
-{
-  sexp(c, false);  // a
-  emit_byte(c, OP_CDR);  // (cdr a)
-}
+  const char *start = c->parser->curr.start;
+  int line = c->parser->curr.line;
 
-static void primitive(struct compiler *c)
-{
-  if (match(c->parser, TOKEN_DEFINE))
-    define(c);
-  else if (match(c->parser, TOKEN_LAMBDA))
-    lambda(c);
-  else if (match(c->parser, TOKEN_CONS))
-    cons(c);
-  else if (match(c->parser, TOKEN_CAR))
-    car(c);
-  else if (match(c->parser, TOKEN_CDR))
-    cdr(c);
-  else
-    // Should never happen as long as all primitive tokens are between
-    // 'PRIMITIVE_START' and 'PRIMITIVE_END'.
-    error_at_current(c->parser, "Unknown primitive");
-}
+  parameters(inner);
+  stack_begin(inner);
 
-static void call(struct compiler *c)
-{
-  // Compile the function being called.
-  sexp(c, false);
+  if (!c->w->lazy_compile)
+    return inner;
 
-  uint8_t opcode = OP_CALL;
-  uint8_t arg_count = 0;
+  // Only find the variables the body closes over, and compile it later.
+  skip_body(inner);
 
-  // Compile the function arguments.
-  while (!check(c->parser, TOKEN_RIGHT_PAREN)
-      && !check(c->parser, TOKEN_DOT)
-      && !check(c->parser, TOKEN_EOF)) {
-    sexp(c, false);
+  struct lazy_body *lazy = ALLOCATE(c->w, struct lazy_body, 1);
+  lazy->start = start;
+  lazy->line = line;
+  lazy->upvalue_count = inner->lambda->upvalue_count;
+  lazy->upvalue_names = ALLOCATE(c->w, struct token, lazy->upvalue_count);
 
-    if (arg_count == UINT8_MAX)
-      error(c->parser, "Can't have more than " XSTR(UINT8_MAX) " arguments");
+  for (int i = 0; i < lazy->upvalue_count; ++i)
+    lazy->upvalue_names[i] = inner->upvalues[i].name;
 
-    arg_count++;
-  }
+  inner->lambda->lazy = lazy;
+  closure(inner);
+  return NULL;
+}
 
-  // Compile the optional dotted argument, which, for a function call,
-  // must be a quoted list (or an identifier associated with one).
-  if (match(c->parser, TOKEN_DOT)) {
-    opcode = OP_DOT_CALL;
-    sexp(c, false);
+// Accounts for a call, which leaves only its result in place of the called
+// closure and the arguments. The elements of the list a dotted call is
+// applied to are spread onto the stack first, as further arguments.
+static void call_stack_effect(struct compiler *c, uint8_t opcode,
+    uint8_t arg_count)
+{
+  if (opcode == OP_DOT_CALL) {
+    stack_effect(c, UINT8_MAX - arg_count - 1);
+    arg_count = UINT8_MAX;
   }
 
-  emit_bytes(c, opcode, arg_count);
+  stack_effect(c, -arg_count);
 }
 
-static int resolve_local(struct compiler *c, struct token *name)
+static int find_local(struct compiler *c, struct token *name)
 {
-  for (int i = c->local_count - 1; i >= 0; --i) {
-    struct local *local = &c->locals[i];
-
-    if (identifiers_equal(name, &local->name)) {
-      if (local->depth == -1)
-        error(c->parser, "Can't read a variable in its own initializer");
-
+  for (int i = c->local_count - 1; i >= 0; --i)
+    if (identifiers_equal(name, &c->locals[i].name))
       return i;
-    }
-  }
 
   return -1;
 }
 
-static int add_upvalue(struct compiler *c, uint8_t index, bool is_local)
+static int resolve_local(struct compiler *c, struct token *name)
+{
+  int i = find_local(c, name);
+
+  if (i != -1 && c->locals[i].depth == -1)
+    error(c->parser, "Can't read a variable in its own initializer");
+
+  return i;
+}
+
+static int add_upvalue(struct compiler *c, uint16_t index, bool is_local,
+    struct token *name)
 {
   int upvalue_count = c->lambda->upvalue_count;
 
@@ -444,130 +864,528 @@ static int add_upvalue(struct compiler *c, uint8_t index, bool is_local)
       return i;
   }
 
-  if (upvalue_count == UINT8_COUNT) {
+  if (upvalue_count == UINT16_COUNT) {
     error(c->parser, "Too many closure variables in function");
     return 0;
   }
 
+  if (upvalue_count >= c->upvalue_capacity) {
+    int old_capacity = c->upvalue_capacity;
+    c->upvalue_capacity = GROW_CAPACITY(old_capacity);
+    c->upvalues = ARENA_GROW_ARRAY(&c->w->compile_arena, struct upvalue,
+        c->upvalues, old_capacity, c->upvalue_capacity);
+  }
+
   c->upvalues[upvalue_count].is_local = is_local;
   c->upvalues[upvalue_count].index = index;
+  c->upvalues[upvalue_count].name = *name;
   return c->lambda->upvalue_count++;
 }
 
 static int resolve_upvalue(struct compiler *c, struct token *name)
 {
-  // The function is called after attempting to resolve the variable in
-  // the current function scope, so we start at the enclosing compiler.
-  if (c->enclosing == NULL)
+  // Find the closest enclosing compiler the variable is local to. The
+  // compilers are walked rather than recursed into, so that the nesting
+  // depth of lambdas is not limited by the C stack.
+  struct compiler *e = c;
+  int index = -1;
+
+  for (; e->enclosing != NULL; e = e->enclosing)
+    if ((index = resolve_local(e->enclosing, name)) != -1)
+      break;
+
+  if (index != -1) {
+    // Found the variable as local in the enclosing compiler.
+    e->enclosing->locals[index].is_captured = true;
+    index = add_upvalue(e, (uint16_t) index, true, name);
+  } else if (e->lazy != NULL)
+    // A lazily compiled body knows which variables it closes over.
+    for (int i = 0; i < e->lazy->upvalue_count && index == -1; ++i)
+      if (identifiers_equal(name, &e->lazy->upvalue_names[i]))
+        index = i;
+
+  if (index == -1)
     // Reached the outermost function without finding a local variable, so it
     // must be global (or undefined).
     return -1;
 
-  int local = resolve_local(c->enclosing, name);
-  if (local != -1) {
-    // Found the variable as local in the enclosing compiler.
-    c->enclosing->locals[local].is_captured = true;
-    return add_upvalue(c, (uint8_t) local, true);
+  // Every lambda nested in between closes over the upvalue of the lambda
+  // enclosing it.
+  while (e != c) {
+    e = e->nested;
+    index = add_upvalue(e, (uint16_t) index, false, name);
   }
 
-  int upvalue = resolve_upvalue(c->enclosing, name);
-  if (upvalue != -1)
-    // Found the variable as local in a non-directly enclosing compiler.
-    return add_upvalue(c, (uint8_t) upvalue, false);
-
-  return -1;
+  return index;
 }
 
 static void identifier(struct compiler *c)
 {
-  uint8_t get_op;
   struct token *name = &c->parser->prev;
   int arg = resolve_local(c, name);
 
   if (arg != -1)
     // Local scope.
-    get_op = OP_GET_LOCAL;
+    emit_bytes(c, OP_GET_LOCAL, (uint8_t) arg);
   else if ((arg = resolve_upvalue(c, name)) != -1)
     // Outer scope.
-    get_op = OP_GET_UPVALUE;
-  else {
+    emit_slot_op(c, OP_GET_UPVALUE, OP_GET_UPVALUE_LONG, arg);
+  else
     // Global scope.
-    arg = atom(c, name);
-    get_op = OP_GET_GLOBAL;
+    emit_constant_op(c, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, atom(c, name));
+
+  stack_effect(c, 1);
+}
+
+// Closes over the variable if it is local to any of the enclosing lambdas.
+// Used instead of 'identifier' when skipping a lambda body to be compiled
+// lazily, so it captures too much rather than too little, and leaves all
+// error reporting to the eventual compilation of the body.
+static void capture_variable(struct compiler *c, struct token *name)
+{
+  if (find_local(c, name) != -1)
+    return;
+
+  for (struct compiler *e = c->enclosing; e != NULL; e = e->enclosing) {
+    int local = find_local(e, name);
+
+    if (local == -1)
+      continue;
+
+    if (e->locals[local].depth == -1)
+      // A variable read in its own initializer.
+      return;
+
+    break;
   }
 
-  emit_bytes(c, get_op, (uint8_t) arg);
+  resolve_upvalue(c, name);
+}
+
+// Consumes a lambda body without compiling it, only checking that the
+// parentheses are balanced and capturing the variables it closes over.
+static void skip_body(struct compiler *c)
+{
+  struct parser *p = c->parser;
+  int depth = 0;
+
+  // Depth at which the currently skipped quoted datum starts (or -1).
+  int quote_depth = -1;
+
+  for (;;) {
+    if (match(p, TOKEN_QUOTE)) {
+      if (quote_depth == -1)
+        quote_depth = depth;
+
+      continue;
+    }
+
+    if (match(p, TOKEN_LEFT_PAREN)) {
+      depth++;
+      continue;
+    }
+
+    if (check(p, TOKEN_EOF) && depth > 0) {
+      error_at_current(p, "Expect ')' at the end of a list");
+      return;
+    }
+
+    if (depth == 0 && !check(p, TOKEN_IDENTIFIER) && !check(p, TOKEN_NUMBER)) {
+      error_at_current(p, "Unexpected token");
+      return;
+    }
+
+    advance(p);
+
+    if (p->prev.type == TOKEN_RIGHT_PAREN)
+      depth--;
+    else if (p->prev.type == TOKEN_IDENTIFIER) {
+      if (quote_depth == -1)
+        capture_variable(c, &p->prev);
+    } else if (p->prev.type != TOKEN_NUMBER)
+      // Dots and primitives do not complete a datum.
+      continue;
+
+    if (quote_depth == depth)
+      quote_depth = -1;
+
+    if (depth == 0)
+      return;
+  }
 }
 
 static void number(struct compiler *c)
 {
   double value = strtod(c->parser->prev.start, NULL);
   emit_constant(c, NUM_VAL(value));
+  stack_effect(c, 1);
 }
 
-static void list(struct compiler *c)
+// A list of quoted data being read.
+struct list_frame {
+  // Index of the first element of the list among the data of the compiler.
+  int start;
+
+  // Whether the dotted tail of the list is being read.
+  bool is_dotted;
+};
+
+static void data_push(struct compiler *c, int *capacity, Value value)
 {
-  if (check(c->parser, TOKEN_RIGHT_PAREN))
-    // '() evaluates to nil.
-    emit_byte(c, OP_NIL);
-  else if (match(c->parser, TOKEN_DOT))
-    // '( . a) evaluates to a
-    sexp(c, true);
-  else {
-    int elements = 0;
+  if (c->data_count >= *capacity) {
+    int old_capacity = *capacity;
+    *capacity = GROW_CAPACITY(old_capacity);
+    c->data = ARENA_GROW_ARRAY(&c->w->compile_arena, Value, c->data,
+        old_capacity, *capacity);
+  }
+
+  c->data[c->data_count++] = value;
+}
 
-    while (!check(c->parser, TOKEN_RIGHT_PAREN)
-        && !check(c->parser, TOKEN_DOT)
-        && !check(c->parser, TOKEN_EOF)) {
-      sexp(c, true);
-      elements++;
+// Replaces the elements of a list read, followed by its tail, with the list.
+// The list is built from its tail, which stays among the data, so that it is
+// reachable while the pairs are allocated.
+static void data_build_list(struct compiler *c, int start)
+{
+  Value *tail = &c->data[c->data_count - 1];
+
+  for (Value *element = tail - 1; element >= c->data + start; --element)
+    *tail = OBJ_VAL(pair_new(c->w, *element, *tail));
+
+  c->data[start] = *tail;
+  c->data_count = start + 1;
+}
+
+// Compiles a quoted datum. A list is built while it is read, and becomes
+// a single constant, so that evaluating it neither allocates nor needs any
+// stack, however long the list is. Nested lists are tracked on an explicit
+// stack rather than by recursion, so that arbitrarily deep data can be
+// compiled without exhausting the C stack.
+static void datum(struct compiler *c)
+{
+  struct list_frame *frames = NULL;
+  int frame_count = 0;
+  int frame_capacity = 0;
+  int data_capacity = 0;
+
+  c->data = NULL;
+  c->data_count = 0;
+
+  for (;;) {
+    // Open lists until reaching a datum that is complete on its own.
+    if (match(c->parser, TOKEN_IDENTIFIER)) {
+      struct token *name = &c->parser->prev;
+      data_push(c, &data_capacity,
+          OBJ_VAL(str_pool_intern(c->w, name->start, name->len)));
+    } else if (match(c->parser, TOKEN_NUMBER))
+      data_push(c, &data_capacity,
+          NUM_VAL(strtod(c->parser->prev.start, NULL)));
+    else if (match(c->parser, TOKEN_QUOTE))
+      continue;
+    else if (match(c->parser, TOKEN_LEFT_PAREN)) {
+      if (match(c->parser, TOKEN_RIGHT_PAREN))
+        // '() evaluates to nil.
+        data_push(c, &data_capacity, NIL_VAL);
+      else {
+        if (frame_count >= frame_capacity) {
+          int old_capacity = frame_capacity;
+          frame_capacity = GROW_CAPACITY(old_capacity);
+          frames = ARENA_GROW_ARRAY(&c->w->compile_arena, struct list_frame,
+              frames, old_capacity, frame_capacity);
+        }
+
+        struct list_frame *frame = &frames[frame_count++];
+        frame->start = c->data_count;
+
+        // '( . a) evaluates to a.
+        frame->is_dotted = match(c->parser, TOKEN_DOT);
+        continue;
+      }
+    } else {
+      error_at_current(c->parser, "Unexpected token");
+      break;
     }
 
-    if (match(c->parser, TOKEN_DOT))
-      sexp(c, true);
-    else
-      emit_byte(c, OP_NIL);
+    // Close all lists completed by the datum.
+    while (frame_count > 0) {
+      struct list_frame *frame = &frames[frame_count - 1];
 
-    for (int i = 0; i < elements; ++i)
-      emit_byte(c, OP_CONS);
+      if (!frame->is_dotted) {
+        if (match(c->parser, TOKEN_DOT)) {
+          frame->is_dotted = true;
+          break;
+        }
+
+        if (!check(c->parser, TOKEN_RIGHT_PAREN)
+            && !check(c->parser, TOKEN_EOF))
+          break;
+
+        data_push(c, &data_capacity, NIL_VAL);
+      }
+
+      consume(c->parser, TOKEN_RIGHT_PAREN, "Expect ')' at the end of a list");
+      data_build_list(c, frame->start);
+      frame_count--;
+    }
+
+    if (frame_count == 0 || c->parser->panic_mode)
+      break;
+  }
+
+  Value value = c->data_count > 0 ? c->data[c->data_count - 1] : NIL_VAL;
+
+  if (IS_NIL(value))
+    emit_byte(c, OP_NIL);
+  else
+    emit_constant(c, value);
+
+  stack_effect(c, 1);
+  c->data_count = 0;
+}
+
+// A step of compiling an expression, waiting on the work stack until the
+// expressions it needs are compiled.
+struct task {
+  enum {
+    // Compile an expression.
+    TASK_SEXP,
+
+    // Consume the ')' closing a list.
+    TASK_CLOSE,
+
+    // Define the global of the operand (or the innermost local).
+    TASK_DEFINE,
+
+    // Finish the lambda whose body is compiled by the compiler of the task.
+    TASK_LAMBDA,
+
+    TASK_CONS,
+    TASK_CAR,
+    TASK_CDR,
+
+    // Compile the next argument of a call, or make the call, the operand
+    // being the number of arguments compiled so far.
+    TASK_CALL,
+
+    // Make a call with a dotted argument, the operand being the number of
+    // the other arguments.
+    TASK_DOT_CALL,
+  } kind;
+
+  // The compiler the step compiles into.
+  struct compiler *c;
+
+  int operand;
+};
+
+struct tasks {
+  struct task *tasks;
+  int count;
+  int capacity;
+};
+
+static void push_task(struct compiler *c, struct tasks *t, int kind,
+    int operand)
+{
+  if (t->count >= t->capacity) {
+    int old_capacity = t->capacity;
+    t->capacity = GROW_CAPACITY(old_capacity);
+    t->tasks = ARENA_GROW_ARRAY(&c->w->compile_arena, struct task, t->tasks,
+        old_capacity, t->capacity);
   }
 
-  consume(c->parser, TOKEN_RIGHT_PAREN, "Expect ')' at the end of a list");
+  struct task *task = &t->tasks[t->count++];
+  task->kind = kind;
+  task->c = c;
+  task->operand = operand;
 }
 
-static void call_or_primitive(struct compiler *c)
+// Starts compiling a list, whose first element has already been consumed,
+// leaving the steps that finish it on the work stack. They are pushed in the
+// reverse order of their execution.
+static void list(struct compiler *c, struct tasks *t)
 {
-  if (check(c->parser, TOKEN_RIGHT_PAREN))
+  push_task(c, t, TASK_CLOSE, 0);
+
+  if (match(c->parser, TOKEN_DEFINE)) {
+    // (define a b)
+    int global = read_identifier(c, "Expect identifier after 'define'");
+    push_task(c, t, TASK_DEFINE, global);
+    push_task(c, t, TASK_SEXP, 0);
+  } else if (match(c->parser, TOKEN_LAMBDA)) {
+    struct compiler *inner = lambda(c);
+
+    if (inner != NULL) {
+      push_task(inner, t, TASK_LAMBDA, 0);
+      push_task(inner, t, TASK_SEXP, 0);
+    }
+  } else if (match(c->parser, TOKEN_CONS)) {
+    // (cons a b)
+    push_task(c, t, TASK_CONS, 0);
+    push_task(c, t, TASK_SEXP, 0);
+    push_task(c, t, TASK_SEXP, 0);
+  } else if (match(c->parser, TOKEN_CAR)) {
+    // (car a)
+    push_task(c, t, TASK_CAR, 0);
+    push_task(c, t, TASK_SEXP, 0);
+  } else if (match(c->parser, TOKEN_CDR)) {
+    // (cdr a)
+    push_task(c, t, TASK_CDR, 0);
+    push_task(c, t, TASK_SEXP, 0);
+  } else if (IS_PRIMITIVE(c->parser->curr.type))
+    // Should never happen as long as all primitive tokens are between
+    // 'PRIMITIVE_START' and 'PRIMITIVE_END'.
+    error_at_current(c->parser, "Unknown primitive");
+  else if (check(c->parser, TOKEN_RIGHT_PAREN))
     error_at_current(c->parser, "Expect function to call");
-  else if (IS_PRIMITIVE(c->parser->curr.type))
-    primitive(c);
-  else
-    call(c);
+  else {
+    // Compile the function being called, and then its arguments.
+    push_task(c, t, TASK_CALL, 0);
+    push_task(c, t, TASK_SEXP, 0);
+  }
+}
 
-  consume(c->parser, TOKEN_RIGHT_PAREN, "Expect ')' at the end of a list");
+// Continues a call once an argument (or the function being called) is
+// compiled.
+static void call(struct compiler *c, struct tasks *t, int arg_count)
+{
+  if (arg_count == UINT8_COUNT)
+    error(c->parser, "Can't have more than " XSTR(UINT8_MAX) " arguments");
+
+  if (!check(c->parser, TOKEN_RIGHT_PAREN)
+      && !check(c->parser, TOKEN_DOT)
+      && !check(c->parser, TOKEN_EOF)) {
+    push_task(c, t, TASK_CALL, arg_count + 1);
+    push_task(c, t, TASK_SEXP, 0);
+  } else if (match(c->parser, TOKEN_DOT)) {
+    // Compile the optional dotted argument, which, for a function call,
+    // must be a quoted list (or an identifier associated with one).
+    push_task(c, t, TASK_DOT_CALL, arg_count);
+    push_task(c, t, TASK_SEXP, 0);
+  } else {
+    emit_bytes(c, OP_CALL, (uint8_t) arg_count);
+    call_stack_effect(c, OP_CALL, (uint8_t) arg_count);
+  }
 }
 
-static void sexp(struct compiler *c, bool quoted)
+// Compiles an expression. Nested expressions are tracked on an explicit work
+// stack rather than by recursion, so that arbitrarily deep expressions can be
+// compiled without exhausting the C stack.
+static void sexp(struct compiler *c)
 {
-  if (match(c->parser, TOKEN_IDENTIFIER)) {
-    if (quoted)
-      emit_bytes(c, OP_CONSTANT, atom(c, &c->parser->prev));
-    else
-      identifier(c);
-  } else if (match(c->parser, TOKEN_NUMBER))
-    number(c);
-  else if (match(c->parser, TOKEN_QUOTE))
-    sexp(c, true);
-  else if (match(c->parser, TOKEN_LEFT_PAREN)) {
-    if (quoted)
-      list(c);
-    else
-      call_or_primitive(c);
-  } else
-    error_at_current(c->parser, "Unexpected token");
+  struct tasks t = {NULL, 0, 0};
+  push_task(c, &t, TASK_SEXP, 0);
+
+  while (t.count > 0) {
+    struct task task = t.tasks[--t.count];
+    c = task.c;
+
+    switch (task.kind) {
+    case TASK_SEXP:
+      if (match(c->parser, TOKEN_IDENTIFIER))
+        identifier(c);
+      else if (match(c->parser, TOKEN_NUMBER))
+        number(c);
+      else if (match(c->parser, TOKEN_QUOTE))
+        datum(c);
+      else if (match(c->parser, TOKEN_LEFT_PAREN)) {
+        list(c, &t);
+        continue;
+      } else
+        error_at_current(c->parser, "Unexpected token");
 
-  if (c->parser->panic_mode)
-    synchronize(c->parser);
+      break;
+    case TASK_CLOSE:
+      consume(c->parser, TOKEN_RIGHT_PAREN, "Expect ')' at the end of a list");
+      break;
+    case TASK_DEFINE:
+      define_variable(c, task.operand);
+      continue;
+    case TASK_LAMBDA:
+      end_lambda(c);
+      closure(c);
+      continue;
+    case TASK_CONS:
+      emit_byte(c, OP_CONS);
+      stack_effect(c, -1);
+      continue;
+    case TASK_CAR:
+      emit_byte(c, OP_CAR);
+      continue;
+    case TASK_CDR:
+      emit_byte(c, OP_CDR);
+      continue;
+    case TASK_CALL:
+      call(c, &t, task.operand);
+      continue;
+    case TASK_DOT_CALL:
+      emit_bytes(c, OP_DOT_CALL, (uint8_t) task.operand);
+      call_stack_effect(c, OP_DOT_CALL, (uint8_t) task.operand);
+      continue;
+    }
+
+    // An expression is complete.
+    if (c->parser->panic_mode)
+      synchronize(c->parser);
+  }
+}
+
+void compiler_mark_roots(struct wisp_state *w)
+{
+  for (struct compiler *c = w->compiler; c != NULL; c = c->enclosing) {
+    obj_mark(w, (struct obj *) c->lambda);
+
+    for (int i = 0; i < c->chunk.constants.count; ++i)
+      if (IS_OBJ(c->chunk.constants.values[i]))
+        obj_mark(w, AS_OBJ(c->chunk.constants.values[i]));
+
+    for (int i = 0; i < c->data_count; ++i)
+      if (IS_OBJ(c->data[i]))
+        obj_mark(w, AS_OBJ(c->data[i]));
+  }
+}
+
+bool compile_lazy(struct wisp_state *w, struct obj_lambda *lambda)
+{
+  struct lazy_body *lazy = lambda->lazy;
+
+  struct scanner sc;
+  scanner_init(&sc, lazy->start);
+  sc.line = lazy->line;
+
+  struct parser p;
+  parser_init(&p, &sc);
+
+  struct compiler c;
+  compiler_init(&c, w, NULL, &p, lambda);
+  c.lazy = lazy;
+  scope_begin(&c);
+
+  // The parameters are compiled again to declare them as locals.
+  lambda->arity = 0;
+  lambda->has_param_list = false;
+
+  advance(&p);
+  parameters(&c);
+  stack_begin(&c);
+  sexp(&c);
+  end_lambda(&c);
+  compiler_free(&c);
+
+  if (p.had_error) {
+    chunk_free(w, &lambda->chunk);
+    return false;
+  }
+
+  lambda->lazy = NULL;
+  lazy_body_free(w, lazy);
+  return true;
+}
+
+void lazy_body_free(struct wisp_state *w, struct lazy_body *lazy)
+{
+  FREE_ARRAY(w, struct token, lazy->upvalue_names, lazy->upvalue_count);
+  FREE(w, struct lazy_body, lazy);
 }
 
 struct obj_lambda *compile(struct wisp_state *w, const char *source)
@@ -579,14 +1397,52 @@ struct obj_lambda *compile(struct wisp_state *w, const char *source)
   parser_init(&p, &sc);
 
   struct compiler c;
-  compiler_init(&c, w, NULL, &p);
+  compiler_init(&c, w, NULL, &p, NULL);
 
   advance(&p);
-  while (!match(&p, TOKEN_EOF))
-    sexp(&c, false);
 
-  emit_byte(&c, OP_NIL);
-  emit_byte(&c, OP_RETURN);
+  if (check(&p, TOKEN_EOF)) {
+    emit_byte(&c, OP_NIL);
+    stack_effect(&c, 1);
+  }
+
+  // Evaluate to the value of the last form, discarding the others.
+  while (!match(&p, TOKEN_EOF)) {
+    sexp(&c);
+
+    if (!check(&p, TOKEN_EOF)) {
+      emit_byte(&c, OP_POP);
+      stack_effect(&c, -1);
+    }
+  }
+
+  end_lambda(&c);
+  compiler_free(&c);
 
   return p.had_error ? NULL : c.lambda;
 }
+
+void toplevel_init(struct toplevel *t, const char *source, int line)
+{
+  scanner_init(&t->scanner, source);
+  t->scanner.line = line;
+  parser_init(&t->parser, &t->scanner);
+  advance(&t->parser);
+}
+
+bool compile_next(struct wisp_state *w, struct toplevel *t,
+    struct obj_lambda **lambda)
+{
+  if (check(&t->parser, TOKEN_EOF))
+    return false;
+
+  struct compiler c;
+  compiler_init(&c, w, NULL, &t->parser, NULL);
+
+  sexp(&c);
+  end_lambda(&c);
+  compiler_free(&c);
+
+  *lambda = t->parser.had_error ? NULL : c.lambda;
+  return true;
+}
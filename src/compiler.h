@@ -1,8 +1,47 @@
 #ifndef WISP_COMPILER_H
 #define WISP_COMPILER_H
 
+#include "scanner.h"
 #include "value.h"
 
+struct parser {
+  // Fetches tokens from the parsed string.
+  struct scanner *scanner;
+
+  // The last consumed token.
+  struct token prev;
+
+  // The currently looked at but yet unconsumed token.
+  struct token curr;
+
+  // Is the parser currently in an error state?
+  bool panic_mode;
+
+  // Was there a parse error?
+  bool had_error;
+};
+
+// Compiles a source one top-level form at a time, so that each form can be
+// executed (and its bytecode discarded) before the next one is compiled.
+struct toplevel {
+  // Scanner of the whole source.
+  struct scanner scanner;
+
+  // Parser shared by the compilers of all forms.
+  struct parser parser;
+};
+
 struct obj_lambda *compile(struct wisp_state *, const char *);
 
+void toplevel_init(struct toplevel *, const char *, int);
+
+bool compile_next(struct wisp_state *, struct toplevel *,
+    struct obj_lambda **);
+
+bool compile_lazy(struct wisp_state *, struct obj_lambda *);
+
+void lazy_body_free(struct wisp_state *, struct lazy_body *);
+
+void compiler_mark_roots(struct wisp_state *);
+
 #endif
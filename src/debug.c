@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "debug.h"
 #include "opcodes.h"
@@ -13,6 +14,29 @@ static int constant_instruction(const char *name, struct chunk *chunk,
   return offset + 2;
 }
 
+static int constant_long_instruction(const char *name, struct chunk *chunk,
+    int offset)
+{
+  uint32_t constant = (chunk->code[offset + 1] << 16)
+                    | (chunk->code[offset + 2] << 8)
+                    | chunk->code[offset + 3];
+  printf("%-16s %8" PRIu32 " '", name, constant);
+  value_print(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int constant_byte_instruction(const char *name, struct chunk *chunk,
+    int offset)
+{
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t operand = chunk->code[offset + 2];
+  printf("%-16s %4u '", name, constant);
+  value_print(chunk->constants.values[constant]);
+  printf("' %d\n", operand);
+  return offset + 3;
+}
+
 static int simple_instruction(const char *name, int offset)
 {
   printf("%s\n", name);
@@ -26,46 +50,68 @@ static int byte_instruction(const char *name, struct chunk *chunk, int offset)
   return offset + 2;
 }
 
+static int short_instruction(const char *name, struct chunk *chunk, int offset)
+{
+  uint16_t slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  printf("%-16s %6d\n", name, slot);
+  return offset + 3;
+}
+
+static int closure_instruction(const char *name, struct chunk *chunk,
+    int offset, uint32_t constant)
+{
+  printf("%-16s %4" PRIu32 " ", name, constant);
+  value_print(chunk->constants.values[constant]);
+  printf("\n");
+
+  struct obj_lambda *lambda = AS_LAMBDA(chunk->constants.values[constant]);
+
+  for (int i = 0; i < lambda->upvalue_count; ++i) {
+    uint8_t is_local = chunk->code[offset++];
+    uint16_t index = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+    offset += 2;
+    printf("%04d | %s %d\n", offset - 3, is_local ? "local" : "upvalue",
+        index);
+  }
+
+  return offset;
+}
+
 int disassemble_instruction(struct chunk *chunk, int offset)
 {
   printf("%04d ", offset);
 
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+  int line = chunk_get_line(chunk, offset);
+
+  if (offset > 0 && line == chunk_get_line(chunk, offset - 1))
     printf("   | ");
   else
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
 
   uint8_t instruction = chunk->code[offset];
 
   switch (instruction) {
   case OP_CONSTANT:
     return constant_instruction("OP_CONSTANT", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constant_long_instruction("OP_CONSTANT_LONG", chunk, offset);
   case OP_NIL:
     return simple_instruction("OP_NIL", offset);
   case OP_CALL:
     return byte_instruction("OP_CALL", chunk, offset);
   case OP_DOT_CALL:
     return byte_instruction("OP_DOT_CALL", chunk, offset);
-  case OP_CLOSURE: {
-    offset++;
-    uint8_t constant = chunk->code[offset++];
-    printf("%-16s %4d ", "OP_CLOSURE", constant);
-    value_print(chunk->constants.values[constant]);
-    printf("\n");
-
-    struct obj_lambda *lambda = AS_LAMBDA(chunk->constants.values[constant]);
-
-    for (int i = 0; i < lambda->upvalue_count; ++i) {
-      uint8_t is_local = chunk->code[offset++];
-      uint8_t index = chunk->code[offset++];
-      printf("%04d | %s %d\n", offset - 2, is_local ? "local" : "upvalue",
-          index);
-    }
-
-    return offset;
-  }
+  case OP_CLOSURE:
+    return closure_instruction("OP_CLOSURE", chunk, offset + 2,
+        chunk->code[offset + 1]);
+  case OP_CLOSURE_LONG:
+    return closure_instruction("OP_CLOSURE_LONG", chunk, offset + 4,
+        (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8)
+        | chunk->code[offset + 3]);
   case OP_RETURN:
     return simple_instruction("OP_RETURN", offset);
+  case OP_POP:
+    return simple_instruction("OP_POP", offset);
   case OP_CONS:
     return simple_instruction("CONS", offset);
   case OP_CAR:
@@ -74,14 +120,131 @@ int disassemble_instruction(struct chunk *chunk, int offset)
     return simple_instruction("CDR", offset);
   case OP_DEFINE_GLOBAL:
     return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+  case OP_DEFINE_GLOBAL_LONG:
+    return constant_long_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
   case OP_GET_LOCAL:
     return byte_instruction("OP_GET_LOCAL", chunk, offset);
   case OP_GET_UPVALUE:
     return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+  case OP_GET_UPVALUE_LONG:
+    return short_instruction("OP_GET_UPVALUE_LONG", chunk, offset);
   case OP_GET_GLOBAL:
     return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+  case OP_GET_GLOBAL_LONG:
+    return constant_long_instruction("OP_GET_GLOBAL_LONG", chunk, offset);
+  case OP_GET_LOCAL_CAR:
+    return byte_instruction("OP_GET_LOCAL_CAR", chunk, offset);
+  case OP_GET_LOCAL_CDR:
+    return byte_instruction("OP_GET_LOCAL_CDR", chunk, offset);
+  case OP_CADR:
+    return simple_instruction("OP_CADR", offset);
+  case OP_CDDR:
+    return simple_instruction("OP_CDDR", offset);
+  case OP_GET_GLOBAL_CALL:
+    return constant_byte_instruction("OP_GET_GLOBAL_CALL", chunk, offset);
+  case OP_LIST:
+    return byte_instruction("OP_LIST", chunk, offset);
   default:
     printf("Unknown opcode: %" PRIu8 "\n", instruction);
     return offset + 1;
   }
 }
+
+static const char *opcode_name(uint8_t instruction)
+{
+  switch (instruction) {
+  case OP_CONSTANT:
+    return "OP_CONSTANT";
+  case OP_CONSTANT_LONG:
+    return "OP_CONSTANT_LONG";
+  case OP_NIL:
+    return "OP_NIL";
+  case OP_CALL:
+    return "OP_CALL";
+  case OP_DOT_CALL:
+    return "OP_DOT_CALL";
+  case OP_CLOSURE:
+    return "OP_CLOSURE";
+  case OP_CLOSURE_LONG:
+    return "OP_CLOSURE_LONG";
+  case OP_RETURN:
+    return "OP_RETURN";
+  case OP_POP:
+    return "OP_POP";
+  case OP_CONS:
+    return "CONS";
+  case OP_CAR:
+    return "CAR";
+  case OP_CDR:
+    return "CDR";
+  case OP_DEFINE_GLOBAL:
+    return "OP_DEFINE_GLOBAL";
+  case OP_DEFINE_GLOBAL_LONG:
+    return "OP_DEFINE_GLOBAL_LONG";
+  case OP_GET_LOCAL:
+    return "OP_GET_LOCAL";
+  case OP_GET_UPVALUE:
+    return "OP_GET_UPVALUE";
+  case OP_GET_UPVALUE_LONG:
+    return "OP_GET_UPVALUE_LONG";
+  case OP_GET_GLOBAL:
+    return "OP_GET_GLOBAL";
+  case OP_GET_GLOBAL_LONG:
+    return "OP_GET_GLOBAL_LONG";
+  case OP_GET_LOCAL_CAR:
+    return "OP_GET_LOCAL_CAR";
+  case OP_GET_LOCAL_CDR:
+    return "OP_GET_LOCAL_CDR";
+  case OP_CADR:
+    return "OP_CADR";
+  case OP_CDDR:
+    return "OP_CDDR";
+  case OP_GET_GLOBAL_CALL:
+    return "OP_GET_GLOBAL_CALL";
+  case OP_LIST:
+    return "OP_LIST";
+  default:
+    return "Unknown opcode";
+  }
+}
+
+struct opcode_pair {
+  uint8_t first;
+  uint8_t second;
+  unsigned long count;
+};
+
+static int opcode_pair_compare(const void *a, const void *b)
+{
+  unsigned long count_a = ((const struct opcode_pair *) a)->count;
+  unsigned long count_b = ((const struct opcode_pair *) b)->count;
+
+  // Sort by the count, in descending order.
+  return (count_a < count_b) - (count_a > count_b);
+}
+
+void opcode_pairs_print(unsigned long pairs[UINT8_COUNT][UINT8_COUNT])
+{
+  static struct opcode_pair sorted[UINT8_COUNT * UINT8_COUNT];
+  unsigned long total = 0;
+  int count = 0;
+
+  for (int i = 0; i < UINT8_COUNT; ++i)
+    for (int j = 0; j < UINT8_COUNT; ++j)
+      if (pairs[i][j] > 0) {
+        sorted[count].first = (uint8_t) i;
+        sorted[count].second = (uint8_t) j;
+        sorted[count].count = pairs[i][j];
+        total += pairs[i][j];
+        count++;
+      }
+
+  qsort(sorted, count, sizeof(struct opcode_pair), opcode_pair_compare);
+
+  fprintf(stderr, "-- opcode pairs (%lu total) --\n", total);
+
+  for (int i = 0; i < count; ++i)
+    fprintf(stderr, "%-21s %-21s %10lu %6.2f%%\n",
+        opcode_name(sorted[i].first), opcode_name(sorted[i].second),
+        sorted[i].count, 100.0 * sorted[i].count / total);
+}
@@ -5,4 +5,6 @@
 
 int disassemble_instruction(struct chunk *, int);
 
+void opcode_pairs_print(unsigned long [UINT8_COUNT][UINT8_COUNT]);
+
 #endif
@@ -0,0 +1,671 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "memory.h"
+#include "state.h"
+#include "strpool.h"
+#include "vm.h"
+
+// Identifies wisp images.
+#define IMAGE_MAGIC "WISPIMG\n"
+
+// Bumped whenever the image format or the bytecode changes, which makes the
+// images written by earlier versions stale.
+#define IMAGE_VERSION 3
+
+// Images are written in the native byte order, and only read back in it.
+#define IMAGE_BYTE_ORDER 0x01020304
+
+// An image is a header followed by records, each starting with its kind.
+// Every record is padded to a multiple of 4 bytes, so that the line runs
+// mapped in place are aligned.
+struct image_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+
+  // Hash and length of the source the image was compiled from.
+  uint64_t source_hash;
+  uint64_t source_len;
+
+  // Size of the whole image, written once the image is complete.
+  uint64_t size;
+};
+
+enum record_kind {
+  // A lambda record, followed by the bytecode, the line runs and the
+  // constants of its chunk. The lambdas nested in it are the ones written
+  // right before it, in the order of its constants.
+  RECORD_LAMBDA = 1,
+
+  // Ends a top-level form, which is the lambda written right before it.
+  RECORD_FORM,
+
+  // Ends the image.
+  RECORD_END,
+};
+
+struct lambda_record {
+  uint32_t kind;
+  uint32_t arity;
+  uint32_t upvalue_count;
+  uint32_t has_param_list;
+  uint32_t stack_size;
+  uint32_t code_count;
+  uint32_t line_count;
+  uint32_t constant_count;
+
+  // Number of the constants that are nested lambdas.
+  uint32_t lambda_count;
+};
+
+// Every constant starts with one of these tags, possibly followed by its
+// contents.
+enum constant_tag {
+  CONSTANT_NIL,
+
+  // Followed by the 8 bytes of the number.
+  CONSTANT_NUM,
+
+  // Followed by the length of the atom name, and the name.
+  CONSTANT_ATOM,
+
+  // The next of the nested lambdas.
+  CONSTANT_LAMBDA,
+
+  // A pair of a quoted list, followed by its car and then its cdr. Neither
+  // holds a lambda.
+  CONSTANT_PAIR,
+};
+
+// A field of a pair being loaded, still to be filled in.
+struct pair_field {
+  struct obj_pair *pair;
+  bool is_cdr;
+};
+
+struct image_frame {
+  // The lambda being written.
+  struct obj_lambda *lambda;
+
+  // Index of the next constant to look for nested lambdas at.
+  int constant;
+};
+
+// The unread part of an image.
+struct cursor {
+  const uint8_t *next;
+  const uint8_t *end;
+};
+
+// A lambda record, with the parts of the chunk located in the image.
+struct lambda_view {
+  struct lambda_record record;
+  const uint8_t *code;
+  const struct line_run *lines;
+};
+
+uint64_t image_hash(const char *source, size_t len)
+{
+  uint64_t hash = 0x3243f6a8885a308d ^ len;
+  uint64_t word;
+  size_t i = 0;
+
+  for (; i + sizeof(word) <= len; i += sizeof(word)) {
+    memcpy(&word, source + i, sizeof(word));
+    hash = (hash ^ word) * 1111111111111111111;
+    hash ^= hash >> 32;
+  }
+
+  word = 0;
+  memcpy(&word, source + i, len - i);
+  hash = (hash ^ word) * 1111111111111111111;
+  return hash ^ hash >> 32;
+}
+
+// Consumes the given number of bytes and their padding, returning NULL if
+// the image ends sooner.
+static const uint8_t *take(struct cursor *c, size_t size)
+{
+  size_t padded = (size + 3) & ~(size_t) 3;
+  if (padded < size || (size_t) (c->end - c->next) < padded)
+    return NULL;
+
+  const uint8_t *bytes = c->next;
+  c->next += padded;
+  return bytes;
+}
+
+static bool take_u32(struct cursor *c, uint32_t *n)
+{
+  const uint8_t *bytes = take(c, sizeof(*n));
+  if (bytes == NULL)
+    return false;
+
+  memcpy(n, bytes, sizeof(*n));
+  return true;
+}
+
+static bool take_lambda(struct cursor *c, struct lambda_view *view)
+{
+  const uint8_t *record = take(c, sizeof(struct lambda_record));
+  if (record == NULL)
+    return false;
+
+  memcpy(&view->record, record, sizeof(struct lambda_record));
+  view->code = take(c, view->record.code_count);
+  view->lines = (const struct line_run *) take(c,
+      sizeof(struct line_run) * (size_t) view->record.line_count);
+  return view->code != NULL && view->lines != NULL;
+}
+
+// Consumes a constant, locating the name if it is an atom.
+static bool take_constant(struct cursor *c, uint32_t *tag, double *num,
+    const char **chars, uint32_t *len)
+{
+  if (!take_u32(c, tag))
+    return false;
+
+  switch (*tag) {
+  case CONSTANT_NIL:
+  case CONSTANT_LAMBDA:
+  case CONSTANT_PAIR:
+    return true;
+  case CONSTANT_NUM: {
+    const uint8_t *bytes = take(c, sizeof(*num));
+    if (bytes == NULL)
+      return false;
+
+    memcpy(num, bytes, sizeof(*num));
+    return true;
+  }
+  case CONSTANT_ATOM:
+    return take_u32(c, len)
+      && (*chars = (const char *) take(c, *len)) != NULL;
+  }
+
+  return false;
+}
+
+// Checks that the records of the image are complete and consistent, so
+// that loading the forms cannot fail halfway through the program. The
+// bytecode itself is trusted, as the image is keyed by its source.
+static bool image_check(struct cursor c)
+{
+  uint32_t depth = 0;
+
+  for (;;) {
+    uint32_t kind;
+    if ((size_t) (c.end - c.next) < sizeof(kind))
+      return false;
+
+    memcpy(&kind, c.next, sizeof(kind));
+
+    switch (kind) {
+    case RECORD_LAMBDA: {
+      struct lambda_view view;
+      if (!take_lambda(&c, &view) || view.record.code_count == 0
+          || view.record.line_count == 0
+          || view.record.constant_count > UINT24_COUNT
+          || view.record.lambda_count > depth)
+        return false;
+
+      uint32_t lambda_count = 0;
+      for (uint32_t i = 0; i < view.record.constant_count; ++i) {
+        // Number of the parts of the constant still to be consumed.
+        size_t pending = 1;
+        bool is_nested = false;
+
+        while (pending > 0) {
+          uint32_t tag;
+          double num;
+          const char *chars;
+          uint32_t len;
+
+          if (!take_constant(&c, &tag, &num, &chars, &len)
+              || (tag == CONSTANT_LAMBDA && is_nested))
+            return false;
+
+          lambda_count += tag == CONSTANT_LAMBDA;
+          pending = tag == CONSTANT_PAIR ? pending + 1 : pending - 1;
+          is_nested = true;
+        }
+      }
+
+      if (lambda_count != view.record.lambda_count)
+        return false;
+
+      depth = depth - lambda_count + 1;
+      break;
+    }
+    case RECORD_FORM:
+      if (depth != 1)
+        return false;
+
+      c.next += sizeof(kind);
+      depth = 0;
+      break;
+    case RECORD_END:
+      return depth == 0 && c.next + sizeof(kind) == c.end;
+    default:
+      return false;
+    }
+  }
+}
+
+bool image_open(struct image *img, struct wisp_state *w, const char *path,
+    uint64_t hash, size_t len)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+      || (size_t) st.st_size < sizeof(struct image_header)) {
+    close(fd);
+    return false;
+  }
+
+  size_t size = (size_t) st.st_size;
+  uint8_t *start = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (start == MAP_FAILED)
+    return false;
+
+  struct image_header header;
+  memcpy(&header, start, sizeof(header));
+
+  struct cursor c = {start + sizeof(header), start + size};
+  if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0
+      || header.version != IMAGE_VERSION
+      || header.byte_order != IMAGE_BYTE_ORDER
+      || header.source_hash != hash || header.source_len != len
+      || header.size != size || !image_check(c)) {
+    munmap(start, size);
+    return false;
+  }
+
+  img->w = w;
+  img->next = c.next;
+  img->end = c.end;
+  img->forms = lambda_new(w);
+  w->pending_forms = img->forms;
+
+  struct obj_mapping *mapping = mapping_new(w, start, size);
+  vm_stack_push(w, OBJ_VAL(mapping));
+  chunk_add_constant(w, &img->forms->chunk, OBJ_VAL(mapping));
+  WRITE_BARRIER(w, &img->forms->obj);
+  vm_stack_pop(w);
+  return true;
+}
+
+// Fills in the fields of a pair of a quoted list, and of all the pairs
+// nested in it. The pair is already reachable, and each nested pair is
+// stored in its field as soon as it is allocated, so that it is as well.
+static void load_pairs(struct wisp_state *w, struct cursor *c,
+    struct obj_pair *pair)
+{
+  struct pair_field *fields = NULL;
+  int capacity = 0;
+  int count = 0;
+
+  for (;;) {
+    if (pair != NULL) {
+      if (count + 2 > capacity) {
+        capacity = GROW_CAPACITY(capacity);
+        fields = realloc(fields, sizeof(struct pair_field) * capacity);
+        if (fields == NULL)
+          exit(1);
+      }
+
+      fields[count++] = (struct pair_field) {pair, true};
+      fields[count++] = (struct pair_field) {pair, false};
+      pair = NULL;
+    }
+
+    if (count == 0)
+      break;
+
+    struct pair_field field = fields[--count];
+    uint32_t tag = CONSTANT_NIL;
+    double num = 0;
+    const char *chars = NULL;
+    uint32_t len = 0;
+    Value value = NIL_VAL;
+
+    take_constant(c, &tag, &num, &chars, &len);
+
+    if (tag == CONSTANT_NUM)
+      value = NUM_VAL(num);
+    else if (tag == CONSTANT_ATOM)
+      value = OBJ_VAL(str_pool_intern(w, chars, len));
+    else if (tag == CONSTANT_PAIR) {
+      pair = pair_new(w, NIL_VAL, NIL_VAL);
+      value = OBJ_VAL(pair);
+    }
+
+    if (field.is_cdr)
+      field.pair->cdr = value;
+    else
+      field.pair->car = value;
+
+    WRITE_BARRIER(w, &field.pair->obj);
+  }
+
+  free(fields);
+}
+
+// Creates the lambda of the record. Its nested lambdas are the topmost ones
+// held by the forms, and the lambda replaces them.
+static void load_lambda(struct image *img, struct cursor *c,
+    struct lambda_view *view)
+{
+  struct wisp_state *w = img->w;
+  struct value_array *held = &img->forms->chunk.constants;
+  struct lambda_record *record = &view->record;
+
+  struct obj_lambda *lambda = lambda_new(w);
+  lambda->arity = (int) record->arity;
+  lambda->upvalue_count = (int) record->upvalue_count;
+  lambda->has_param_list = record->has_param_list != 0;
+  lambda->stack_size = (int) record->stack_size;
+  lambda->image = (struct obj_mapping *) AS_OBJ(held->values[0]);
+
+  // The image is mapped read-only, and the bytecode is never written.
+  lambda->chunk.code = (uint8_t *) view->code;
+  lambda->chunk.count = (int) record->code_count;
+  lambda->chunk.capacity = (int) record->code_count;
+  lambda->chunk.lines = (struct line_run *) view->lines;
+  lambda->chunk.line_count = (int) record->line_count;
+  lambda->chunk.line_capacity = (int) record->line_count;
+
+  vm_stack_push(w, OBJ_VAL(lambda));
+  chunk_add_constant(w, &img->forms->chunk, OBJ_VAL(lambda));
+  WRITE_BARRIER(w, &img->forms->obj);
+  vm_stack_pop(w);
+
+  struct value_array *constants = &lambda->chunk.constants;
+  constants->values = ALLOCATE(w, Value, record->constant_count);
+  constants->capacity = (int) record->constant_count;
+
+  int nested = held->count - 1 - (int) record->lambda_count;
+
+  for (uint32_t i = 0; i < record->constant_count; ++i) {
+    uint32_t tag = CONSTANT_NIL;
+    double num = 0;
+    const char *chars = NULL;
+    uint32_t len = 0;
+    Value constant = NIL_VAL;
+
+    take_constant(c, &tag, &num, &chars, &len);
+
+    if (tag == CONSTANT_NUM)
+      constant = NUM_VAL(num);
+    else if (tag == CONSTANT_ATOM)
+      constant = OBJ_VAL(str_pool_intern(w, chars, len));
+    else if (tag == CONSTANT_LAMBDA)
+      constant = held->values[nested++];
+
+    else if (tag == CONSTANT_PAIR)
+      constant = OBJ_VAL(pair_new(w, NIL_VAL, NIL_VAL));
+
+    constants->values[constants->count++] = constant;
+    WRITE_BARRIER(w, &lambda->obj);
+
+    if (tag == CONSTANT_PAIR)
+      load_pairs(w, c, AS_PAIR(constant));
+  }
+
+  held->values[held->count - 1 - (int) record->lambda_count] =
+    OBJ_VAL(lambda);
+  held->count -= (int) record->lambda_count;
+  WRITE_BARRIER(w, &img->forms->obj);
+}
+
+bool image_next(struct image *img, struct obj_lambda **lambda)
+{
+  struct value_array *held = &img->forms->chunk.constants;
+  struct cursor c = {img->next, img->end};
+
+  // The previous form has been executed, only the mapping is kept.
+  held->count = 1;
+
+  for (;;) {
+    uint32_t kind;
+    memcpy(&kind, c.next, sizeof(kind));
+
+    if (kind == RECORD_END)
+      return false;
+
+    if (kind == RECORD_FORM) {
+      img->next = c.next + sizeof(kind);
+      *lambda = AS_LAMBDA(held->values[1]);
+      return true;
+    }
+
+    struct lambda_view view;
+    take_lambda(&c, &view);
+    load_lambda(img, &c, &view);
+  }
+}
+
+void image_close(struct image *img)
+{
+  // The mapping is unmapped once none of the loaded lambdas are reachable.
+  img->w->pending_forms = NULL;
+}
+
+static void write_bytes(struct image_writer *iw, const void *bytes,
+    size_t size)
+{
+  static const uint8_t padding[3] = {0, 0, 0};
+  size_t padded = (size + 3) & ~(size_t) 3;
+
+  fwrite(bytes, 1, size, iw->file);
+  fwrite(padding, 1, padded - size, iw->file);
+  iw->size += padded;
+}
+
+static void write_u32(struct image_writer *iw, uint32_t n)
+{
+  write_bytes(iw, &n, sizeof(n));
+}
+
+bool image_writer_open(struct image_writer *iw, const char *path,
+    uint64_t hash, size_t len)
+{
+  size_t path_len = strlen(path);
+  iw->path = malloc(path_len + 1);
+  iw->temp_path = malloc(path_len + sizeof(".XXXXXX"));
+  if (iw->path == NULL || iw->temp_path == NULL)
+    exit(1);
+
+  memcpy(iw->path, path, path_len + 1);
+  memcpy(iw->temp_path, path, path_len);
+  memcpy(iw->temp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  int fd = mkstemp(iw->temp_path);
+  iw->file = fd == -1 ? NULL : fdopen(fd, "wb");
+
+  if (iw->file == NULL) {
+    if (fd != -1) {
+      close(fd);
+      unlink(iw->temp_path);
+    }
+
+    free(iw->path);
+    free(iw->temp_path);
+    return false;
+  }
+
+  iw->size = 0;
+  iw->has_failed = false;
+  iw->frames = NULL;
+  iw->frame_capacity = 0;
+  iw->values = NULL;
+  iw->value_capacity = 0;
+
+  struct image_header header;
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.byte_order = IMAGE_BYTE_ORDER;
+  header.source_hash = hash;
+  header.source_len = len;
+  header.size = 0;
+  write_bytes(iw, &header, sizeof(header));
+  return true;
+}
+
+// Writes a constant, and the pairs of a quoted list in the order they are
+// loaded in, each followed by its car and then its cdr.
+static void write_constant(struct image_writer *iw, Value constant)
+{
+  int count = 0;
+
+  for (;;) {
+    if (IS_NIL(constant))
+      write_u32(iw, CONSTANT_NIL);
+    else if (IS_NUM(constant)) {
+      double num = AS_NUM(constant);
+      write_u32(iw, CONSTANT_NUM);
+      write_bytes(iw, &num, sizeof(num));
+    } else if (IS_ATOM(constant)) {
+      struct obj_string *atom = AS_ATOM(constant);
+      write_u32(iw, CONSTANT_ATOM);
+      write_u32(iw, (uint32_t) atom->len);
+      write_bytes(iw, atom->chars, atom->len);
+    } else if (IS_LAMBDA(constant))
+      write_u32(iw, CONSTANT_LAMBDA);
+    else if (IS_PAIR(constant)) {
+      if (count + 2 > iw->value_capacity) {
+        iw->value_capacity = GROW_CAPACITY(iw->value_capacity);
+        iw->values = realloc(iw->values, sizeof(Value) * iw->value_capacity);
+        if (iw->values == NULL)
+          exit(1);
+      }
+
+      write_u32(iw, CONSTANT_PAIR);
+      iw->values[count++] = AS_PAIR(constant)->cdr;
+      iw->values[count++] = AS_PAIR(constant)->car;
+    } else {
+      // The compiler emits no other constants.
+      write_u32(iw, CONSTANT_NIL);
+      iw->has_failed = true;
+    }
+
+    if (count == 0)
+      break;
+
+    constant = iw->values[--count];
+  }
+}
+
+static void write_lambda(struct image_writer *iw, struct obj_lambda *lambda)
+{
+  struct chunk *chunk = &lambda->chunk;
+
+  // A lambda whose body has not been compiled has no bytecode to write.
+  if (lambda->lazy != NULL) {
+    iw->has_failed = true;
+    return;
+  }
+
+  struct lambda_record record = {
+    RECORD_LAMBDA,
+    (uint32_t) lambda->arity,
+    (uint32_t) lambda->upvalue_count,
+    lambda->has_param_list,
+    (uint32_t) lambda->stack_size,
+    (uint32_t) chunk->count,
+    (uint32_t) chunk->line_count,
+    (uint32_t) chunk->constants.count,
+    0,
+  };
+
+  for (int i = 0; i < chunk->constants.count; ++i)
+    record.lambda_count += IS_LAMBDA(chunk->constants.values[i]);
+
+  write_bytes(iw, &record, sizeof(record));
+  write_bytes(iw, chunk->code, (size_t) chunk->count);
+  write_bytes(iw, chunk->lines, sizeof(struct line_run) * chunk->line_count);
+
+  for (int i = 0; i < chunk->constants.count; ++i)
+    write_constant(iw, chunk->constants.values[i]);
+}
+
+void image_write_form(struct image_writer *iw, struct obj_lambda *form)
+{
+  int count = 0;
+  struct obj_lambda *next = form;
+
+  // Write the nested lambdas before the lambdas they are nested in.
+  while (next != NULL) {
+    if (count >= iw->frame_capacity) {
+      iw->frame_capacity = GROW_CAPACITY(iw->frame_capacity);
+      iw->frames = realloc(iw->frames,
+          sizeof(struct image_frame) * iw->frame_capacity);
+      if (iw->frames == NULL)
+        exit(1);
+    }
+
+    iw->frames[count].lambda = next;
+    iw->frames[count++].constant = 0;
+    next = NULL;
+
+    while (count > 0 && next == NULL) {
+      struct image_frame *frame = &iw->frames[count - 1];
+      struct value_array *constants = &frame->lambda->chunk.constants;
+
+      while (frame->constant < constants->count
+          && !IS_LAMBDA(constants->values[frame->constant]))
+        frame->constant++;
+
+      if (frame->constant < constants->count)
+        next = AS_LAMBDA(constants->values[frame->constant++]);
+      else {
+        write_lambda(iw, frame->lambda);
+        count--;
+      }
+    }
+  }
+
+  write_u32(iw, RECORD_FORM);
+}
+
+bool image_writer_close(struct image_writer *iw, bool commit)
+{
+  bool is_written = commit && !iw->has_failed;
+
+  if (is_written) {
+    write_u32(iw, RECORD_END);
+
+    uint64_t size = iw->size;
+    is_written = fseek(iw->file, offsetof(struct image_header, size),
+        SEEK_SET) == 0 && fwrite(&size, sizeof(size), 1, iw->file) == 1;
+  }
+
+  is_written = !ferror(iw->file) && is_written;
+  is_written = fclose(iw->file) == 0 && is_written;
+
+  // Renaming replaces any image written concurrently as a whole.
+  if (is_written)
+    is_written = rename(iw->temp_path, iw->path) == 0;
+
+  if (!is_written)
+    unlink(iw->temp_path);
+
+  free(iw->path);
+  free(iw->temp_path);
+  free(iw->frames);
+  free(iw->values);
+  return is_written;
+}
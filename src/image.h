@@ -0,0 +1,82 @@
+#ifndef WISP_IMAGE_H
+#define WISP_IMAGE_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+struct image_frame;
+
+// Executes the top-level forms of a program from a compiled image, instead
+// of compiling its source. The image is mapped into memory, and the bytecode
+// and lines of its lambdas are used in place rather than copied.
+struct image {
+  // The state the forms are loaded into.
+  struct wisp_state *w;
+
+  // Position of the next record in the image.
+  const uint8_t *next;
+
+  // End of the image.
+  const uint8_t *end;
+
+  // Holds the mapping of the image as its first constant, followed by the
+  // lambdas of the form being loaded. It is kept as the pending forms of the
+  // state, so they are always reachable by the collector.
+  struct obj_lambda *forms;
+};
+
+// Writes the top-level forms of a program into an image as they are
+// compiled. The image is written under a temporary name, and only renamed
+// to its path once all forms have been written.
+struct image_writer {
+  // The temporary file being written.
+  FILE *file;
+
+  // Path the image is renamed to when complete.
+  char *path;
+
+  // The temporary path of the image.
+  char *temp_path;
+
+  // Number of bytes written so far.
+  size_t size;
+
+  // Whether a form could not be written, so the image must be discarded.
+  bool has_failed;
+
+  // Work stack of the lambdas whose nested lambdas are being written.
+  struct image_frame *frames;
+
+  // Capacity of the 'frames' array.
+  int frame_capacity;
+
+  // Work stack of the parts of the quoted list being written.
+  Value *values;
+
+  // Capacity of the 'values' array.
+  int value_capacity;
+};
+
+// Hashes the source, identifying the images compiled from it.
+uint64_t image_hash(const char *, size_t);
+
+// Opens the image at the path if it was compiled from a source of the given
+// hash and length by this version of wisp, returning false otherwise.
+bool image_open(struct image *, struct wisp_state *, const char *, uint64_t,
+    size_t);
+
+bool image_next(struct image *, struct obj_lambda **);
+
+void image_close(struct image *);
+
+bool image_writer_open(struct image_writer *, const char *, uint64_t, size_t);
+
+void image_write_form(struct image_writer *, struct obj_lambda *);
+
+// Closes the writer, keeping the image only if it should be committed and
+// all of it could be written.
+bool image_writer_close(struct image_writer *, bool);
+
+#endif
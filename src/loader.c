@@ -0,0 +1,373 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "loader.h"
+#include "memory.h"
+#include "state.h"
+#include "strpool.h"
+#include "vm.h"
+
+// Source bytes compiled by one batch at most. Smaller sources are split
+// evenly between the jobs, but not into batches smaller than the minimum.
+#define BATCH_SIZE_MAX (128 * 1024)
+#define BATCH_SIZE_MIN (4 * 1024)
+
+// How many batches per job can be compiled ahead of the one being executed.
+// Limits the memory held by compiled but not yet executed forms.
+#define BATCHES_AHEAD 2
+
+struct batch {
+  // Start of the first form of the batch.
+  const char *start;
+
+  // Start of the first form of the next batch (or NULL if the last batch).
+  const char *end;
+
+  // Line the batch starts at.
+  int line;
+
+  // Private state the batch is compiled in. As nothing is shared between
+  // batches, the threads compiling them need no synchronization. Once
+  // compiled, its objects are moved over to the executing state.
+  struct wisp_state *w;
+
+  // Holds the compiled forms as its constants, in source order. It is kept
+  // on the VM stack of the private state, and as the pending forms of the
+  // executing state, so the forms are always reachable by the collector.
+  struct obj_lambda *forms;
+
+  // Whether compiling a form failed. No forms of the batch after the one
+  // that failed are compiled.
+  bool had_error;
+
+  // Whether the batch has been compiled.
+  bool is_compiled;
+};
+
+static void batch_compile(struct batch *b, bool lazy_compile)
+{
+  b->w = malloc(sizeof(struct wisp_state));
+  if (b->w == NULL)
+    exit(1);
+
+  struct wisp_state *w = b->w;
+  wisp_state_init(w);
+  w->lazy_compile = lazy_compile;
+
+  b->forms = lambda_new(w);
+  vm_stack_push(w, OBJ_VAL(b->forms));
+
+  struct toplevel t;
+  toplevel_init(&t, b->start, b->line);
+
+  struct obj_lambda *lambda;
+  while ((b->end == NULL || t.parser.curr.start < b->end)
+      && compile_next(w, &t, &lambda)) {
+    if (lambda == NULL) {
+      b->had_error = true;
+      break;
+    }
+
+    vm_stack_push(w, OBJ_VAL(lambda));
+    chunk_add_constant(w, &b->forms->chunk, OBJ_VAL(lambda));
+    WRITE_BARRIER(w, &b->forms->obj);
+    vm_stack_pop(w);
+  }
+}
+
+static void batch_free(struct batch *b)
+{
+  if (b->w == NULL)
+    return;
+
+  wisp_state_free(b->w);
+  free(b->w);
+  b->w = NULL;
+}
+
+static void *worker(void *arg)
+{
+  struct loader *l = arg;
+  pthread_mutex_lock(&l->lock);
+
+  for (;;) {
+    while (!l->is_stopping && l->next_batch < l->batch_count
+        && l->next_batch >= l->batch + BATCHES_AHEAD * l->thread_count)
+      pthread_cond_wait(&l->changed, &l->lock);
+
+    if (l->is_stopping || l->next_batch == l->batch_count)
+      break;
+
+    struct batch *b = &l->batches[l->next_batch++];
+    pthread_mutex_unlock(&l->lock);
+
+    batch_compile(b, l->w->lazy_compile);
+
+    pthread_mutex_lock(&l->lock);
+    b->is_compiled = true;
+    pthread_cond_broadcast(&l->changed);
+  }
+
+  pthread_mutex_unlock(&l->lock);
+  return NULL;
+}
+
+static void add_batch(struct loader *l, const char *start, int line)
+{
+  if (l->batch_count > 0)
+    l->batches[l->batch_count - 1].end = start;
+
+  if (l->batch_count >= l->batch_capacity) {
+    l->batch_capacity = GROW_CAPACITY(l->batch_capacity);
+    l->batches = realloc(l->batches, sizeof(struct batch) * l->batch_capacity);
+    if (l->batches == NULL)
+      exit(1);
+  }
+
+  struct batch *b = &l->batches[l->batch_count++];
+  b->start = start;
+  b->end = NULL;
+  b->line = line;
+  b->w = NULL;
+  b->forms = NULL;
+  b->had_error = false;
+  b->is_compiled = false;
+}
+
+// Splits the source into batches with a quick scan over the parentheses.
+// A batch may only start at an opening parenthesis following a top-level
+// list, so that the token looked ahead at the end of a batch is always
+// valid, and never reported as an error by its compiler.
+static void split_source(struct loader *l, const char *source, int jobs)
+{
+  size_t batch_size = strlen(source) / jobs;
+  if (batch_size > BATCH_SIZE_MAX)
+    batch_size = BATCH_SIZE_MAX;
+  if (batch_size < BATCH_SIZE_MIN)
+    batch_size = BATCH_SIZE_MIN;
+
+  const char *batch_start = source;
+  int depth = 0;
+  int line = 1;
+  bool after_list = false;
+
+  add_batch(l, source, line);
+
+  for (const char *c = source; *c != '\0'; ++c) {
+    switch (*c) {
+    case '\n':
+      line++; // Fallthrough.
+    case ' ':
+    case '\t':
+    case '\r':
+      continue;
+    case ';':
+      while (c[1] != '\n' && c[1] != '\0')
+        c++;
+      continue;
+    case '(':
+      if (after_list && (size_t) (c - batch_start) >= batch_size) {
+        add_batch(l, c, line);
+        batch_start = c;
+      }
+
+      depth++;
+      break;
+    case ')':
+      // An unbalanced parenthesis is reported by the compiler.
+      if (depth > 0)
+        depth--;
+
+      after_list = depth == 0;
+      continue;
+    }
+
+    after_list = false;
+  }
+}
+
+// Moves all objects of the compiled batch over to the given state, which
+// then holds the compiled forms as pending, along with the pool pages they
+// are allocated on. Only the string pool of the
+// private state is left behind, so its atoms are no longer interned.
+static void batch_adopt(struct wisp_state *w, struct batch *b)
+{
+  struct wisp_state *from = b->w;
+  size_t pool_size = from->str_pool.ht == NULL
+                   ? 0
+                   : sizeof(struct obj_string *) << from->str_pool.exp;
+
+  // A collection still in progress in the private state is finished first,
+  // as the pages it has yet to sweep hold garbage, which the given state
+  // would sweep without the marks of the live objects.
+  if (from->gc_phase != GC_IDLE)
+    collect_garbage(from);
+
+  // The objects are young in the given state, whatever their age in the
+  // private one, so they are unmarked and forgotten by the private state.
+  pool_unmark(&from->pool);
+  for (int i = 0; i < from->remembered_count; ++i)
+    from->remembered[i]->is_remembered = false;
+
+  w->bytes_allocated += from->bytes_allocated - pool_size;
+  w->pending_forms = b->forms;
+  pool_adopt(&w->pool, &from->pool);
+  from->remembered_count = 0;
+  from->bytes_allocated = pool_size;
+}
+
+// Replaces the atom in the slot of the object with the atom interned in the
+// given state, or pushes the lambda or the pair in it to have its own atoms
+// interned.
+static void intern_slot(struct loader *l, struct obj *obj, Value *slot,
+    int *count)
+{
+  Value val = *slot;
+
+  if (IS_ATOM(val)) {
+    struct obj_string *atom = AS_ATOM(val);
+    *slot = OBJ_VAL(str_pool_intern(l->w, atom->chars, atom->len));
+    WRITE_BARRIER(l->w, obj);
+  } else if (IS_LAMBDA(val) || IS_PAIR(val)) {
+    if (*count >= l->obj_capacity) {
+      l->obj_capacity = GROW_CAPACITY(l->obj_capacity);
+      l->objs = realloc(l->objs, sizeof(struct obj *) * l->obj_capacity);
+      if (l->objs == NULL)
+        exit(1);
+    }
+
+    l->objs[(*count)++] = AS_OBJ(val);
+  }
+}
+
+// Replaces the atoms of an adopted form and of all lambdas and quoted lists
+// nested in it with atoms interned in the given state. The form is interned
+// just before being executed, so that the atoms are interned in source
+// order.
+static void intern_atoms(struct loader *l, struct obj_lambda *form)
+{
+  int count = 0;
+  l->objs[count++] = &form->obj;
+
+  while (count > 0) {
+    struct obj *obj = l->objs[--count];
+
+    if (obj->type == OBJ_PAIR) {
+      struct obj_pair *pair = (struct obj_pair *) obj;
+      intern_slot(l, obj, &pair->car, &count);
+      intern_slot(l, obj, &pair->cdr, &count);
+      continue;
+    }
+
+    struct obj_lambda *lambda = (struct obj_lambda *) obj;
+    struct value_array *constants = &lambda->chunk.constants;
+    for (int i = 0; i < constants->count; ++i)
+      intern_slot(l, obj, &constants->values[i], &count);
+  }
+}
+
+void loader_init(struct loader *l, struct wisp_state *w, const char *source,
+    int jobs)
+{
+  l->w = w;
+  l->batches = NULL;
+  l->batch_count = 0;
+  l->batch_capacity = 0;
+  l->next_batch = 0;
+  l->batch = 0;
+  l->form = 0;
+  l->is_stopping = false;
+  l->obj_capacity = GROW_CAPACITY(0);
+  l->objs = malloc(sizeof(struct obj *) * l->obj_capacity);
+  if (l->objs == NULL)
+    exit(1);
+
+  split_source(l, source, jobs);
+
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_cond_init(&l->changed, NULL);
+
+  l->threads = malloc(sizeof(pthread_t) * jobs);
+  if (l->threads == NULL)
+    exit(1);
+
+  // The count is read by the workers, so it must be final before they start.
+  pthread_mutex_lock(&l->lock);
+  l->thread_count = 0;
+
+  for (int i = 0; i < jobs; ++i)
+    if (pthread_create(&l->threads[l->thread_count], NULL, worker, l) == 0)
+      l->thread_count++;
+
+  pthread_mutex_unlock(&l->lock);
+}
+
+bool loader_next(struct loader *l, struct obj_lambda **lambda)
+{
+  while (l->batch < l->batch_count) {
+    struct batch *b = &l->batches[l->batch];
+
+    if (l->thread_count == 0 && !b->is_compiled) {
+      // No thread could be started, compile the batch here.
+      batch_compile(b, l->w->lazy_compile);
+      b->is_compiled = true;
+    }
+
+    pthread_mutex_lock(&l->lock);
+    while (!b->is_compiled)
+      pthread_cond_wait(&l->changed, &l->lock);
+    pthread_mutex_unlock(&l->lock);
+
+    if (b->w != NULL) {
+      batch_adopt(l->w, b);
+      batch_free(b);
+    }
+
+    if (l->form < b->forms->chunk.constants.count) {
+      *lambda = AS_LAMBDA(b->forms->chunk.constants.values[l->form++]);
+      intern_atoms(l, *lambda);
+      return true;
+    }
+
+    if (b->had_error) {
+      *lambda = NULL;
+      return true;
+    }
+
+    l->w->pending_forms = NULL;
+    l->form = 0;
+
+    pthread_mutex_lock(&l->lock);
+    l->batch++;
+    pthread_cond_broadcast(&l->changed);
+    pthread_mutex_unlock(&l->lock);
+  }
+
+  return false;
+}
+
+void loader_free(struct loader *l)
+{
+  pthread_mutex_lock(&l->lock);
+  l->is_stopping = true;
+  pthread_cond_broadcast(&l->changed);
+  pthread_mutex_unlock(&l->lock);
+
+  for (int i = 0; i < l->thread_count; ++i)
+    pthread_join(l->threads[i], NULL);
+
+  for (int i = 0; i < l->batch_count; ++i)
+    batch_free(&l->batches[i]);
+
+  l->w->pending_forms = NULL;
+
+  pthread_cond_destroy(&l->changed);
+  pthread_mutex_destroy(&l->lock);
+  free(l->objs);
+  free(l->threads);
+  free(l->batches);
+}
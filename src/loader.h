@@ -0,0 +1,66 @@
+#ifndef WISP_LOADER_H
+#define WISP_LOADER_H
+
+#include <pthread.h>
+
+#include "common.h"
+#include "value.h"
+
+struct batch;
+
+// Compiles the top-level forms of a source on a pool of threads, and hands
+// the compiled forms over to the state in source order, so that they execute
+// exactly as if they had been compiled one by one. Each batch of forms is
+// compiled in a private state, whose objects are then moved over as a whole.
+struct loader {
+  // The state the compiled forms are executed in.
+  struct wisp_state *w;
+
+  // Consecutive parts of the source, each compiled as a whole by one thread.
+  struct batch *batches;
+
+  // Number of the batches.
+  int batch_count;
+
+  // Capacity of the 'batches' array.
+  int batch_capacity;
+
+  // The threads compiling the batches.
+  pthread_t *threads;
+
+  // Number of the threads that could be started.
+  int thread_count;
+
+  // Guards the fields below, and whether the batches have been compiled.
+  pthread_mutex_t lock;
+
+  // Signalled whenever a batch is compiled or executed, or the loader stops.
+  pthread_cond_t changed;
+
+  // The next batch to be compiled.
+  int next_batch;
+
+  // The batch the next form is executed from.
+  int batch;
+
+  // Whether the threads should stop compiling, even if batches are left.
+  bool is_stopping;
+
+  // Index of the next form to be executed within the batch.
+  int form;
+
+  // Work stack of the lambdas, and of the pairs of quoted lists, whose atoms
+  // are being interned.
+  struct obj **objs;
+
+  // Capacity of the 'objs' array.
+  int obj_capacity;
+};
+
+void loader_init(struct loader *, struct wisp_state *, const char *, int);
+
+bool loader_next(struct loader *, struct obj_lambda **);
+
+void loader_free(struct loader *);
+
+#endif
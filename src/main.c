@@ -1,8 +1,21 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "compiler.h"
+#include "image.h"
+#include "loader.h"
+#include "natives.h"
 #include "scanner.h"
+#include "server.h"
+#include "snapshot.h"
 #include "state.h"
 #include "value.h"
 #include "vm.h"
@@ -12,6 +25,42 @@
 #define EXIT_SOFTWARE_ERROR 70
 #define EXIT_IO_ERROR 74
 
+// Options of running a program, given on the command line.
+struct options {
+  // Whether lambda bodies are compiled on their first call.
+  bool lazy_compile;
+
+  // Whether compiled images of the source are cached.
+  bool use_cache;
+
+  // Number of threads compiling the source.
+  int jobs;
+
+  // Path of the snapshot the state is restored from, or NULL.
+  const char *restore_path;
+
+  // Path the state is snapshotted into once the program ends, or NULL.
+  const char *snapshot_path;
+
+  // Path of the socket requests are served on once the program ends, or
+  // NULL.
+  const char *serve_path;
+
+  // Whether the heap is backed by transparent huge pages.
+  bool huge_pages;
+
+  // Number of threads marking objects when collecting garbage at once.
+  int gc_threads;
+
+  // Longest pause of collecting garbage incrementally, in microseconds, or
+  // 0 to collect all of it at once.
+  int max_gc_pause;
+
+  // Whether the heap is compacted between the requests served, once
+  // fragmented.
+  bool compact;
+};
+
 static char *read_file(const char *path)
 {
   FILE *f = fopen(path, "r");
@@ -56,11 +105,72 @@ static char *read_file(const char *path)
   return buffer;
 }
 
+// Maps a regular file into memory, returning NULL if it cannot be mapped.
+// As the mapped source must be null-terminated, files whose size is
+// a multiple of the page size are not mapped. The remainder of the last page
+// of any other file is filled with zeros.
+static char *map_file(const char *path, size_t *size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0
+      || st.st_size % sysconf(_SC_PAGESIZE) == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void *source = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd,
+      0);
+  close(fd);
+
+  if (source == MAP_FAILED)
+    return NULL;
+
+  // The source is scanned front to back exactly once.
+  posix_madvise(source, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL);
+
+  *size = (size_t) st.st_size;
+  return source;
+}
+
+// Finds the path of the cached image of the source with the given hash,
+// creating the cache directory if needed. The cache directory is taken from
+// WISP_CACHE_DIR, caching being disabled if it is empty, and defaults to
+// $XDG_CACHE_HOME/wisp or ~/.cache/wisp.
+static bool cache_path(char *path, size_t size, uint64_t hash)
+{
+  const char *dir = getenv("WISP_CACHE_DIR");
+  int len;
+
+  if (dir != NULL)
+    len = snprintf(path, size, "%s", dir);
+  else if ((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0')
+    len = snprintf(path, size, "%s/wisp", dir);
+  else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0') {
+    snprintf(path, size, "%s/.cache", dir);
+    mkdir(path, 0700);
+    len = snprintf(path, size, "%s/.cache/wisp", dir);
+  } else
+    return false;
+
+  if (len <= 0 || (size_t) len >= size
+      || (mkdir(path, 0700) == -1 && errno != EEXIST))
+    return false;
+
+  int name_len = snprintf(path + len, size - len, "/%016" PRIx64 ".wimg",
+      hash);
+  return name_len > 0 && (size_t) name_len < size - len;
+}
+
 static void run_repl()
 {
   char line[1024];
   struct wisp_state w;
   wisp_state_init(&w);
+  natives_define(&w);
 
   // TODO: Read arbitrarily long lines.
   for (;;) {
@@ -78,32 +188,120 @@ static void run_repl()
   wisp_state_free(&w);
 }
 
-static int run_file(const char *path)
+static int run_file(const char *path, const struct options *opts)
 {
+  bool lazy_compile = opts->lazy_compile;
+  int jobs = opts->jobs;
   int exit_code = EXIT_SUCCESS;
 
-  char *source = read_file(path);
+  // Without a path, an empty program is run, so that a restored or
+  // a fresh state can be served.
+  size_t mapped_size = 0;
+  char *source = path == NULL ? calloc(1, 1) : map_file(path, &mapped_size);
+  if (source == NULL && path != NULL)
+    source = read_file(path);
   if (source == NULL)
     return EXIT_IO_ERROR;
 
   struct wisp_state w;
   wisp_state_init(&w);
+  w.pool.huge_pages = opts->huge_pages;
+  w.gc_threads = opts->gc_threads;
+  w.max_gc_pause = opts->max_gc_pause;
+  w.compact_idle = opts->compact;
+
+  // The snapshot must be restored before anything is allocated, natives
+  // included, as the restored objects are used in place.
+  if (opts->restore_path != NULL
+      && !wisp_state_restore(&w, opts->restore_path)) {
+    fprintf(stderr, "Cannot restore the snapshot '%s'\n", opts->restore_path);
+    wisp_state_free(&w);
+
+    if (mapped_size > 0)
+      munmap(source, mapped_size);
+    else
+      free(source);
+
+    return EXIT_IO_ERROR;
+  }
+
+  natives_define(&w);
+
+  // The source stays available until the state is freed, so lambda bodies
+  // can be compiled on their first call.
+  w.lazy_compile = lazy_compile;
+
+  // A source compiled before is executed from its cached image. Otherwise,
+  // the image is written as the source is compiled, unless lambda bodies
+  // are compiled lazily, and kept only if all of the source is executed.
+  size_t source_len = mapped_size > 0 ? mapped_size : strlen(source);
+  uint64_t hash = image_hash(source, source_len);
+  char image_path[4096];
+  struct image img;
+  struct image_writer iw;
+
+  bool use_cache = opts->use_cache && path != NULL
+    && cache_path(image_path, sizeof(image_path), hash);
+  bool use_image = use_cache
+    && image_open(&img, &w, image_path, hash, source_len);
+  bool write_image = use_cache && !use_image && !lazy_compile
+    && image_writer_open(&iw, image_path, hash, source_len);
+
+  // Execute each top-level form as soon as it is compiled. Its bytecode is
+  // garbage once executed, so the memory use does not grow with the source.
+  // With more jobs, the forms are compiled ahead on other threads instead.
+  struct toplevel t;
+  struct loader l;
+
+  if (!use_image && jobs > 1)
+    loader_init(&l, &w, source, jobs);
+  else if (!use_image)
+    toplevel_init(&t, source, 1);
+
+  struct obj_lambda *lambda;
+  while (use_image ? image_next(&img, &lambda)
+       : jobs > 1 ? loader_next(&l, &lambda)
+       : compile_next(&w, &t, &lambda)) {
+    if (lambda == NULL) {
+      exit_code = EXIT_DATA_ERROR;
+      break;
+    }
+
+    if (write_image)
+      image_write_form(&iw, lambda);
 
-  struct obj_lambda *lambda = compile(&w, source);
-  if (lambda == NULL) {
-    exit_code = EXIT_DATA_ERROR;
-    goto end;
+    if (!interpret(&w, lambda)) {
+      exit_code = EXIT_SOFTWARE_ERROR;
+      break;
+    }
   }
 
-  bool success = interpret(&w, lambda);
-  if (!success) {
-    exit_code = EXIT_SOFTWARE_ERROR;
-    goto end;
+  if (use_image)
+    image_close(&img);
+  else if (jobs > 1)
+    loader_free(&l);
+
+  if (write_image)
+    image_writer_close(&iw, exit_code == EXIT_SUCCESS);
+
+  // Lambda bodies compiled lazily are compiled while the source is still
+  // available, so they are part of the snapshot.
+  if (exit_code == EXIT_SUCCESS && opts->snapshot_path != NULL
+      && !wisp_state_snapshot(&w, opts->snapshot_path)) {
+    fprintf(stderr, "Cannot write the snapshot '%s'\n", opts->snapshot_path);
+    exit_code = EXIT_IO_ERROR;
   }
 
-end:
+  if (exit_code == EXIT_SUCCESS && opts->serve_path != NULL
+      && !server_run(&w, opts->serve_path))
+    exit_code = EXIT_IO_ERROR;
+
   wisp_state_free(&w);
-  free(source);
+
+  if (mapped_size > 0)
+    munmap(source, mapped_size);
+  else
+    free(source);
 
   return exit_code;
 }
@@ -111,13 +309,63 @@ end:
 int main(int argc, const char **argv)
 {
   int exit_code = EXIT_SUCCESS;
-  if (argc == 1)
+  struct options opts = {false, true, 1, NULL, NULL, NULL, false, 1, 0,
+    false};
+  int arg = 1;
+
+  while (arg < argc && argv[arg][0] == '-') {
+    if (strcmp(argv[arg], "--lazy") == 0) {
+      opts.lazy_compile = true;
+      arg++;
+    } else if (strcmp(argv[arg], "--huge-pages") == 0) {
+      opts.huge_pages = true;
+      arg++;
+    } else if (strcmp(argv[arg], "--compact") == 0) {
+      opts.compact = true;
+      arg++;
+    } else if (strcmp(argv[arg], "--no-cache") == 0) {
+      opts.use_cache = false;
+      arg++;
+    } else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc
+        && (opts.jobs = atoi(argv[arg + 1])) > 0)
+      arg += 2;
+    else if (strcmp(argv[arg], "--gc-threads") == 0 && arg + 1 < argc
+        && (opts.gc_threads = atoi(argv[arg + 1])) > 0)
+      arg += 2;
+    else if (strcmp(argv[arg], "--max-pause") == 0 && arg + 1 < argc
+        && (opts.max_gc_pause = atoi(argv[arg + 1])) > 0)
+      arg += 2;
+    else if (strcmp(argv[arg], "--restore") == 0 && arg + 1 < argc) {
+      opts.restore_path = argv[arg + 1];
+      arg += 2;
+    } else if (strcmp(argv[arg], "--snapshot") == 0 && arg + 1 < argc) {
+      opts.snapshot_path = argv[arg + 1];
+      arg += 2;
+    } else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc) {
+      opts.serve_path = argv[arg + 1];
+      arg += 2;
+    } else
+      break;
+  }
+
+  if (arg == argc && opts.serve_path != NULL)
+    exit_code = run_file(NULL, &opts);
+  else if (arg == argc && opts.restore_path == NULL
+      && opts.snapshot_path == NULL)
     run_repl();
-  else if (argc == 2)
-    exit_code = run_file(argv[1]);
+  else if (arg == argc - 1 && argv[arg][0] != '-')
+    exit_code = run_file(argv[arg], &opts);
   else {
     exit_code = EXIT_USAGE_ERROR;
-    fprintf(stderr, "Usage: wisp [path]\n");
+    fprintf(stderr, "Usage: wisp [--lazy] [--jobs n] [--no-cache] "
+        "[--huge-pages] [--gc-threads n] [--max-pause us] [--compact] "
+        "[--restore snapshot] [--snapshot snapshot] [--serve socket] "
+        "[path]\n");
   }
+
+#ifdef DEBUG_PROFILE_OPCODES
+  vm_profile_print();
+#endif
+
   return exit_code;
 }
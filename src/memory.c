@@ -1,24 +1,61 @@
+#define _POSIX_C_SOURCE 200809L
+
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #endif
 
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "compiler.h"
 #include "memory.h"
+#include "pool.h"
+#include "reader.h"
 #include "state.h"
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void obj_mark(struct wisp_state *w, struct obj *obj)
+// Number of gray objects a marking thread keeps to itself before sharing
+// some with the other marking threads.
+#define MARK_SHARE_MIN 64
+
+// Number of objects an incremental collection processes between checking
+// whether its slice has used up the pause budget.
+#define GC_SLICE_OBJECTS 256
+
+// Number of pages a slice of lazy sweeping sweeps.
+#define GC_SWEEP_PAGES 2
+
+// Objects are collected in two generations, without being moved, as the
+// interpreter holds plain pointers to them. Objects surviving a collection
+// stay marked until the next full collection, which makes them old: minor
+// collections stop marking at them, and only sweep the pool pages allocated
+// on since the last collection. An old object into which a reference is
+// stored is remembered, and marked again by the next minor collection,
+// along with everything young it refers to. The mark bits are kept in the
+// bitmaps of the pages, which are swept a word of objects at a time.
+//
+// A full collection can also be incremental, done in slices between which
+// the program runs. It first unmarks the old objects, then marks the
+// reachable ones and finally sweeps the unmarked ones. Objects allocated
+// meanwhile start unmarked, and no minor collections are done. A marked
+// object into which a reference is stored is remembered, and marked again
+// before marking finishes. Marking finishes once marking the roots and the
+// remembered objects finds nothing new, all within one slice.
+//
+// Otherwise, a full collection marks all objects at once, but sweeps them
+// lazily, in slices like those of an incremental collection, so that freeing
+// the unreachable objects is left out of its pause. A page is swept before
+// anything is allocated on it, so the objects allocated meanwhile are young,
+// and never freed by the sweep.
+
+// Pushes a marked object onto the gray stack, so that the objects it refers
+// to are marked as well.
+static void gray_push(struct wisp_state *w, struct obj *obj)
 {
-  if (obj == NULL || obj->is_marked)
-    return;
-
-#ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void *) obj);
-  obj_print(obj);
-  printf("\n");
-#endif
-  obj->is_marked = true;
-
   if (w->gray_count >= w->gray_capacity) {
     w->gray_capacity = GROW_CAPACITY(w->gray_capacity);
     w->gray_stack = realloc(w->gray_stack,
@@ -32,6 +69,42 @@ void obj_mark(struct wisp_state *w, struct obj *obj)
   w->gray_stack[w->gray_count++] = obj;
 }
 
+// Marks the object, returning whether it was unmarked.
+static bool obj_set_marked(struct obj *obj)
+{
+  if (obj->is_static)
+    return false;
+
+  if (obj->is_large) {
+    struct pool_large *large = POOL_LARGE(obj);
+    bool was_marked = large->is_marked;
+    large->is_marked = true;
+    return !was_marked;
+  }
+
+  size_t index = POOL_INDEX(obj);
+  uint64_t *word = &POOL_PAGE_OF(obj)->marked[index / 64];
+  uint64_t bit = (uint64_t) 1 << (index % 64);
+  if (*word & bit)
+    return false;
+
+  *word |= bit;
+  return true;
+}
+
+void obj_mark(struct wisp_state *w, struct obj *obj)
+{
+  if (obj == NULL || !obj_set_marked(obj))
+    return;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void *) obj);
+  obj_print(obj);
+  printf("\n");
+#endif
+  gray_push(w, obj);
+}
+
 static void mark_roots(struct wisp_state *w)
 {
   for (Value *slot = w->stack; slot < w->stack_top; ++slot)
@@ -47,11 +120,15 @@ static void mark_roots(struct wisp_state *w)
     obj_mark(w, (struct obj *) upvalue);
 
   table_mark(w, &w->globals);
-
-  // compiler_mark_roots();  // TODO
+  obj_mark(w, (struct obj *) w->pending_forms);
+  compiler_mark_roots(w);
+  reader_mark_roots(w);
 }
 
-static void obj_blacken(struct wisp_state *w, struct obj *obj)
+// Marks the objects the given one refers to by the given function, so that
+// the same tracing serves marking on one thread and on many.
+static void obj_blacken(struct obj *obj, void (*mark)(void *, struct obj *),
+    void *ctx)
 {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void *) obj);
@@ -63,10 +140,10 @@ static void obj_blacken(struct wisp_state *w, struct obj *obj)
     break;
   case OBJ_CLOSURE: {
     struct obj_closure *closure = (struct obj_closure *) obj;
-    obj_mark(w, (struct obj *) closure->lambda);
+    mark(ctx, (struct obj *) closure->lambda);
 
     for (int i = 0; i < closure->upvalue_count; ++i)
-      obj_mark(w, (struct obj *) closure->upvalues[i]);
+      mark(ctx, (struct obj *) closure->upvalues[i]);
     break;
   }
   case OBJ_LAMBDA: {
@@ -74,35 +151,305 @@ static void obj_blacken(struct wisp_state *w, struct obj *obj)
 
     for (int i = 0; i < lambda->chunk.constants.count; ++i)
       if (IS_OBJ(lambda->chunk.constants.values[i]))
-        obj_mark(w, AS_OBJ(lambda->chunk.constants.values[i]));
+        mark(ctx, AS_OBJ(lambda->chunk.constants.values[i]));
+
+    mark(ctx, (struct obj *) lambda->image);
     break;
   }
+  case OBJ_NATIVE:
+    break;
   case OBJ_UPVALUE: {
     struct obj_upvalue *upvalue = (struct obj_upvalue *) obj;
 
     if (IS_OBJ(upvalue->closed))
-      obj_mark(w, AS_OBJ(upvalue->closed));
+      mark(ctx, AS_OBJ(upvalue->closed));
     break;
   }
   case OBJ_PAIR: {
     struct obj_pair *pair = (struct obj_pair *) obj;
 
     if (IS_OBJ(pair->car))
-      obj_mark(w, AS_OBJ(pair->car));
+      mark(ctx, AS_OBJ(pair->car));
 
     if (IS_OBJ(pair->cdr))
-      obj_mark(w, AS_OBJ(pair->cdr));
+      mark(ctx, AS_OBJ(pair->cdr));
     break;
   }
+  case OBJ_MAPPING:
+    break;
+  case OBJ_BYTES:
+    mark(ctx, (struct obj *) ((struct obj_bytes *) obj)->mapping);
+    break;
   }
 }
 
-static void trace_references(struct wisp_state *w)
+static void mark_ref(void *w, struct obj *obj)
 {
-  while (w->gray_count > 0) {
+  obj_mark(w, obj);
+}
+
+// Traces at most the given number of gray objects, returning whether none
+// are left.
+static bool trace_references(struct wisp_state *w, size_t count)
+{
+  for (; w->gray_count > 0 && count > 0; --count) {
     struct obj *obj = w->gray_stack[--w->gray_count];
-    obj_blacken(w, obj);
+    obj_blacken(obj, mark_ref, w);
   }
+
+  return w->gray_count == 0;
+}
+
+// Marking shared by several threads, each of which marks the objects it
+// takes from its gray objects, and steals them from the other threads once
+// out of them. Marking is done once all threads are out of gray objects.
+struct parallel_mark {
+  // The marking threads, the first one being the collecting thread.
+  struct marker *markers;
+
+  // Number of the marking threads.
+  int count;
+
+  // Guards the counts below, and signals their changes.
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  // Number of gray objects the threads have shared and not yet stolen.
+  long available;
+
+  // Number of the threads out of gray objects.
+  int idle;
+
+  // Whether all threads have run out of gray objects.
+  bool is_done;
+};
+
+// A marking thread. It pushes and pops its local gray objects without
+// locking, and only shares some with the other threads, which steal them
+// from the shared end, when it has enough and the shared end is empty.
+struct marker {
+  struct parallel_mark *pm;
+  pthread_t thread;
+
+  // Gray objects only this thread takes from.
+  struct obj **local;
+  size_t local_count;
+  size_t local_capacity;
+
+  // Guards the shared gray objects.
+  pthread_mutex_t lock;
+
+  // Gray objects any thread may steal.
+  struct obj **shared;
+  size_t shared_count;
+  size_t shared_capacity;
+};
+
+static void reserve_grays(struct obj ***grays, size_t *capacity, size_t count)
+{
+  if (count <= *capacity)
+    return;
+
+  while (*capacity < count)
+    *capacity = GROW_CAPACITY(*capacity);
+
+  *grays = realloc(*grays, sizeof(struct obj *) * *capacity);
+  if (*grays == NULL)
+    exit(1);
+}
+
+static void marker_push(struct marker *m, struct obj *obj)
+{
+  reserve_grays(&m->local, &m->local_capacity, m->local_count + 1);
+  m->local[m->local_count++] = obj;
+}
+
+// Marks the object, unless any thread has marked it already. The mark bits
+// of a page share words, so they are set atomically, though only once they
+// are found unset, to keep the words from bouncing between the threads.
+static void mark_ref_atomic(void *m, struct obj *obj)
+{
+  if (obj == NULL || obj->is_static)
+    return;
+
+  if (obj->is_large) {
+    bool *mark = &POOL_LARGE(obj)->is_marked;
+    if (__atomic_load_n(mark, __ATOMIC_RELAXED)
+        || __atomic_exchange_n(mark, true, __ATOMIC_RELAXED))
+      return;
+  } else {
+    size_t index = POOL_INDEX(obj);
+    uint64_t *word = &POOL_PAGE_OF(obj)->marked[index / 64];
+    uint64_t bit = (uint64_t) 1 << (index % 64);
+    if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+        || (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit))
+      return;
+  }
+
+  marker_push(m, obj);
+}
+
+// Shares the older half of the local gray objects, which are likely to lead
+// to more objects than the recent ones.
+static void marker_share(struct marker *m)
+{
+  size_t count = m->local_count / 2;
+
+  pthread_mutex_lock(&m->lock);
+  reserve_grays(&m->shared, &m->shared_capacity, m->shared_count + count);
+  memcpy(m->shared + m->shared_count, m->local,
+      sizeof(struct obj *) * count);
+  __atomic_store_n(&m->shared_count, m->shared_count + count,
+      __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&m->lock);
+
+  m->local_count -= count;
+  memmove(m->local, m->local + count, sizeof(struct obj *) * m->local_count);
+
+  struct parallel_mark *pm = m->pm;
+  pthread_mutex_lock(&pm->lock);
+  pm->available += (long) count;
+  if (pm->idle > 0)
+    pthread_cond_broadcast(&pm->changed);
+  pthread_mutex_unlock(&pm->lock);
+}
+
+// Steals half of the shared gray objects of another thread, returning
+// whether there were any.
+static bool marker_steal(struct marker *m)
+{
+  struct parallel_mark *pm = m->pm;
+  int self = (int) (m - pm->markers);
+
+  for (int i = 1; i < pm->count; ++i) {
+    struct marker *victim = &pm->markers[(self + i) % pm->count];
+    if (__atomic_load_n(&victim->shared_count, __ATOMIC_RELAXED) == 0)
+      continue;
+
+    pthread_mutex_lock(&victim->lock);
+    size_t count = (victim->shared_count + 1) / 2;
+    size_t left = victim->shared_count - count;
+
+    reserve_grays(&m->local, &m->local_capacity, m->local_count + count);
+    memcpy(m->local + m->local_count, victim->shared + left,
+        sizeof(struct obj *) * count);
+    m->local_count += count;
+    __atomic_store_n(&victim->shared_count, left, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&victim->lock);
+
+    if (count == 0)
+      continue;
+
+    pthread_mutex_lock(&pm->lock);
+    pm->available -= (long) count;
+    pthread_mutex_unlock(&pm->lock);
+    return true;
+  }
+
+  return false;
+}
+
+// Waits until another thread shares gray objects, returning false once all
+// threads are out of them.
+static bool marker_wait(struct marker *m)
+{
+  struct parallel_mark *pm = m->pm;
+  pthread_mutex_lock(&pm->lock);
+
+  bool is_idle = pm->available <= 0;
+  if (is_idle && ++pm->idle == pm->count) {
+    pm->is_done = true;
+    pthread_cond_broadcast(&pm->changed);
+  }
+
+  while (pm->available <= 0 && !pm->is_done)
+    pthread_cond_wait(&pm->changed, &pm->lock);
+
+  bool is_done = pm->is_done;
+  if (is_idle && !is_done)
+    pm->idle--;
+
+  pthread_mutex_unlock(&pm->lock);
+  return !is_done;
+}
+
+static void marker_run(struct marker *m)
+{
+  do {
+    while (m->local_count > 0) {
+      struct obj *obj = m->local[--m->local_count];
+      obj_blacken(obj, mark_ref_atomic, m);
+
+      if (m->local_count >= 2 * MARK_SHARE_MIN
+          && __atomic_load_n(&m->shared_count, __ATOMIC_RELAXED) == 0)
+        marker_share(m);
+    }
+  } while (marker_steal(m) || marker_wait(m));
+}
+
+static void *marker_thread(void *m)
+{
+  marker_run(m);
+  return NULL;
+}
+
+// Traces the gray objects on the given number of threads, the collecting
+// one included. The other threads start out of gray objects, stealing the
+// ones the collecting thread shares.
+static void trace_parallel(struct wisp_state *w, int thread_count)
+{
+  struct parallel_mark pm;
+  pm.markers = calloc((size_t) thread_count, sizeof(struct marker));
+  if (pm.markers == NULL)
+    exit(1);
+
+  pm.count = thread_count;
+  pthread_mutex_init(&pm.lock, NULL);
+  pthread_cond_init(&pm.changed, NULL);
+  pm.available = 0;
+  pm.idle = 0;
+  pm.is_done = false;
+
+  for (int i = 0; i < thread_count; ++i) {
+    pm.markers[i].pm = &pm;
+    pthread_mutex_init(&pm.markers[i].lock, NULL);
+  }
+
+  for (int i = 0; i < w->gray_count; ++i)
+    marker_push(&pm.markers[0], w->gray_stack[i]);
+
+  w->gray_count = 0;
+  bool *is_started = calloc((size_t) thread_count, sizeof(bool));
+  if (is_started == NULL)
+    exit(1);
+
+  // A thread that cannot be started counts as out of gray objects.
+  for (int i = 1; i < thread_count; ++i) {
+    struct marker *m = &pm.markers[i];
+    is_started[i] = pthread_create(&m->thread, NULL, marker_thread, m) == 0;
+
+    if (!is_started[i]) {
+      pthread_mutex_lock(&pm.lock);
+      pm.idle++;
+      pthread_mutex_unlock(&pm.lock);
+    }
+  }
+
+  marker_run(&pm.markers[0]);
+
+  for (int i = 0; i < thread_count; ++i) {
+    if (is_started[i])
+      pthread_join(pm.markers[i].thread, NULL);
+
+    pthread_mutex_destroy(&pm.markers[i].lock);
+    free(pm.markers[i].local);
+    free(pm.markers[i].shared);
+  }
+
+  pthread_cond_destroy(&pm.changed);
+  pthread_mutex_destroy(&pm.lock);
+  free(is_started);
+  free(pm.markers);
 }
 
 static void obj_free(struct wisp_state *w, struct obj *obj)
@@ -114,66 +461,317 @@ static void obj_free(struct wisp_state *w, struct obj *obj)
   case OBJ_ATOM: {
     struct obj_string *str = (struct obj_string *) obj;
     FREE_ARRAY(w, char, str->chars, str->len + 1);
-    FREE(w, struct obj_string, obj);
+    FREE_OBJ(w, struct obj_string, obj);
     break;
   }
   case OBJ_CLOSURE: {
     struct obj_closure *closure = (struct obj_closure *) obj;
     FREE_ARRAY(w, struct obj_upvalue *, closure->upvalues,
         closure->upvalue_count);
-    FREE(w, struct obj_closure, obj);
+    FREE_OBJ(w, struct obj_closure, obj);
     break;
   }
   case OBJ_LAMBDA: {
     struct obj_lambda *lambda = (struct obj_lambda *) obj;
-    chunk_free(w, &lambda->chunk);
-    FREE(w, struct obj_lambda, obj);
+
+    // The bytecode and lines of a lambda loaded from an image stay mapped.
+    if (lambda->image != NULL)
+      value_array_free(w, &lambda->chunk.constants);
+    else
+      chunk_free(w, &lambda->chunk);
+
+    if (lambda->lazy != NULL)
+      lazy_body_free(w, lambda->lazy);
+
+    FREE_OBJ(w, struct obj_lambda, obj);
     break;
   }
+  case OBJ_NATIVE:
+    FREE_OBJ(w, struct obj_native, obj);
+    break;
   case OBJ_UPVALUE:
-    FREE(w, struct obj_upvalue, obj);
+    FREE_OBJ(w, struct obj_upvalue, obj);
     break;
   case OBJ_PAIR:
-    FREE(w, struct obj_pair, obj);
+    FREE_OBJ(w, struct obj_pair, obj);
+    break;
+  case OBJ_MAPPING: {
+    struct obj_mapping *mapping = (struct obj_mapping *) obj;
+
+    if (mapping->start != NULL)
+      munmap(mapping->start, mapping->size);
+
+    FREE_OBJ(w, struct obj_mapping, obj);
+    break;
+  }
+  case OBJ_BYTES:
+    FREE_OBJ(w, struct obj_bytes, obj);
     break;
   }
 }
 
-static void sweep(struct wisp_state *w)
+void obj_remember(struct wisp_state *w, struct obj *obj)
 {
-  struct obj *prev = NULL;
-  struct obj *obj = w->objects;
+  obj->is_remembered = true;
 
-  while (obj != NULL) {
-    if (obj->is_marked) {
-      obj->is_marked = false;
-      prev = obj;
-      obj = obj->next;
-    } else {
-      struct obj *unreached = obj;
-      obj = obj->next;
+  if (w->remembered_count >= w->remembered_capacity) {
+    w->remembered_capacity = GROW_CAPACITY(w->remembered_capacity);
+    w->remembered = realloc(w->remembered,
+        sizeof(struct obj *) * w->remembered_capacity);
 
-      if (prev == NULL)
-        w->objects = obj;
-      else
-        prev->next = obj;
+    if (w->remembered == NULL)
+      exit(1);
+  }
+
+  w->remembered[w->remembered_count++] = obj;
+}
+
+// Traces the remembered objects again, and forgets them.
+static void mark_remembered(struct wisp_state *w)
+{
+  for (int i = 0; i < w->remembered_count; ++i) {
+    w->remembered[i]->is_remembered = false;
+    gray_push(w, w->remembered[i]);
+  }
+
+  w->remembered_count = 0;
+}
+
+static void forget_remembered(struct wisp_state *w)
+{
+  for (int i = 0; i < w->remembered_count; ++i)
+    w->remembered[i]->is_remembered = false;
+
+  w->remembered_count = 0;
+}
+
+// Frees the unmarked objects of the page, a word of mark bits at a time.
+// The marked objects stay marked, so they are old from now on.
+static void sweep_page(struct wisp_state *w, struct pool_page *page)
+{
+  for (size_t i = 0; i < POOL_BITMAP_WORDS; ++i) {
+    uint64_t unmarked = page->allocated[i] & ~page->marked[i];
 
-      obj_free(w, unreached);
+    for (; unmarked != 0; unmarked &= unmarked - 1) {
+      size_t bit = (size_t) __builtin_ctzll(unmarked);
+      obj_free(w, POOL_OBJ(page, i * 64 + bit));
     }
   }
+
+  page->has_young = false;
+  page->is_unswept = false;
+}
+
+// Frees the unmarked large objects, starting from the given one, until the
+// given number of objects has been swept. Returns the next object to sweep.
+static struct pool_large *sweep_large(struct wisp_state *w,
+    struct pool_large *large, size_t count)
+{
+  for (; large != NULL && count > 0; --count) {
+    struct pool_large *next = large->next;
+
+    if (!large->is_marked)
+      obj_free(w, (struct obj *) (large + 1));
+
+    large = next;
+  }
+
+  return large;
 }
 
-static void collect_garbage(struct wisp_state *w)
+// Frees all unmarked objects.
+static void sweep_heap(struct wisp_state *w)
+{
+  for (struct pool_page *page = pool_next_page(&w->pool, NULL);
+      page != NULL;
+      page = pool_next_page(&w->pool, page))
+    sweep_page(w, page);
+
+  sweep_large(w, w->pool.large, SIZE_MAX);
+  w->pool.young_large_count = 0;
+}
+
+// Collects the objects allocated since the last collection. Its cost only
+// depends on the roots, the remembered objects and the survivors, apart from
+// sweeping the pages allocated on, and the large objects and atoms allocated
+// since.
+static void collect_young(struct wisp_state *w)
 {
 #ifdef DEBUG_LOG_GC
-  printf("-- gc begin --\n");
+  printf("-- minor gc begin --\n");
   size_t before = w->bytes_allocated;
 #endif
   mark_roots(w);
-  trace_references(w);
-  str_pool_remove_white(w);
-  sweep(w);
+  mark_remembered(w);
+  trace_references(w, SIZE_MAX);
+  str_pool_remove_young(w);
+
+  for (struct pool_page *page = pool_next_page(&w->pool, NULL);
+      page != NULL;
+      page = pool_next_page(&w->pool, page))
+    if (page->has_young)
+      sweep_page(w, page);
+
+  sweep_large(w, w->pool.large, w->pool.young_large_count);
+  w->pool.young_large_count = 0;
+  w->next_young_gc = w->bytes_allocated + w->nursery_size;
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end --\n");
+  printf("  collected %zu bytes (from %zu to %zu)\n",
+      before - w->bytes_allocated, before, w->bytes_allocated);
+#endif
+}
+
+// Finishes a full collection, once all unreachable objects are freed.
+static void collect_end(struct wisp_state *w)
+{
+  pool_trim(&w->pool);
   w->next_gc = w->bytes_allocated * GC_HEAP_GROW_FACTOR;
+  w->next_young_gc = w->bytes_allocated + w->nursery_size;
+}
+
+static void incremental_begin(struct wisp_state *w)
+{
+#ifdef DEBUG_LOG_GC
+  printf("-- incremental gc begin --\n");
+#endif
+  // The large objects are few, so they are unmarked at once.
+  for (struct pool_large *large = w->pool.large; large != NULL;
+      large = large->next)
+    large->is_marked = false;
+
+  w->gc_phase = GC_CLEAR;
+  w->gc_cursor = pool_next_page(&w->pool, NULL);
+}
+
+// Marks the pages awaiting the sweep, so that the pages split or reused
+// meanwhile are left alone.
+static void sweep_begin(struct wisp_state *w)
+{
+  str_pool_remove_white(w);
+
+  for (struct pool_page *page = pool_next_page(&w->pool, NULL);
+      page != NULL;
+      page = pool_next_page(&w->pool, page))
+    page->is_unswept = true;
+
+  // The large objects allocated from now on are young, and not swept.
+  w->gc_cursor = pool_next_page(&w->pool, NULL);
+  w->sweep_large = w->pool.large;
+  w->pool.young_large_count = 0;
+  w->gc_phase = GC_SWEEP;
+}
+
+// Sweeps at most the given number of the pages awaiting the sweep, returning
+// whether none are left.
+static bool sweep_pages(struct wisp_state *w, int count)
+{
+  while (w->gc_cursor != NULL && count > 0) {
+    struct pool_page *page = w->gc_cursor;
+    w->gc_cursor = pool_next_page(&w->pool, page);
+
+    if (page->is_unswept) {
+      sweep_page(w, page);
+      count--;
+    }
+  }
+
+  return w->gc_cursor == NULL;
+}
+
+static void sweep_end(struct wisp_state *w)
+{
+  w->gc_phase = GC_IDLE;
+  collect_end(w);
+#ifdef DEBUG_LOG_GC
+  printf("-- sweep end --\n");
+  printf("  %zu bytes allocated, next at %zu\n", w->bytes_allocated,
+      w->next_gc);
+#endif
+}
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// Does a slice of the collection in progress, or finishes it. A slice of an
+// incremental collection lasts about the pause budget, and a slice of lazy
+// sweeping sweeps a fixed number of pages.
+static void collect_step(struct wisp_state *w, bool finish)
+{
+  uint64_t deadline = now() + (uint64_t) w->max_gc_pause;
+
+  do {
+    switch (w->gc_phase) {
+    case GC_IDLE:
+      return;
+    case GC_CLEAR:
+      if (w->gc_cursor != NULL) {
+        pool_unmark_page(w->gc_cursor);
+        w->gc_cursor = pool_next_page(&w->pool, w->gc_cursor);
+        break;
+      }
+
+      // The objects remembered so far are unmarked, like the rest.
+      forget_remembered(w);
+      mark_roots(w);
+      w->gc_phase = GC_MARK;
+      break;
+    case GC_MARK:
+      if (!trace_references(w, GC_SLICE_OBJECTS))
+        break;
+
+      // The roots may have changed since the last slice, and the remembered
+      // objects may refer to unmarked ones.
+      mark_roots(w);
+      mark_remembered(w);
+      if (w->gray_count == 0)
+        sweep_begin(w);
+      break;
+    case GC_SWEEP:
+      if (w->sweep_large != NULL)
+        w->sweep_large = sweep_large(w, w->sweep_large, GC_SLICE_OBJECTS);
+      else if (sweep_pages(w, w->max_gc_pause > 0 ? 1 : GC_SWEEP_PAGES))
+        sweep_end(w);
+      break;
+    }
+  } while (finish || now() < deadline);
+}
+
+// Marks all objects reachable from the roots at once.
+static void mark_all(struct wisp_state *w)
+{
+  // A collection in progress is abandoned, once its sweep is done.
+  if (w->gc_phase == GC_SWEEP)
+    collect_step(w, true);
+
+  w->gc_phase = GC_IDLE;
+  w->gray_count = 0;
+
+  // The old objects must be marked again to survive.
+  pool_unmark(&w->pool);
+  forget_remembered(w);
+  mark_roots(w);
+
+  if (w->gc_threads > 1)
+    trace_parallel(w, w->gc_threads);
+  else
+    trace_references(w, SIZE_MAX);
+}
+
+void collect_garbage(struct wisp_state *w)
+{
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin --\n");
+  size_t before = w->bytes_allocated;
+#endif
+  mark_all(w);
+  str_pool_remove_white(w);
+  sweep_heap(w);
+  collect_end(w);
 #ifdef DEBUG_LOG_GC
   printf("-- gc end --\n");
   printf("  collected %zu bytes (from %zu to %zu), next at %zu\n",
@@ -181,18 +779,58 @@ static void collect_garbage(struct wisp_state *w)
 #endif
 }
 
-void *wisp_realloc(struct wisp_state *w, void *ptr, size_t old_size,
-    size_t new_size)
+void collect_young_garbage(struct wisp_state *w)
 {
-  w->bytes_allocated += new_size - old_size;
-  if (new_size > old_size) {
+  if (w->gc_phase != GC_IDLE)
+    collect_step(w, true);
+
+  collect_young(w);
+}
+
+// Collects garbage once enough has been allocated since the last collection,
+// fully if the heap has grown enough. A full collection is either done
+// incrementally, or marks all objects at once and sweeps them lazily. Its
+// slices are done in place of minor collections, but more often, to keep
+// ahead of the allocation. The collection is finished at once if the heap
+// grows too much meanwhile.
+static void collect_if_needed(struct wisp_state *w)
+{
+  if (w->gc_phase != GC_IDLE) {
 #ifdef DEBUG_STRESS_GC
-    collect_garbage(w);
+    collect_step(w, false);
 #endif
-    if (w->bytes_allocated > w->next_gc)
-      collect_garbage(w);
+    if (w->bytes_allocated > w->next_gc * GC_HEAP_GROW_FACTOR)
+      collect_step(w, true);
+    else if (w->bytes_allocated > w->next_young_gc) {
+      collect_step(w, false);
+      w->next_young_gc = w->bytes_allocated + w->nursery_size / 8;
+    }
+    return;
   }
 
+#ifdef DEBUG_STRESS_GC
+  collect_young(w);
+#endif
+  if (w->bytes_allocated > w->next_gc && w->max_gc_pause > 0)
+    incremental_begin(w);
+  else if (w->bytes_allocated > w->next_gc) {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin, sweeping lazily --\n");
+#endif
+    mark_all(w);
+    sweep_begin(w);
+    w->next_young_gc = w->bytes_allocated + w->nursery_size / 8;
+  } else if (w->bytes_allocated > w->next_young_gc)
+    collect_young(w);
+}
+
+void *wisp_realloc(struct wisp_state *w, void *ptr, size_t old_size,
+    size_t new_size)
+{
+  w->bytes_allocated += new_size - old_size;
+  if (new_size > old_size)
+    collect_if_needed(w);
+
   if (new_size == 0) {
     free(ptr);
     return NULL;
@@ -211,13 +849,8 @@ void *wisp_calloc(struct wisp_state *w, size_t old_nmemb, size_t new_nmemb,
   size_t old_size = old_nmemb * size;
   size_t new_size = new_nmemb * size;
   w->bytes_allocated += new_size - old_size;
-  if (new_size > old_size) {
-#ifdef DEBUG_STRESS_GC
-    collect_garbage(w);
-#endif
-    if (w->bytes_allocated > w->next_gc)
-      collect_garbage(w);
-  }
+  if (new_size > old_size)
+    collect_if_needed(w);
 
   void *result = calloc(new_nmemb, size);
   if (result == NULL)
@@ -226,13 +859,35 @@ void *wisp_calloc(struct wisp_state *w, size_t old_nmemb, size_t new_nmemb,
   return result;
 }
 
-void wisp_free_objs(struct wisp_state *w)
+void *wisp_alloc_obj(struct wisp_state *w, size_t size)
 {
-  struct obj *obj = w->objects;
+  w->bytes_allocated += size;
+  collect_if_needed(w);
 
-  while (obj != NULL) {
-    struct obj *next = obj->next;
-    obj_free(w, obj);
-    obj = next;
-  }
+  if (size > POOL_SIZE_MAX)
+    return pool_alloc_large(&w->pool, size);
+
+  // A page awaiting the sweep is swept before it is allocated on, so that
+  // the objects allocated start young, like any others.
+  struct pool_page *page = w->pool.pages[(size - 1) / POOL_GRANULE];
+  if (page != NULL && page->is_unswept)
+    sweep_page(w, page);
+
+  return pool_alloc(&w->pool, size);
+}
+
+void wisp_free_obj(struct wisp_state *w, void *ptr, size_t size)
+{
+  w->bytes_allocated -= size;
+
+  if (size > POOL_SIZE_MAX)
+    pool_dealloc_large(&w->pool, ptr);
+  else
+    pool_dealloc(&w->pool, ptr, size);
+}
+
+void wisp_free_objs(struct wisp_state *w)
+{
+  pool_unmark(&w->pool);
+  sweep_heap(w);
 }
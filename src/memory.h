@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 #include "common.h"
+#include "pool.h"
 #include "value.h"
 
 #define ALLOCATE(w, type, count) \
@@ -21,12 +22,52 @@
 #define FREE_ARRAY(w, type, ptr, old_count) \
   wisp_realloc(w, ptr, sizeof(type) * (old_count), 0)
 
+#define FREE_OBJ(w, type, ptr) wisp_free_obj(w, ptr, sizeof(type))
+
+// Must follow any store of a reference into an object after the object has
+// been allocated and initialized, so that an old object referring to a young
+// one keeps it alive through minor collections, and so that an object
+// already marked by an incremental collection is traced again.
+#define WRITE_BARRIER(w, obj) \
+  do { \
+    if (!(obj)->is_remembered && obj_is_marked(obj)) \
+      obj_remember(w, obj); \
+  } while (false)
+
+static inline bool obj_is_marked(const struct obj *obj)
+{
+  if (obj->is_static)
+    return true;
+
+  if (obj->is_large)
+    return POOL_LARGE(obj)->is_marked;
+
+  return pool_is_marked(obj);
+}
+
 void obj_mark(struct wisp_state *, struct obj *);
 
+void obj_remember(struct wisp_state *, struct obj *);
+
+// Frees all objects unreachable from the roots, young or old, and sets the
+// next full collection to happen once the heap grows enough. An incremental
+// collection in progress is finished or abandoned first.
+void collect_garbage(struct wisp_state *);
+
+// Frees the unreachable objects allocated since the last collection, at a
+// cost independent of the number of old objects. A full collection in
+// progress is finished first.
+void collect_young_garbage(struct wisp_state *);
+
 void *wisp_realloc(struct wisp_state *, void *, size_t, size_t);
 
 void *wisp_calloc(struct wisp_state *, size_t, size_t, size_t);
 
+// Allocates an object from the pool of the state, large ones by malloc.
+void *wisp_alloc_obj(struct wisp_state *, size_t);
+
+void wisp_free_obj(struct wisp_state *, void *, size_t);
+
 void wisp_free_objs(struct wisp_state *);
 
 #endif
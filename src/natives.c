@@ -0,0 +1,397 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "natives.h"
+#include "printer.h"
+#include "reader.h"
+#include "serialize.h"
+#include "state.h"
+#include "strpool.h"
+#include "vm.h"
+
+// Checks that the argument is a byte vector.
+static bool check_bytes(struct wisp_state *w, Value arg)
+{
+  if (IS_BYTES(arg))
+    return true;
+
+  runtime_error(w, "Operand must be a byte vector");
+  return false;
+}
+
+// Checks that the argument is an integer between 0 and the limit inclusive.
+static bool check_index(struct wisp_state *w, Value arg, size_t limit,
+    size_t *index)
+{
+  if (!IS_NUM(arg) || !(AS_NUM(arg) >= 0 && AS_NUM(arg) <= (double) limit)
+      || AS_NUM(arg) != (size_t) AS_NUM(arg)) {
+    runtime_error(w, "Index must be an integer between 0 and %zu", limit);
+    return false;
+  }
+
+  *index = (size_t) AS_NUM(arg);
+  return true;
+}
+
+// Maps the whole file into memory, returning NULL if it cannot be mapped.
+static struct obj_mapping *map_file(struct wisp_state *w, const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+
+  // Empty files cannot be mapped, but are still valid byte vectors.
+  void *start = NULL;
+  if (st.st_size > 0) {
+    start = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (start == MAP_FAILED) {
+      close(fd);
+      return NULL;
+    }
+  }
+
+  close(fd);
+  return mapping_new(w, start, (size_t) st.st_size);
+}
+
+// Copies the path the argument names, an atom, or a byte vector for paths
+// that cannot be written as an atom. Returns NULL if it is neither.
+static char *path_copy(struct wisp_state *w, Value arg)
+{
+  const char *name;
+  size_t len;
+  if (IS_ATOM(arg)) {
+    name = AS_ATOM(arg)->chars;
+    len = AS_ATOM(arg)->len;
+  } else if (IS_BYTES(arg)) {
+    name = (const char *) AS_BYTES(arg)->bytes;
+    len = AS_BYTES(arg)->len;
+  } else {
+    runtime_error(w, "Path must be an atom or a byte vector");
+    return NULL;
+  }
+
+  char *path = malloc(len + 1);
+  if (path == NULL)
+    exit(1);
+
+  memcpy(path, name, len);
+  path[len] = '\0';
+  return path;
+}
+
+// (bytes-map path) evaluates to a byte vector of the contents of the file,
+// mapped into memory rather than read. The path is an atom, or a byte vector
+// for paths that cannot be written as an atom.
+static bool native_bytes_map(struct wisp_state *w, int arg_count,
+    Value *args, Value *result)
+{
+  (void) arg_count;
+
+  char *path = path_copy(w, args[0]);
+  if (path == NULL)
+    return false;
+
+  struct obj_mapping *mapping = map_file(w, path);
+  if (mapping == NULL)
+    runtime_error(w, "Cannot map the file %s", path);
+
+  free(path);
+
+  if (mapping == NULL)
+    return false;
+
+  vm_stack_push(w, OBJ_VAL(mapping));
+  *result = OBJ_VAL(bytes_new(w, mapping, mapping->start, mapping->size));
+  vm_stack_pop(w);
+  return true;
+}
+
+// (bytes-length b) evaluates to the number of bytes in b.
+static bool native_bytes_length(struct wisp_state *w, int arg_count,
+    Value *args, Value *result)
+{
+  (void) arg_count;
+
+  if (!check_bytes(w, args[0]))
+    return false;
+
+  *result = NUM_VAL((double) AS_BYTES(args[0])->len);
+  return true;
+}
+
+// (bytes-ref b i) evaluates to the i-th byte of b, counted from 0.
+static bool native_bytes_ref(struct wisp_state *w, int arg_count,
+    Value *args, Value *result)
+{
+  (void) arg_count;
+
+  size_t index;
+  if (!check_bytes(w, args[0]))
+    return false;
+
+  struct obj_bytes *vector = AS_BYTES(args[0]);
+  if (vector->len == 0) {
+    runtime_error(w, "The byte vector is empty");
+    return false;
+  }
+
+  if (!check_index(w, args[1], vector->len - 1, &index))
+    return false;
+
+  *result = NUM_VAL(vector->bytes[index]);
+  return true;
+}
+
+// (bytes-slice b start end) evaluates to the bytes of b from start up to,
+// but not including, end. The slice shares the bytes of b.
+static bool native_bytes_slice(struct wisp_state *w, int arg_count,
+    Value *args, Value *result)
+{
+  (void) arg_count;
+
+  size_t start;
+  size_t end;
+  if (!check_bytes(w, args[0]))
+    return false;
+
+  struct obj_bytes *vector = AS_BYTES(args[0]);
+  if (!check_index(w, args[1], vector->len, &start)
+      || !check_index(w, args[2], vector->len, &end))
+    return false;
+
+  if (end < start) {
+    runtime_error(w, "The slice cannot end before it starts");
+    return false;
+  }
+
+  *result = OBJ_VAL(bytes_new(w, vector->mapping, vector->bytes + start,
+        end - start));
+  return true;
+}
+
+// (bytes-find b byte start) evaluates to the index of the first occurrence
+// of the byte in b at or after start, or to nil if there is none.
+static bool native_bytes_find(struct wisp_state *w, int arg_count,
+    Value *args, Value *result)
+{
+  (void) arg_count;
+
+  size_t byte;
+  size_t start;
+  if (!check_bytes(w, args[0]) || !check_index(w, args[1], UINT8_MAX, &byte))
+    return false;
+
+  struct obj_bytes *vector = AS_BYTES(args[0]);
+  if (!check_index(w, args[2], vector->len, &start))
+    return false;
+
+  const uint8_t *found = start == vector->len
+                       ? NULL
+                       : memchr(vector->bytes + start, (int) byte,
+                           vector->len - start);
+
+  *result = found == NULL ? NIL_VAL : NUM_VAL((double) (found - vector->bytes));
+  return true;
+}
+
+// (bytes-atom b) evaluates to the atom named by the bytes of b.
+static bool native_bytes_atom(struct wisp_state *w, int arg_count,
+    Value *args, Value *result)
+{
+  (void) arg_count;
+
+  if (!check_bytes(w, args[0]))
+    return false;
+
+  struct obj_bytes *vector = AS_BYTES(args[0]);
+  *result = OBJ_VAL(str_pool_intern(w, (const char *) vector->bytes,
+        vector->len));
+  return true;
+}
+
+// The reader of the standard input, shared by all natives reading it.
+static struct reader *input(struct wisp_state *w)
+{
+  if (w->input == NULL) {
+    w->input = malloc(sizeof(struct reader));
+    if (w->input == NULL)
+      exit(1);
+
+    reader_init(w->input, stdin);
+  }
+
+  return w->input;
+}
+
+// (deserialize) evaluates to the next serialized value of the standard
+// input, or to nil once the input ends.
+static bool native_deserialize(struct wisp_state *w, int arg_count,
+    Value *args, Value *result)
+{
+  (void) arg_count;
+  (void) args;
+
+  if (deserialize(w, input(w), result) == READ_ERROR) {
+    runtime_error(w, "Cannot deserialize the input");
+    return false;
+  }
+
+  return true;
+}
+
+// (read) evaluates to the next datum of the standard input, or to nil once
+// the input ends.
+static bool native_read(struct wisp_state *w, int arg_count, Value *args,
+    Value *result)
+{
+  (void) arg_count;
+  (void) args;
+
+  if (reader_next(w, input(w), result) == READ_ERROR) {
+    runtime_error(w, "Cannot read the input");
+    return false;
+  }
+
+  return true;
+}
+
+// The reader of the file at the path, opened on its first use, which takes
+// over the path. Returns NULL if the file cannot be opened.
+static struct reader *file_reader(struct wisp_state *w, char *path)
+{
+  for (struct file_input *file = w->files; file != NULL; file = file->next)
+    if (strcmp(file->path, path) == 0) {
+      free(path);
+      return file->reader;
+    }
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    runtime_error(w, "Cannot open the file %s", path);
+    free(path);
+    return NULL;
+  }
+
+  struct file_input *file = malloc(sizeof(struct file_input));
+  struct reader *reader = malloc(sizeof(struct reader));
+  if (file == NULL || reader == NULL)
+    exit(1);
+
+  reader_init(reader, f);
+  file->path = path;
+  file->reader = reader;
+  file->next = w->files;
+  w->files = file;
+  return reader;
+}
+
+// (read-file path) evaluates to the next datum of the file, or to nil once
+// the file ends. The path is an atom, or a byte vector, as for bytes-map.
+// Each file is read from where the last call for its path stopped.
+static bool native_read_file(struct wisp_state *w, int arg_count,
+    Value *args, Value *result)
+{
+  (void) arg_count;
+
+  char *path = path_copy(w, args[0]);
+  if (path == NULL)
+    return false;
+
+  struct reader *reader = file_reader(w, path);
+  if (reader == NULL)
+    return false;
+
+  if (reader_next(w, reader, result) == READ_ERROR) {
+    runtime_error(w, "Cannot read the file");
+    return false;
+  }
+
+  return true;
+}
+
+// (print x) writes x followed by a newline to the standard output, and
+// evaluates to x.
+static bool native_print(struct wisp_state *w, int arg_count, Value *args,
+    Value *result)
+{
+  (void) w;
+  (void) arg_count;
+
+  struct printer p;
+  printer_init(&p, stdout, false);
+  printer_print(&p, args[0]);
+  printer_write(&p, "\n", 1);
+  printer_free(&p);
+
+  *result = args[0];
+  return true;
+}
+
+// (serialize x) writes x in the binary form to the standard output, and
+// evaluates to x.
+static bool native_serialize(struct wisp_state *w, int arg_count, Value *args,
+    Value *result)
+{
+  (void) arg_count;
+
+  struct serializer s;
+  serializer_init(&s, stdout);
+  bool is_serialized = serialize(&s, args[0]);
+  serializer_free(&s);
+
+  if (!is_serialized) {
+    runtime_error(w, "Only nil, numbers, atoms and pairs can be serialized");
+    return false;
+  }
+
+  *result = args[0];
+  return true;
+}
+
+// The built-in native functions.
+static const struct {
+  const char *name;
+  native_fn function;
+  int arity;
+} natives[] = {
+  {"bytes-atom", native_bytes_atom, 1},
+  {"bytes-find", native_bytes_find, 3},
+  {"bytes-length", native_bytes_length, 1},
+  {"bytes-map", native_bytes_map, 1},
+  {"bytes-ref", native_bytes_ref, 2},
+  {"bytes-slice", native_bytes_slice, 3},
+  {"deserialize", native_deserialize, 0},
+  {"print", native_print, 1},
+  {"read", native_read, 0},
+  {"read-file", native_read_file, 1},
+  {"serialize", native_serialize, 1},
+};
+
+void natives_define(struct wisp_state *w)
+{
+  for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); ++i)
+    define_native(w, natives[i].name, natives[i].function, natives[i].arity);
+}
+
+native_fn natives_find(const char *name, int arity)
+{
+  for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); ++i)
+    if (strcmp(natives[i].name, name) == 0 && natives[i].arity == arity)
+      return natives[i].function;
+
+  return NULL;
+}
@@ -0,0 +1,15 @@
+#ifndef WISP_NATIVES_H
+#define WISP_NATIVES_H
+
+#include "common.h"
+#include "value.h"
+
+// Defines the built-in native functions as globals of the state.
+void natives_define(struct wisp_state *);
+
+// Finds the built-in native function of the given name and arity, returning
+// NULL if there is none. Native functions are identified by their names
+// rather than their addresses outside of the process.
+native_fn natives_find(const char *, int);
+
+#endif
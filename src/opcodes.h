@@ -1,20 +1,38 @@
 #ifndef WISP_OPCODES_H
 #define WISP_OPCODES_H
 
+// Opcodes suffixed with _LONG take a 24-bit constant index or a 16-bit local
+// or upvalue index, stored big-endian, instead of a single byte operand.
 enum opcode {
   OP_CONSTANT,
+  OP_CONSTANT_LONG,
   OP_NIL,
   OP_CALL,
   OP_DOT_CALL,
   OP_CLOSURE,
+  OP_CLOSURE_LONG,
   OP_RETURN,
+  OP_POP,
   OP_CONS,
   OP_CAR,
   OP_CDR,
   OP_DEFINE_GLOBAL,
+  OP_DEFINE_GLOBAL_LONG,
   OP_GET_LOCAL,
   OP_GET_UPVALUE,
+  OP_GET_UPVALUE_LONG,
   OP_GET_GLOBAL,
+  OP_GET_GLOBAL_LONG,
+
+  // Superinstructions fusing the most frequent opcode pairs, as profiled by
+  // 'make profile' over bench/corpus. They are never emitted directly, only
+  // by the compiler pass rewriting finished chunks.
+  OP_GET_LOCAL_CAR,     // OP_GET_LOCAL slot, OP_CAR
+  OP_GET_LOCAL_CDR,     // OP_GET_LOCAL slot, OP_CDR
+  OP_CADR,              // OP_CDR, OP_CAR
+  OP_CDDR,              // OP_CDR, OP_CDR
+  OP_GET_GLOBAL_CALL,   // OP_GET_GLOBAL constant, OP_CALL arg_count
+  OP_LIST,              // OP_NIL, count * OP_CONS
 };
 
 #endif
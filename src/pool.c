@@ -0,0 +1,363 @@
+// For MAP_ANONYMOUS and madvise.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void) (addr), (void) (size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void) (addr), (void) (size))
+#endif
+
+// Size of a region, which is the size of a huge page on most systems.
+#define POOL_REGION_SIZE (2 * 1024 * 1024)
+
+struct pool_region {
+  // The region mapped before this one (or NULL).
+  struct pool_region *next;
+
+  // Start of the region.
+  unsigned char *base;
+
+  // Start of the part of the region not yet split into pages.
+  unsigned char *unused;
+};
+
+#define PAGE_DATA(page) \
+  ((unsigned char *) (page) \
+   + ((sizeof(struct pool_page) + POOL_GRANULE - 1) & ~(POOL_GRANULE - 1)))
+
+#define PAGE_END(page) ((unsigned char *) (page) + POOL_PAGE_SIZE)
+
+#define REGION_END(region) ((region)->base + POOL_REGION_SIZE)
+
+void pool_init(struct pool *p)
+{
+  for (int i = 0; i < POOL_CLASS_COUNT; ++i)
+    p->pages[i] = NULL;
+
+  p->free_pages = NULL;
+  p->regions = NULL;
+  p->large = NULL;
+  p->young_large_count = 0;
+  p->huge_pages = false;
+}
+
+static void page_push(struct pool_page **list, struct pool_page *page)
+{
+  page->prev = NULL;
+  page->next = *list;
+  if (*list != NULL)
+    (*list)->prev = page;
+  *list = page;
+}
+
+static void page_unlink(struct pool_page **list, struct pool_page *page)
+{
+  if (page->prev == NULL)
+    *list = page->next;
+  else
+    page->prev->next = page->next;
+
+  if (page->next != NULL)
+    page->next->prev = page->prev;
+}
+
+// Maps a region aligned to its size, so that it can be backed by huge pages.
+static void region_map(struct pool *p)
+{
+  unsigned char *start = mmap(NULL, 2 * POOL_REGION_SIZE,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED)
+    exit(1);
+
+  uintptr_t offset = (uintptr_t) start & (POOL_REGION_SIZE - 1);
+  unsigned char *base = offset == 0
+                      ? start
+                      : start + POOL_REGION_SIZE - offset;
+
+  if (base > start)
+    munmap(start, (size_t) (base - start));
+  munmap(base + POOL_REGION_SIZE,
+      (size_t) (start + 2 * POOL_REGION_SIZE - base - POOL_REGION_SIZE));
+
+#ifdef MADV_HUGEPAGE
+  if (p->huge_pages)
+    madvise(base, POOL_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+
+  struct pool_region *region = malloc(sizeof(struct pool_region));
+  if (region == NULL)
+    exit(1);
+
+  region->next = p->regions;
+  region->base = base;
+  region->unused = base;
+  p->regions = region;
+}
+
+// Splits the next page off the region, empty and not assigned to any size
+// class. Its bitmaps are clear, as the region is freshly mapped.
+static struct pool_page *region_split(struct pool_region *region)
+{
+  struct pool_page *page = (struct pool_page *) region->unused;
+  region->unused += POOL_PAGE_SIZE;
+  page->region = region;
+  page->size = 0;
+  return page;
+}
+
+// Assigns an empty page to the size class, and puts it on its list. The
+// bitmaps of an empty page are clear, as freeing an object clears its bits.
+static struct pool_page *page_new(struct pool *p, int class)
+{
+  struct pool_page *page = p->free_pages;
+
+  if (page != NULL)
+    page_unlink(&p->free_pages, page);
+  else {
+    if (p->regions == NULL || p->regions->unused == REGION_END(p->regions))
+      region_map(p);
+
+    page = region_split(p->regions);
+  }
+
+  page->free = NULL;
+  page->unused = PAGE_DATA(page);
+  page->size = (size_t) (class + 1) * POOL_GRANULE;
+  page->live = 0;
+  page->has_room = true;
+  page->has_young = false;
+  page->is_unswept = false;
+  page_push(&p->pages[class], page);
+  return page;
+}
+
+void *pool_alloc(struct pool *p, size_t size)
+{
+  int class = (int) ((size - 1) / POOL_GRANULE);
+  struct pool_page *page = p->pages[class];
+  if (page == NULL)
+    page = page_new(p, class);
+
+  void *obj;
+
+  if (page->free != NULL) {
+    obj = page->free;
+    ASAN_UNPOISON_MEMORY_REGION(obj, page->size);
+    page->free = *(void **) obj;
+  } else {
+    obj = page->unused;
+    ASAN_UNPOISON_MEMORY_REGION(obj, page->size);
+    page->unused += page->size;
+  }
+
+  size_t index = POOL_INDEX(obj);
+  uint64_t bit = (uint64_t) 1 << (index % 64);
+  page->allocated[index / 64] |= bit;
+  page->has_young = true;
+  page->live++;
+
+  if (page->free == NULL
+      && (size_t) (PAGE_END(page) - page->unused) < page->size) {
+    page_unlink(&p->pages[class], page);
+    page->has_room = false;
+  }
+
+  return obj;
+}
+
+void pool_dealloc(struct pool *p, void *ptr, size_t size)
+{
+  struct pool_page *page = POOL_PAGE_OF(ptr);
+  size_t index = POOL_INDEX(ptr);
+  uint64_t bit = (uint64_t) 1 << (index % 64);
+
+  page->allocated[index / 64] &= ~bit;
+  page->marked[index / 64] &= ~bit;
+  *(void **) ptr = page->free;
+  page->free = ptr;
+  page->live--;
+  ASAN_POISON_MEMORY_REGION(ptr, page->size);
+
+  if (!page->has_room) {
+    page_push(&p->pages[(size - 1) / POOL_GRANULE], page);
+    page->has_room = true;
+  }
+}
+
+void *pool_alloc_large(struct pool *p, size_t size)
+{
+  struct pool_large *large = malloc(sizeof(struct pool_large) + size);
+  if (large == NULL)
+    exit(1);
+
+  large->prev = NULL;
+  large->next = p->large;
+  large->is_marked = false;
+  if (p->large != NULL)
+    p->large->prev = large;
+  p->large = large;
+  p->young_large_count++;
+  return large + 1;
+}
+
+void pool_dealloc_large(struct pool *p, void *ptr)
+{
+  struct pool_large *large = POOL_LARGE(ptr);
+
+  if (large->prev == NULL)
+    p->large = large->next;
+  else
+    large->prev->next = large->next;
+
+  if (large->next != NULL)
+    large->next->prev = large->prev;
+
+  free(large);
+}
+
+struct pool_page *pool_next_page(struct pool *p, struct pool_page *page)
+{
+  struct pool_region *region = page == NULL ? p->regions : page->region;
+  unsigned char *next = page == NULL
+                      ? NULL
+                      : (unsigned char *) page + POOL_PAGE_SIZE;
+
+  for (; region != NULL; region = region->next, next = NULL) {
+    if (next == NULL)
+      next = region->base;
+
+    for (; next < region->unused; next += POOL_PAGE_SIZE)
+      if (((struct pool_page *) next)->size != 0)
+        return (struct pool_page *) next;
+  }
+
+  return NULL;
+}
+
+void pool_unmark_page(struct pool_page *page)
+{
+  memset(page->marked, 0, sizeof(page->marked));
+  page->has_young = true;
+}
+
+void pool_unmark(struct pool *p)
+{
+  for (struct pool_page *page = pool_next_page(p, NULL);
+      page != NULL;
+      page = pool_next_page(p, page))
+    pool_unmark_page(page);
+
+  for (struct pool_large *large = p->large; large != NULL;
+      large = large->next)
+    large->is_marked = false;
+}
+
+void pool_trim(struct pool *p)
+{
+  uintptr_t os_page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+
+  for (int i = 0; i < POOL_CLASS_COUNT; ++i) {
+    struct pool_page *page = p->pages[i];
+
+    while (page != NULL) {
+      struct pool_page *next = page->next;
+
+      if (page->live == 0) {
+        // The header stays, along with the rest of the system page it is on.
+        uintptr_t start = ((uintptr_t) PAGE_DATA(page) + os_page_size - 1)
+                        & ~(os_page_size - 1);
+        madvise((void *) start, (uintptr_t) PAGE_END(page) - start,
+            MADV_DONTNEED);
+
+        page_unlink(&p->pages[i], page);
+        page->size = 0;
+        page_push(&p->free_pages, page);
+      }
+
+      page = next;
+    }
+  }
+}
+
+void pool_adopt(struct pool *p, struct pool *from)
+{
+  for (int i = 0; i < POOL_CLASS_COUNT; ++i)
+    while (from->pages[i] != NULL) {
+      struct pool_page *page = from->pages[i];
+      page_unlink(&from->pages[i], page);
+      page_push(&p->pages[i], page);
+    }
+
+  while (from->free_pages != NULL) {
+    struct pool_page *page = from->free_pages;
+    page_unlink(&from->free_pages, page);
+    page_push(&p->free_pages, page);
+  }
+
+  // The rest of the region being split is split as well, so that only the
+  // first region of this pool is ever split further.
+  if (from->regions != NULL)
+    while (from->regions->unused < REGION_END(from->regions))
+      page_push(&p->free_pages, region_split(from->regions));
+
+  if (from->regions != NULL) {
+    struct pool_region *last = from->regions;
+    while (last->next != NULL)
+      last = last->next;
+
+    if (p->regions == NULL)
+      p->regions = from->regions;
+    else {
+      last->next = p->regions->next;
+      p->regions->next = from->regions;
+    }
+
+    from->regions = NULL;
+  }
+
+  // The large objects are young in this pool, whatever their age in the
+  // other one.
+  if (from->large != NULL) {
+    struct pool_large *last = from->large;
+    p->young_large_count++;
+    while (last->next != NULL) {
+      last = last->next;
+      p->young_large_count++;
+    }
+
+    last->next = p->large;
+    if (p->large != NULL)
+      p->large->prev = last;
+    p->large = from->large;
+    from->large = NULL;
+    from->young_large_count = 0;
+  }
+}
+
+void pool_free(struct pool *p)
+{
+  struct pool_region *region = p->regions;
+  while (region != NULL) {
+    struct pool_region *next = region->next;
+    munmap(region->base, POOL_REGION_SIZE);
+    free(region);
+    region = next;
+  }
+
+  struct pool_large *large = p->large;
+  while (large != NULL) {
+    struct pool_large *next = large->next;
+    free(large);
+    large = next;
+  }
+
+  pool_init(p);
+}
@@ -0,0 +1,151 @@
+#ifndef WISP_POOL_H
+#define WISP_POOL_H
+
+#include "common.h"
+
+// Largest object allocated from a pool rather than by malloc.
+#define POOL_SIZE_MAX 64
+
+// Object sizes are rounded up to a multiple of the granule, each multiple
+// being a size class of its own.
+#define POOL_GRANULE 8
+
+#define POOL_CLASS_COUNT (POOL_SIZE_MAX / POOL_GRANULE)
+
+// Size of a page. Pages are aligned to their size, so the page of an object
+// is found from its address alone.
+#define POOL_PAGE_SIZE (64 * 1024)
+
+// Number of words of a bitmap with a bit for each granule of a page.
+#define POOL_BITMAP_WORDS (POOL_PAGE_SIZE / POOL_GRANULE / 64)
+
+#define POOL_PAGE_OF(ptr) \
+  ((struct pool_page *) ((uintptr_t) (ptr) \
+                         & ~(uintptr_t) (POOL_PAGE_SIZE - 1)))
+
+// Index of the granule an object starts at within its page, and the object
+// starting at the given granule.
+#define POOL_INDEX(ptr) \
+  (((uintptr_t) (ptr) & (POOL_PAGE_SIZE - 1)) / POOL_GRANULE)
+#define POOL_OBJ(page, index) \
+  ((void *) ((unsigned char *) (page) + (index) * POOL_GRANULE))
+
+#define POOL_LARGE(ptr) ((struct pool_large *) (ptr) - 1)
+
+struct pool_region;
+
+struct pool_page {
+  // Neighbours on the list of pages the page is on, if any.
+  struct pool_page *prev;
+  struct pool_page *next;
+
+  // Objects freed on the page, linked through their first word.
+  void *free;
+
+  // Start of the part of the page never allocated from.
+  unsigned char *unused;
+
+  // The region the page is split off.
+  struct pool_region *region;
+
+  // Size of the objects of the page, or 0 if the page is empty and not
+  // assigned to any size class.
+  size_t size;
+
+  // Number of objects of the page in use.
+  size_t live;
+
+  // Whether the page is on the list of its size class, having room.
+  bool has_room;
+
+  // Whether the page may hold unmarked objects, which the collection of
+  // the young objects sweeps.
+  bool has_young;
+
+  // Whether the page awaits the sweep in progress, which must be done
+  // before the page is allocated on.
+  bool is_unswept;
+
+  // Bits of the granules objects in use start at.
+  uint64_t allocated[POOL_BITMAP_WORDS];
+
+  // Bits of the granules marked objects start at. The mark bits are kept
+  // apart from the objects, so that marking never writes into them.
+  uint64_t marked[POOL_BITMAP_WORDS];
+};
+
+// Header in front of an object too large for the pages, allocated by
+// malloc.
+struct pool_large {
+  // Neighbours on the list of large objects of the pool.
+  struct pool_large *prev;
+  struct pool_large *next;
+
+  bool is_marked;
+};
+
+// Allocator of objects. Memory is mapped in large regions, which are split
+// into pages, each page holding small objects of a single size class. An
+// object freed is kept on the free list of its page, and pages left empty
+// are returned to the operating system when the pool is trimmed, staying
+// mapped to be reused by any size class. The pages also hold the mark bits
+// of their objects. Larger objects are allocated by malloc, and listed.
+struct pool {
+  // Pages of each size class with room for another object.
+  struct pool_page *pages[POOL_CLASS_COUNT];
+
+  // Empty pages, not assigned to any size class.
+  struct pool_page *free_pages;
+
+  // All regions mapped by the pool, the first one being split into pages.
+  struct pool_region *regions;
+
+  // The objects too large for the pages, the last allocated first.
+  struct pool_large *large;
+
+  // Number of the large objects allocated since the young ones were last
+  // swept, which are the first ones listed.
+  size_t young_large_count;
+
+  // Whether the regions are backed by transparent huge pages, where the
+  // system supports them.
+  bool huge_pages;
+};
+
+static inline bool pool_is_marked(const void *ptr)
+{
+  size_t index = POOL_INDEX(ptr);
+  return POOL_PAGE_OF(ptr)->marked[index / 64] >> (index % 64) & 1;
+}
+
+void pool_init(struct pool *);
+
+void *pool_alloc(struct pool *, size_t);
+
+void pool_dealloc(struct pool *, void *, size_t);
+
+void *pool_alloc_large(struct pool *, size_t);
+
+void pool_dealloc_large(struct pool *, void *);
+
+// Returns the page following the given one, or the first page given NULL,
+// among the pages assigned to a size class.
+struct pool_page *pool_next_page(struct pool *, struct pool_page *);
+
+// Unmarks all objects of the page.
+void pool_unmark_page(struct pool_page *);
+
+// Unmarks all objects of the pool.
+void pool_unmark(struct pool *);
+
+// Returns the memory of the empty pages to the operating system.
+void pool_trim(struct pool *);
+
+// Moves all pages and large objects of the second pool over to the first
+// one, so that the objects allocated from either are freed into the first
+// one.
+void pool_adopt(struct pool *, struct pool *);
+
+void pool_free(struct pool *);
+
+#endif
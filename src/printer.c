@@ -0,0 +1,326 @@
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "printer.h"
+
+// Size the buffer of a printer writing to a file grows to before it is
+// flushed.
+#define PRINTER_BUFFER_SIZE (64 * 1024)
+
+enum print_item_type {
+  // A value to be printed.
+  ITEM_VALUE,
+
+  // The rest of a list, following an element.
+  ITEM_REST,
+
+  // The closing parenthesis of a dotted list.
+  ITEM_CLOSE,
+};
+
+struct print_item {
+  enum print_item_type type;
+
+  // The value, or the rest of the list.
+  Value value;
+
+  // The first pair of the list, and the number of its pairs printed so far.
+  // They are needed to remove the pairs from the set of open pairs once
+  // the list is printed.
+  struct obj_pair *first;
+  size_t count;
+};
+
+// Marks a deleted slot in the set of open pairs.
+static struct obj_pair tombstone;
+
+void printer_init(struct printer *p, FILE *file, bool detect_cycles)
+{
+  p->file = file;
+  p->buffer = NULL;
+  p->len = 0;
+  p->capacity = 0;
+  p->detect_cycles = detect_cycles;
+  p->items = NULL;
+  p->item_count = 0;
+  p->item_capacity = 0;
+  p->open = NULL;
+  p->open_count = 0;
+  p->open_capacity = 0;
+}
+
+void printer_write(struct printer *p, const char *chars, size_t len)
+{
+  if (p->file != NULL && p->len + len > PRINTER_BUFFER_SIZE) {
+    printer_flush(p);
+
+    if (len > PRINTER_BUFFER_SIZE) {
+      fwrite(chars, 1, len, p->file);
+      return;
+    }
+  }
+
+  if (p->len + len > p->capacity) {
+    while (p->len + len > p->capacity)
+      p->capacity = GROW_CAPACITY(p->capacity);
+
+    p->buffer = realloc(p->buffer, p->capacity);
+    if (p->buffer == NULL)
+      exit(1);
+  }
+
+  memcpy(p->buffer + p->len, chars, len);
+  p->len += len;
+}
+
+static void write_str(struct printer *p, const char *str)
+{
+  printer_write(p, str, strlen(str));
+}
+
+// Writes the shortest representation that reads back as the same number.
+static void write_number(struct printer *p, double num)
+{
+  char buffer[32];
+  int len;
+
+  if (num > -1e15 && num < 1e15 && num == (double) (long long) num
+      && !(num == 0 && signbit(num))) {
+    // Integers are written digit by digit, without going through printf.
+    long long n = (long long) num;
+    bool is_negative = n < 0;
+    char *end = buffer + sizeof(buffer);
+    char *start = end;
+
+    do {
+      long long digit = n % 10;
+      *--start = (char) ('0' + (is_negative ? -digit : digit));
+      n /= 10;
+    } while (n != 0);
+
+    if (is_negative)
+      *--start = '-';
+
+    printer_write(p, start, end - start);
+    return;
+  }
+
+  // Any number reading back from at most 15 significant digits is written
+  // with its shortest such representation, as %g drops trailing zeros.
+  // Others need 16 or 17 digits. Subnormal numbers are less precise, so
+  // their shortest representation is searched for from a single digit.
+  bool is_subnormal = num > -DBL_MIN && num < DBL_MIN;
+
+  for (int precision = is_subnormal ? 1 : 15;; ++precision) {
+    len = snprintf(buffer, sizeof(buffer), "%.*g", precision, num);
+
+    if (precision == 17 || strtod(buffer, NULL) == num)
+      break;
+  }
+
+  printer_write(p, buffer, len);
+}
+
+static void write_obj(struct printer *p, struct obj *obj)
+{
+  switch (obj->type) {
+  case OBJ_ATOM: {
+    struct obj_string *atom = (struct obj_string *) obj;
+    printer_write(p, atom->chars, atom->len);
+    break;
+  }
+  case OBJ_CLOSURE:
+    write_str(p, "closure");
+    break;
+  case OBJ_LAMBDA:
+    write_str(p, "lambda");
+    break;
+  case OBJ_NATIVE:
+    write_str(p, "<native ");
+    write_str(p, ((struct obj_native *) obj)->name);
+    write_str(p, ">");
+    break;
+  case OBJ_UPVALUE:
+    write_str(p, "upvalue");
+    break;
+  case OBJ_PAIR:
+    // Printed by 'printer_print'.
+    break;
+  case OBJ_MAPPING:
+    write_str(p, "mapping");
+    break;
+  case OBJ_BYTES: {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "<bytes %zu>",
+        ((struct obj_bytes *) obj)->len);
+    write_str(p, buffer);
+    break;
+  }
+  }
+}
+
+static void push_item(struct printer *p, enum print_item_type type,
+    Value value, struct obj_pair *first, size_t count)
+{
+  if (p->item_count >= p->item_capacity) {
+    p->item_capacity = GROW_CAPACITY(p->item_capacity);
+    p->items = realloc(p->items, sizeof(struct print_item) * p->item_capacity);
+    if (p->items == NULL)
+      exit(1);
+  }
+
+  struct print_item *item = &p->items[p->item_count++];
+  item->type = type;
+  item->value = value;
+  item->first = first;
+  item->count = count;
+}
+
+static struct obj_pair **find_open(struct printer *p, struct obj_pair *pair)
+{
+  size_t mask = p->open_capacity - 1;
+  struct obj_pair **deleted = NULL;
+
+  for (size_t i = ((uintptr_t) pair >> 4) & mask;; i = (i + 1) & mask) {
+    struct obj_pair **slot = &p->open[i];
+
+    if (*slot == pair)
+      return slot;
+
+    if (*slot == NULL)
+      return deleted != NULL ? deleted : slot;
+
+    if (*slot == &tombstone && deleted == NULL)
+      deleted = slot;
+  }
+}
+
+// Adds the pair to the set of open pairs, unless it is already there.
+// Returns whether it has been added.
+static bool open_pair(struct printer *p, struct obj_pair *pair)
+{
+  if (!p->detect_cycles)
+    return true;
+
+  if (2 * (p->open_count + 1) > p->open_capacity) {
+    struct obj_pair **old = p->open;
+    size_t old_capacity = p->open_capacity;
+
+    p->open_capacity = GROW_CAPACITY(old_capacity);
+    p->open = calloc(p->open_capacity, sizeof(struct obj_pair *));
+    if (p->open == NULL)
+      exit(1);
+
+    p->open_count = 0;
+
+    for (size_t i = 0; i < old_capacity; ++i)
+      if (old[i] != NULL && old[i] != &tombstone) {
+        *find_open(p, old[i]) = old[i];
+        p->open_count++;
+      }
+
+    free(old);
+  }
+
+  struct obj_pair **slot = find_open(p, pair);
+  if (*slot == pair)
+    return false;
+
+  if (*slot == NULL)
+    p->open_count++;
+
+  *slot = pair;
+  return true;
+}
+
+// Removes the printed pairs of a list from the set of open pairs.
+static void close_list(struct printer *p, struct obj_pair *first,
+    size_t count)
+{
+  if (!p->detect_cycles)
+    return;
+
+  struct obj_pair *pair = first;
+
+  for (size_t i = 0; i < count; ++i) {
+    *find_open(p, pair) = &tombstone;
+    pair = i + 1 < count ? AS_PAIR(pair->cdr) : NULL;
+  }
+}
+
+void printer_print(struct printer *p, Value val)
+{
+  push_item(p, ITEM_VALUE, val, NULL, 0);
+
+  while (p->item_count > 0) {
+    struct print_item item = p->items[--p->item_count];
+
+    switch (item.type) {
+    case ITEM_VALUE:
+      if (IS_NIL(item.value))
+        write_str(p, "nil");
+      else if (IS_NUM(item.value))
+        write_number(p, AS_NUM(item.value));
+      else if (!IS_PAIR(item.value))
+        write_obj(p, AS_OBJ(item.value));
+      else if (!open_pair(p, AS_PAIR(item.value)))
+        write_str(p, "...");
+      else {
+        struct obj_pair *pair = AS_PAIR(item.value);
+        write_str(p, "(");
+        push_item(p, ITEM_REST, pair->cdr, pair, 1);
+        push_item(p, ITEM_VALUE, pair->car, NULL, 0);
+      }
+      break;
+    case ITEM_REST:
+      if (IS_NIL(item.value)) {
+        write_str(p, ")");
+        close_list(p, item.first, item.count);
+      } else if (!IS_PAIR(item.value)) {
+        write_str(p, " . ");
+        push_item(p, ITEM_CLOSE, NIL_VAL, item.first, item.count);
+        push_item(p, ITEM_VALUE, item.value, NULL, 0);
+      } else if (!open_pair(p, AS_PAIR(item.value))) {
+        write_str(p, " . ...)");
+        close_list(p, item.first, item.count);
+      } else {
+        struct obj_pair *pair = AS_PAIR(item.value);
+        write_str(p, " ");
+        push_item(p, ITEM_REST, pair->cdr, item.first, item.count + 1);
+        push_item(p, ITEM_VALUE, pair->car, NULL, 0);
+      }
+      break;
+    case ITEM_CLOSE:
+      write_str(p, ")");
+      close_list(p, item.first, item.count);
+      break;
+    }
+  }
+
+  // Every pair has been closed again, so only deleted slots are left.
+  if (p->open_count > 0) {
+    memset(p->open, 0, sizeof(struct obj_pair *) * p->open_capacity);
+    p->open_count = 0;
+  }
+}
+
+void printer_flush(struct printer *p)
+{
+  if (p->file == NULL || p->len == 0)
+    return;
+
+  fwrite(p->buffer, 1, p->len, p->file);
+  p->len = 0;
+}
+
+void printer_free(struct printer *p)
+{
+  printer_flush(p);
+  free(p->buffer);
+  free(p->items);
+  free(p->open);
+  printer_init(p, NULL, false);
+}
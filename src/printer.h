@@ -0,0 +1,61 @@
+#ifndef WISP_PRINTER_H
+#define WISP_PRINTER_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+struct print_item;
+
+// Writes values as text into a buffer, which is written out in one piece
+// whenever it fills up or is flushed. Nested lists are walked with an explicit
+// stack, so values of any depth can be printed.
+struct printer {
+  // The file the output is written to. If NULL, the output accumulates in
+  // the buffer, which grows as needed and is never flushed.
+  FILE *file;
+
+  // Output not yet written to the file.
+  char *buffer;
+
+  // Number of bytes in the buffer.
+  size_t len;
+
+  // Capacity of the buffer.
+  size_t capacity;
+
+  // Whether to print a pair reached again from within itself as "...",
+  // rather than looping forever.
+  bool detect_cycles;
+
+  // Work stack of the values and list remainders still to be printed.
+  struct print_item *items;
+
+  // Number of the items.
+  int item_count;
+
+  // Capacity of the 'items' array.
+  int item_capacity;
+
+  // Open-addressed set of the pairs being printed, used to detect cycles.
+  struct obj_pair **open;
+
+  // Number of the occupied slots of the set, including deleted ones.
+  size_t open_count;
+
+  // Capacity of the 'open' array, always a power of two.
+  size_t open_capacity;
+};
+
+void printer_init(struct printer *, FILE *, bool);
+
+void printer_write(struct printer *, const char *, size_t);
+
+void printer_print(struct printer *, Value);
+
+void printer_flush(struct printer *);
+
+void printer_free(struct printer *);
+
+#endif
@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "reader.h"
+#include "state.h"
+#include "strpool.h"
+
+#define READER_BUFFER_SIZE (64 * 1024)
+
+struct read_frame {
+  // The list read so far (or nil if no element has been read).
+  Value head;
+
+  // The last pair of the list (or NULL if no element has been read).
+  struct obj_pair *tail;
+
+  // Whether a dot has been read, so the next datum ends the list.
+  bool is_dotted;
+
+  // Whether the datum following the dot has been read.
+  bool has_tail;
+};
+
+static void reader_init_buffer(struct reader *r, FILE *file, char *buffer,
+    size_t len)
+{
+  r->file = file;
+  r->buffer = buffer;
+  r->start = 0;
+  r->end = len;
+  r->is_eof = file == NULL;
+  r->line = 1;
+  r->token = NULL;
+  r->token_len = 0;
+  r->token_capacity = 0;
+  r->frames = NULL;
+  r->frame_count = 0;
+  r->frame_capacity = 0;
+  r->datum = NIL_VAL;
+}
+
+void reader_init(struct reader *r, FILE *file)
+{
+  char *buffer = malloc(READER_BUFFER_SIZE);
+  if (buffer == NULL)
+    exit(1);
+
+  reader_init_buffer(r, file, buffer, 0);
+}
+
+void reader_init_memory(struct reader *r, const char *data, size_t len)
+{
+  // The buffer of a reader without a file is never refilled, so it is never
+  // written to either.
+  reader_init_buffer(r, NULL, (char *) data, len);
+}
+
+size_t reader_fill(struct reader *r, size_t count)
+{
+  if (count > READER_BUFFER_SIZE)
+    count = READER_BUFFER_SIZE;
+
+  if (r->end - r->start >= count || r->is_eof)
+    return r->end - r->start;
+
+  memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+  r->end -= r->start;
+  r->start = 0;
+
+  while (r->end < count && !r->is_eof) {
+    size_t bytes_read = fread(r->buffer + r->end, 1,
+        READER_BUFFER_SIZE - r->end, r->file);
+
+    if (bytes_read == 0)
+      r->is_eof = true;
+
+    r->end += bytes_read;
+  }
+
+  return r->end - r->start;
+}
+
+// Returns the byte at the given distance without consuming anything, or EOF
+// past the end of the file.
+static int peek_at(struct reader *r, size_t distance)
+{
+  if (reader_fill(r, distance + 1) <= distance)
+    return EOF;
+
+  return (unsigned char) r->buffer[r->start + distance];
+}
+
+static int peek(struct reader *r)
+{
+  if (r->start < r->end)
+    return (unsigned char) r->buffer[r->start];
+
+  return peek_at(r, 0);
+}
+
+static void advance(struct reader *r)
+{
+  r->start++;
+}
+
+static bool is_digit(int c)
+{
+  return '0' <= c && c <= '9';
+}
+
+// The same characters as in the scanner, so that the data reads the same as
+// when quoted in a program.
+static bool is_valid_identifier(int c)
+{
+  return 0x21 <= c && c <= 0x7E
+    && c != '(' && c != ')' && c != '\'' && c != '.';
+}
+
+static void skip_whitespace_comments(struct reader *r)
+{
+  for (;;) {
+    int c = peek(r);
+    switch (c) {
+    case '\n':
+      r->line++; // Fallthrough.
+    case ' ':
+    case '\t':
+    case '\r':
+      advance(r);
+      break;
+    case ';':
+      while ((c = peek(r)) != '\n' && c != EOF)
+        advance(r);
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+// Appends the buffered bytes up to the given position to the token, and
+// consumes them.
+static void token_append(struct reader *r, size_t end)
+{
+  size_t len = end - r->start;
+
+  if (r->token_len + len + 1 > r->token_capacity) {
+    while (r->token_len + len + 1 > r->token_capacity)
+      r->token_capacity = GROW_CAPACITY(r->token_capacity);
+
+    r->token = realloc(r->token, r->token_capacity);
+    if (r->token == NULL)
+      exit(1);
+  }
+
+  memcpy(r->token + r->token_len, r->buffer + r->start, len);
+  r->token_len += len;
+  r->token[r->token_len] = '\0';
+  r->start = end;
+}
+
+// Reads the token of all bytes up to the first one not satisfying the
+// predicate, refilling the buffer as needed.
+static void read_token(struct reader *r, bool (*predicate)(int))
+{
+  do {
+    size_t end = r->start;
+    while (end < r->end && predicate((unsigned char) r->buffer[end]))
+      end++;
+
+    token_append(r, end);
+  } while (r->start == r->end && peek(r) != EOF);
+}
+
+// Reads a number token the way the scanner does: digits, optionally
+// followed by a dot and more digits.
+static Value number(struct reader *r)
+{
+  r->token_len = 0;
+  read_token(r, is_digit);
+
+  if (peek(r) == '.' && is_digit(peek_at(r, 1))) {
+    token_append(r, r->start + 1);
+    read_token(r, is_digit);
+  }
+
+  return NUM_VAL(strtod(r->token, NULL));
+}
+
+static Value atom(struct wisp_state *w, struct reader *r)
+{
+  r->token_len = 0;
+  read_token(r, is_valid_identifier);
+  return OBJ_VAL(str_pool_intern(w, r->token, r->token_len));
+}
+
+static enum read_status error(struct reader *r, const char *msg)
+{
+  fprintf(stderr, "[line %d] Error: %s\n", r->line, msg);
+  return READ_ERROR;
+}
+
+static void open_list(struct reader *r)
+{
+  if (r->frame_count >= r->frame_capacity) {
+    r->frame_capacity = GROW_CAPACITY(r->frame_capacity);
+    r->frames = realloc(r->frames,
+        sizeof(struct read_frame) * r->frame_capacity);
+    if (r->frames == NULL)
+      exit(1);
+  }
+
+  struct read_frame *frame = &r->frames[r->frame_count++];
+  frame->head = NIL_VAL;
+  frame->tail = NULL;
+  frame->is_dotted = false;
+  frame->has_tail = false;
+}
+
+// Adds the completed datum to the innermost open list. The datum is kept in
+// the reader until then, as allocating the pair can trigger a GC.
+static void append(struct wisp_state *w, struct read_frame *frame, Value datum)
+{
+  if (frame->is_dotted) {
+    frame->has_tail = true;
+
+    if (frame->tail == NULL)
+      // '( . a) reads as a.
+      frame->head = datum;
+    else {
+      frame->tail->cdr = datum;
+      WRITE_BARRIER(w, &frame->tail->obj);
+    }
+
+    return;
+  }
+
+  struct obj_pair *pair = pair_new(w, datum, NIL_VAL);
+
+  if (frame->tail == NULL)
+    frame->head = OBJ_VAL(pair);
+  else {
+    frame->tail->cdr = OBJ_VAL(pair);
+    WRITE_BARRIER(w, &frame->tail->obj);
+  }
+
+  frame->tail = pair;
+}
+
+static enum read_status read_datum(struct wisp_state *w, struct reader *r)
+{
+  r->frame_count = 0;
+
+  for (;;) {
+    skip_whitespace_comments(r);
+    int c = peek(r);
+
+    if (c == EOF) {
+      if (r->frame_count > 0)
+        return error(r, "Expect ')' at the end of a list");
+
+      return READ_END;
+    }
+
+    if (c == '\'') {
+      // Quotes within data are redundant, just as in quoted literals.
+      advance(r);
+      continue;
+    }
+
+    if (c == '(') {
+      advance(r);
+      open_list(r);
+      continue;
+    }
+
+    if (c == '.') {
+      advance(r);
+
+      if (r->frame_count == 0 || r->frames[r->frame_count - 1].is_dotted)
+        return error(r, "Unexpected '.'");
+
+      r->frames[r->frame_count - 1].is_dotted = true;
+      continue;
+    }
+
+    if (c == ')') {
+      advance(r);
+
+      if (r->frame_count == 0)
+        return error(r, "Unexpected ')'");
+
+      struct read_frame *frame = &r->frames[--r->frame_count];
+      if (frame->is_dotted && !frame->has_tail)
+        return error(r, "Expect a datum after '.'");
+
+      r->datum = frame->head;
+    } else if (is_digit(c))
+      r->datum = number(r);
+    else if (is_valid_identifier(c))
+      r->datum = atom(w, r);
+    else {
+      advance(r);
+      return error(r, "Unexpected character");
+    }
+
+    if (r->frame_count == 0)
+      return READ_OK;
+
+    struct read_frame *frame = &r->frames[r->frame_count - 1];
+    if (frame->has_tail)
+      return error(r, "Expect ')' after the datum following '.'");
+
+    append(w, frame, r->datum);
+  }
+}
+
+enum read_status reader_next(struct wisp_state *w, struct reader *r,
+    Value *datum)
+{
+  // Only one reader runs at a time, its unfinished data are GC roots.
+  w->reader = r;
+  enum read_status status = read_datum(w, r);
+  w->reader = NULL;
+
+  *datum = status == READ_OK ? r->datum : NIL_VAL;
+  r->datum = NIL_VAL;
+  r->frame_count = 0;
+  return status;
+}
+
+void reader_mark_roots(struct wisp_state *w)
+{
+  struct reader *r = w->reader;
+  if (r == NULL)
+    return;
+
+  if (IS_OBJ(r->datum))
+    obj_mark(w, AS_OBJ(r->datum));
+
+  for (int i = 0; i < r->frame_count; ++i)
+    if (IS_OBJ(r->frames[i].head))
+      obj_mark(w, AS_OBJ(r->frames[i].head));
+}
+
+void reader_free(struct reader *r)
+{
+  if (r->file != NULL)
+    free(r->buffer);
+
+  free(r->token);
+  free(r->frames);
+}
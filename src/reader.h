@@ -0,0 +1,76 @@
+#ifndef WISP_READER_H
+#define WISP_READER_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+enum read_status {
+  READ_OK,
+  READ_END,
+  READ_ERROR,
+};
+
+struct read_frame;
+
+// Reads data written as quoted literals, such as '(a (b . 1) 2.5), straight
+// into values, without compiling them. The file is read in chunks of a fixed
+// size, so data of any size can be read from a pipe. The buffered input can
+// also be consumed directly, such as by the deserializer.
+struct reader {
+  // The file being read (or NULL if reading from memory).
+  FILE *file;
+
+  // Bytes read from the file but not yet consumed.
+  char *buffer;
+
+  // Position of the next unconsumed byte in the buffer.
+  size_t start;
+
+  // Number of valid bytes in the buffer.
+  size_t end;
+
+  // Whether the end of the file has been reached.
+  bool is_eof;
+
+  // Currently read line.
+  int line;
+
+  // The atom or number being read. Tokens can span several buffer refills.
+  char *token;
+
+  // Length of the token.
+  size_t token_len;
+
+  // Capacity of the 'token' array.
+  size_t token_capacity;
+
+  // Lists whose closing parenthesis has not been read yet, innermost last.
+  struct read_frame *frames;
+
+  // Number of the open lists.
+  int frame_count;
+
+  // Capacity of the 'frames' array.
+  int frame_capacity;
+
+  // The most recently completed datum, until it is added to its list.
+  Value datum;
+};
+
+void reader_init(struct reader *, FILE *);
+
+void reader_init_memory(struct reader *, const char *, size_t);
+
+// Buffers at least the given number of unconsumed bytes (at most the buffer
+// size), unless the input ends sooner. Returns the number of buffered bytes.
+size_t reader_fill(struct reader *, size_t);
+
+enum read_status reader_next(struct wisp_state *, struct reader *, Value *);
+
+void reader_mark_roots(struct wisp_state *);
+
+void reader_free(struct reader *);
+
+#endif
@@ -0,0 +1,513 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "serialize.h"
+#include "state.h"
+#include "strpool.h"
+
+// Every value starts with one of these tags, possibly followed by operands.
+// Counts and indices are written as unsigned LEB128 varints.
+enum tag {
+  // Nil.
+  TAG_NIL,
+
+  // An integer of at most 53 bits, as a zigzag-encoded varint.
+  TAG_INT,
+
+  // Any other number, as the 8 bytes of the double, least significant first.
+  TAG_NUM,
+
+  // An atom not written before, as the length of its name followed by the
+  // name. It gets the next atom index.
+  TAG_ATOM,
+
+  // An atom written before, as its index.
+  TAG_ATOM_REF,
+
+  // A pair not written before, followed by its car and its cdr. It gets the
+  // next pair index.
+  TAG_PAIR,
+
+  // A pair written before, as its index.
+  TAG_PAIR_REF,
+
+  // Ends a value that could not be written.
+  TAG_ERROR,
+};
+
+// Longest encoding of a tag with its operands, except for the atom names.
+#define TAG_SIZE_MAX 11
+
+// Longest varint, which encodes 64 bits in groups of 7.
+#define VARINT_SIZE_MAX 10
+
+// Longest atom name accepted when reading, so that corrupt data cannot make
+// the reader allocate arbitrarily large buffers.
+#define ATOM_SIZE_MAX (64 * 1024 * 1024)
+
+// Integers of this magnitude and above are not all representable exactly.
+#define INT_LIMIT 9007199254740992.0
+
+void obj_index_init(struct obj_index *index)
+{
+  index->keys = NULL;
+  index->indices = NULL;
+  index->count = 0;
+  index->capacity = 0;
+}
+
+static uint32_t obj_index_find(struct obj_index *index, struct obj *key)
+{
+  uint32_t mask = index->capacity - 1;
+  uint64_t hash = (uint64_t) (uintptr_t) key * 0x9e3779b97f4a7c15;
+
+  for (uint32_t i = (uint32_t) (hash >> 32) & mask;; i = (i + 1) & mask)
+    if (index->keys[i] == key || index->keys[i] == NULL)
+      return i;
+}
+
+uint32_t obj_index_get_or_add(struct obj_index *index, struct obj *key,
+    uint32_t value)
+{
+  if (2 * (index->count + 1) > index->capacity) {
+    struct obj **keys = index->keys;
+    uint32_t *indices = index->indices;
+    uint32_t capacity = index->capacity;
+
+    index->capacity = GROW_CAPACITY(capacity);
+    index->keys = calloc(index->capacity, sizeof(struct obj *));
+    index->indices = malloc(sizeof(uint32_t) * index->capacity);
+    if (index->keys == NULL || index->indices == NULL)
+      exit(1);
+
+    for (uint32_t i = 0; i < capacity; ++i)
+      if (keys[i] != NULL) {
+        uint32_t slot = obj_index_find(index, keys[i]);
+        index->keys[slot] = keys[i];
+        index->indices[slot] = indices[i];
+      }
+
+    free(keys);
+    free(indices);
+  }
+
+  uint32_t slot = obj_index_find(index, key);
+  if (index->keys[slot] != NULL)
+    return index->indices[slot];
+
+  index->keys[slot] = key;
+  index->indices[slot] = value;
+  index->count++;
+  return value;
+}
+
+void obj_index_clear(struct obj_index *index)
+{
+  if (index->count == 0)
+    return;
+
+  memset(index->keys, 0, sizeof(struct obj *) * index->capacity);
+  index->count = 0;
+}
+
+void obj_index_free(struct obj_index *index)
+{
+  free(index->keys);
+  free(index->indices);
+  obj_index_init(index);
+}
+
+void serializer_init(struct serializer *s, FILE *file)
+{
+  printer_init(&s->out, file, false);
+  obj_index_init(&s->atoms);
+  obj_index_init(&s->pairs);
+  s->pair_count = 0;
+  s->has_failed = false;
+  s->values = NULL;
+  s->value_count = 0;
+  s->value_capacity = 0;
+}
+
+static int write_varint(uint8_t *bytes, uint64_t n)
+{
+  int len = 0;
+
+  for (; n >= 0x80; n >>= 7)
+    bytes[len++] = (uint8_t) (n | 0x80);
+
+  bytes[len++] = (uint8_t) n;
+  return len;
+}
+
+static void push_value(struct serializer *s, Value val)
+{
+  if (s->value_count >= s->value_capacity) {
+    s->value_capacity = GROW_CAPACITY(s->value_capacity);
+    s->values = realloc(s->values, sizeof(Value) * s->value_capacity);
+    if (s->values == NULL)
+      exit(1);
+  }
+
+  s->values[s->value_count++] = val;
+}
+
+static bool write_value(struct serializer *s, Value val)
+{
+  push_value(s, val);
+
+  while (s->value_count > 0) {
+    val = s->values[--s->value_count];
+
+    uint8_t bytes[TAG_SIZE_MAX];
+    int len = 0;
+
+    if (IS_NIL(val))
+      bytes[len++] = TAG_NIL;
+    else if (IS_NUM(val)) {
+      double num = AS_NUM(val);
+
+      if (num > -INT_LIMIT && num < INT_LIMIT && num == (double) (int64_t) num
+          && !(num == 0 && signbit(num))) {
+        int64_t n = (int64_t) num;
+        uint64_t zigzag = n < 0
+                        ? ((uint64_t) -n << 1) - 1
+                        : (uint64_t) n << 1;
+
+        bytes[len++] = TAG_INT;
+        len += write_varint(bytes + len, zigzag);
+      } else {
+        uint64_t bits;
+        memcpy(&bits, &num, sizeof(bits));
+
+        bytes[len++] = TAG_NUM;
+        for (int i = 0; i < 8; ++i)
+          bytes[len++] = (uint8_t) (bits >> (8 * i));
+      }
+    } else if (IS_ATOM(val)) {
+      struct obj_string *atom = AS_ATOM(val);
+      uint32_t count = s->atoms.count;
+      uint32_t index = obj_index_get_or_add(&s->atoms, AS_OBJ(val), count);
+
+      if (s->atoms.count == count) {
+        bytes[len++] = TAG_ATOM_REF;
+        len += write_varint(bytes + len, index);
+      } else {
+        bytes[len++] = TAG_ATOM;
+        len += write_varint(bytes + len, atom->len);
+        printer_write(&s->out, (const char *) bytes, len);
+        printer_write(&s->out, atom->chars, atom->len);
+        continue;
+      }
+    } else if (IS_PAIR(val)) {
+      struct obj_pair *pair = AS_PAIR(val);
+      uint32_t index = obj_index_get_or_add(&s->pairs, AS_OBJ(val),
+          s->pair_count);
+
+      if (index < s->pair_count) {
+        bytes[len++] = TAG_PAIR_REF;
+        len += write_varint(bytes + len, index);
+      } else {
+        s->pair_count++;
+        bytes[len++] = TAG_PAIR;
+        push_value(s, pair->cdr);
+        push_value(s, pair->car);
+      }
+    } else {
+      // Functions only make sense within the process that created them.
+      bytes[len++] = TAG_ERROR;
+      s->value_count = 0;
+      printer_write(&s->out, (const char *) bytes, len);
+      return false;
+    }
+
+    printer_write(&s->out, (const char *) bytes, len);
+  }
+
+  return true;
+}
+
+static void value_end(struct serializer *s)
+{
+  obj_index_clear(&s->atoms);
+  obj_index_clear(&s->pairs);
+  s->pair_count = 0;
+  s->has_failed = false;
+}
+
+bool serialize(struct serializer *s, Value val)
+{
+  bool result = write_value(s, val);
+  value_end(s);
+  return result;
+}
+
+void serialize_list_begin(struct serializer *s)
+{
+  value_end(s);
+}
+
+bool serialize_list_add(struct serializer *s, Value val)
+{
+  if (s->has_failed)
+    return false;
+
+  // Written just like a pair whose cdr is the rest of the list.
+  uint8_t tag = TAG_PAIR;
+  printer_write(&s->out, (const char *) &tag, 1);
+  s->pair_count++;
+
+  s->has_failed = !write_value(s, val);
+  return !s->has_failed;
+}
+
+void serialize_list_end(struct serializer *s)
+{
+  if (!s->has_failed) {
+    uint8_t tag = TAG_NIL;
+    printer_write(&s->out, (const char *) &tag, 1);
+  }
+
+  value_end(s);
+}
+
+void serializer_free(struct serializer *s)
+{
+  printer_free(&s->out);
+  obj_index_free(&s->atoms);
+  obj_index_free(&s->pairs);
+  free(s->values);
+}
+
+// A place a value still to be read belongs to, within the pair owning it
+// (or NULL for the datum of the reader).
+struct slot {
+  Value *value;
+  struct obj_pair *owner;
+};
+
+// State of reading one value. The value read so far is held by the reader,
+// which keeps it reachable by the collector, and everything else read is
+// reachable from it.
+struct deserializer {
+  struct wisp_state *w;
+  struct reader *r;
+
+  // Atoms read so far, in the order of their indices.
+  struct obj_string **atoms;
+  uint32_t atom_count;
+  uint32_t atom_capacity;
+
+  // Pairs read so far, in the order of their indices.
+  struct obj_pair **pairs;
+  uint32_t pair_count;
+  uint32_t pair_capacity;
+
+  // Work stack of the places where the values still to be read belong.
+  struct slot *slots;
+  int slot_count;
+  int slot_capacity;
+};
+
+static enum read_status invalid(const char *msg)
+{
+  fprintf(stderr, "Error: %s\n", msg);
+  return READ_ERROR;
+}
+
+static bool read_varint(struct reader *r, uint64_t *n)
+{
+  size_t available = reader_fill(r, VARINT_SIZE_MAX);
+  const uint8_t *bytes = (const uint8_t *) r->buffer + r->start;
+  *n = 0;
+
+  for (size_t i = 0; i < available && i < VARINT_SIZE_MAX; ++i) {
+    *n |= (uint64_t) (bytes[i] & 0x7F) << (7 * i);
+
+    if ((bytes[i] & 0x80) == 0) {
+      r->start += i + 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static struct obj_string *read_atom(struct deserializer *d, uint64_t len)
+{
+  struct reader *r = d->r;
+
+  if (reader_fill(r, len) >= len) {
+    // The whole name is buffered.
+    struct obj_string *atom = str_pool_intern(d->w, r->buffer + r->start, len);
+    r->start += len;
+    return atom;
+  }
+
+  char *chars = malloc(len);
+  if (chars == NULL)
+    exit(1);
+
+  for (size_t done = 0; done < len;) {
+    size_t available = reader_fill(r, len - done);
+    if (available == 0) {
+      free(chars);
+      return NULL;
+    }
+
+    if (available > len - done)
+      available = len - done;
+
+    memcpy(chars + done, r->buffer + r->start, available);
+    r->start += available;
+    done += available;
+  }
+
+  struct obj_string *atom = str_pool_intern(d->w, chars, len);
+  free(chars);
+  return atom;
+}
+
+static void push_slot(struct deserializer *d, Value *value,
+    struct obj_pair *owner)
+{
+  if (d->slot_count >= d->slot_capacity) {
+    d->slot_capacity = GROW_CAPACITY(d->slot_capacity);
+    d->slots = realloc(d->slots, sizeof(struct slot) * d->slot_capacity);
+    if (d->slots == NULL)
+      exit(1);
+  }
+
+  d->slots[d->slot_count].value = value;
+  d->slots[d->slot_count].owner = owner;
+  d->slot_count++;
+}
+
+// Stores an object read into its place.
+static void store(struct deserializer *d, struct slot slot, Value val)
+{
+  *slot.value = val;
+
+  if (slot.owner != NULL)
+    WRITE_BARRIER(d->w, &slot.owner->obj);
+}
+
+#define APPEND(array, count, capacity, item) \
+  do { \
+    if ((count) >= (capacity)) { \
+      (capacity) = GROW_CAPACITY(capacity); \
+      (array) = realloc((array), sizeof(*(array)) * (capacity)); \
+      if ((array) == NULL) \
+        exit(1); \
+    } \
+    (array)[(count)++] = (item); \
+  } while (false)
+
+static enum read_status read_value(struct deserializer *d)
+{
+  struct reader *r = d->r;
+  push_slot(d, &r->datum, NULL);
+
+  while (d->slot_count > 0) {
+    if (reader_fill(r, 1) == 0)
+      return d->slot_count == 1 && d->slots[0].value == &r->datum
+           ? READ_END
+           : invalid("Unexpected end of serialized data");
+
+    uint8_t tag = (uint8_t) r->buffer[r->start++];
+    struct slot slot = d->slots[--d->slot_count];
+    uint64_t n;
+
+    switch (tag) {
+    case TAG_NIL:
+      *slot.value = NIL_VAL;
+      break;
+    case TAG_INT:
+      if (!read_varint(r, &n))
+        return invalid("Invalid serialized integer");
+
+      *slot.value = NUM_VAL((n & 1) ? -(double) (n >> 1) - 1
+          : (double) (n >> 1));
+      break;
+    case TAG_NUM: {
+      if (reader_fill(r, 8) < 8)
+        return invalid("Invalid serialized number");
+
+      uint64_t bits = 0;
+      for (int i = 0; i < 8; ++i)
+        bits |= (uint64_t) (uint8_t) r->buffer[r->start + i] << (8 * i);
+      r->start += 8;
+
+      double num;
+      memcpy(&num, &bits, sizeof(num));
+      *slot.value = NUM_VAL(num);
+      break;
+    }
+    case TAG_ATOM: {
+      struct obj_string *atom;
+      if (!read_varint(r, &n) || n > ATOM_SIZE_MAX
+          || (atom = read_atom(d, n)) == NULL)
+        return invalid("Invalid serialized atom");
+
+      APPEND(d->atoms, d->atom_count, d->atom_capacity, atom);
+      store(d, slot, OBJ_VAL(atom));
+      break;
+    }
+    case TAG_ATOM_REF:
+      if (!read_varint(r, &n) || n >= d->atom_count)
+        return invalid("Invalid serialized atom reference");
+
+      store(d, slot, OBJ_VAL(d->atoms[n]));
+      break;
+    case TAG_PAIR: {
+      struct obj_pair *pair = pair_new(d->w, NIL_VAL, NIL_VAL);
+      store(d, slot, OBJ_VAL(pair));
+      APPEND(d->pairs, d->pair_count, d->pair_capacity, pair);
+      push_slot(d, &pair->cdr, pair);
+      push_slot(d, &pair->car, pair);
+      break;
+    }
+    case TAG_PAIR_REF:
+      if (!read_varint(r, &n) || n >= d->pair_count)
+        return invalid("Invalid serialized pair reference");
+
+      store(d, slot, OBJ_VAL(d->pairs[n]));
+      break;
+    case TAG_ERROR:
+      return invalid("The value could not be serialized");
+    default:
+      return invalid("Invalid serialized data");
+    }
+  }
+
+  return READ_OK;
+}
+
+#undef APPEND
+
+enum read_status deserialize(struct wisp_state *w, struct reader *r,
+    Value *val)
+{
+  struct deserializer d = {
+    w, r, NULL, 0, 0, NULL, 0, 0, NULL, 0, 0,
+  };
+
+  // Only one reader runs at a time, the value it reads is a GC root.
+  w->reader = r;
+  r->datum = NIL_VAL;
+  r->frame_count = 0;
+
+  enum read_status status = read_value(&d);
+
+  w->reader = NULL;
+  *val = status == READ_OK ? r->datum : NIL_VAL;
+  r->datum = NIL_VAL;
+
+  free(d.atoms);
+  free(d.pairs);
+  free(d.slots);
+  return status;
+}
@@ -0,0 +1,89 @@
+#ifndef WISP_SERIALIZE_H
+#define WISP_SERIALIZE_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "printer.h"
+#include "reader.h"
+#include "value.h"
+
+// Open-addressed map of objects to their indices in the serialized value.
+struct obj_index {
+  // The objects, or NULL for unoccupied entries.
+  struct obj **keys;
+
+  // The indices of the objects.
+  uint32_t *indices;
+
+  // Number of the objects.
+  uint32_t count;
+
+  // Capacity of the arrays, always a power of two.
+  uint32_t capacity;
+};
+
+void obj_index_init(struct obj_index *);
+
+// Returns the index of the object, or adds it with the given index and
+// returns the given index.
+uint32_t obj_index_get_or_add(struct obj_index *, struct obj *, uint32_t);
+
+void obj_index_clear(struct obj_index *);
+
+void obj_index_free(struct obj_index *);
+
+// Writes values in a compact binary form. Each atom name is written once per
+// value, and any pair reached again is written as a reference to its first
+// occurrence, so shared substructure is preserved. Values are walked with
+// an explicit stack rather than by recursion.
+struct serializer {
+  // Buffered output, which also accumulates the bytes in memory if it has
+  // no file.
+  struct printer out;
+
+  // Atoms written so far within the current value, and their indices.
+  struct obj_index atoms;
+
+  // Pairs written so far within the current value, and their indices.
+  struct obj_index pairs;
+
+  // Number of pairs written so far within the current value, including the
+  // ones of a list written element by element.
+  uint32_t pair_count;
+
+  // Whether writing the list being written element by element has failed,
+  // so that the rest of it is skipped.
+  bool has_failed;
+
+  // Work stack of the values still to be written.
+  Value *values;
+
+  // Number of the values.
+  int value_count;
+
+  // Capacity of the 'values' array.
+  int value_capacity;
+};
+
+void serializer_init(struct serializer *, FILE *);
+
+// Writes the value, returning false if it contains something other than nil,
+// numbers, atoms and pairs. The value is then read back as an error.
+bool serialize(struct serializer *, Value);
+
+// Starts writing a list element by element, which never needs all of the
+// list in memory. Until the list ends, the elements share the atoms and the
+// pairs written, just like the elements of a single value.
+void serialize_list_begin(struct serializer *);
+
+bool serialize_list_add(struct serializer *, Value);
+
+void serialize_list_end(struct serializer *);
+
+void serializer_free(struct serializer *);
+
+// Reads a value written by the serializer from the buffered input.
+enum read_status deserialize(struct wisp_state *, struct reader *, Value *);
+
+#endif
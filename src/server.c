@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "compact.h"
+#include "compiler.h"
+#include "memory.h"
+#include "server.h"
+#include "state.h"
+#include "vm.h"
+
+// Longest source a request may have.
+#define REQUEST_SIZE_MAX (64 * 1024 * 1024)
+
+// Longest decimal length of a request, including the newline.
+#define HEADER_SIZE_MAX 16
+
+// Requests read from a connection. The buffer may hold the beginning of the
+// next request after the current one, if the client sent it ahead.
+struct connection {
+  int fd;
+
+  // Bytes read from the connection.
+  char *buffer;
+
+  // Number of the bytes in the buffer.
+  size_t len;
+
+  // Capacity of the buffer.
+  size_t capacity;
+};
+
+// Set by a signal handler once the server should stop.
+static volatile sig_atomic_t is_stopping = 0;
+
+static void stop(int signal)
+{
+  (void) signal;
+  is_stopping = 1;
+}
+
+bool server_eval(struct wisp_state *w, const char *source, struct printer *p)
+{
+  bool lazy_compile = w->lazy_compile;
+  w->lazy_compile = false;
+
+  Value value;
+  struct obj_lambda *lambda = compile(w, source);
+  bool is_evaluated = lambda != NULL && evaluate(w, lambda, &value);
+
+  w->lazy_compile = lazy_compile;
+
+  // Printing does not allocate, so the value is safe until it is printed.
+  if (is_evaluated)
+    printer_print(p, value);
+
+  return is_evaluated;
+}
+
+void server_collect(struct wisp_state *w)
+{
+  // A full collection after every request would cost as much as the heap,
+  // however little the request allocated.
+  if (w->bytes_allocated <= w->next_gc)
+    collect_young_garbage(w);
+  else if (w->compact_idle)
+    compact_if_fragmented(w);
+  else
+    collect_garbage(w);
+}
+
+static void reserve(struct connection *c, size_t size)
+{
+  if (size <= c->capacity)
+    return;
+
+  while (size > c->capacity)
+    c->capacity = GROW_CAPACITY(c->capacity);
+
+  c->buffer = realloc(c->buffer, c->capacity);
+  if (c->buffer == NULL)
+    exit(1);
+}
+
+// Reads more bytes into the buffer, returning false once the connection
+// ends or fails.
+static bool fill(struct connection *c)
+{
+  reserve(c, c->len + 1);
+
+  ssize_t bytes_read;
+  do
+    bytes_read = read(c->fd, c->buffer + c->len, c->capacity - c->len);
+  while (bytes_read == -1 && errno == EINTR && !is_stopping);
+
+  if (bytes_read <= 0)
+    return false;
+
+  c->len += (size_t) bytes_read;
+  return true;
+}
+
+// Reads the next request, setting the offset of its source in the buffer
+// and its length. Returns false once the connection ends, or if the request
+// is malformed.
+static bool read_request(struct connection *c, size_t *start, size_t *len)
+{
+  char *newline;
+
+  while ((newline = memchr(c->buffer, '\n', c->len)) == NULL)
+    if (c->len >= HEADER_SIZE_MAX || !fill(c))
+      return false;
+
+  if (newline == c->buffer)
+    return false;
+
+  size_t size = 0;
+  for (char *digit = c->buffer; digit < newline; ++digit) {
+    if (*digit < '0' || *digit > '9')
+      return false;
+
+    size = size * 10 + (size_t) (*digit - '0');
+    if (size > REQUEST_SIZE_MAX)
+      return false;
+  }
+
+  *start = (size_t) (newline - c->buffer) + 1;
+  *len = size;
+
+  // Room for the null terminator of the source.
+  reserve(c, *start + size + 1);
+
+  while (c->len < *start + size)
+    if (!fill(c))
+      return false;
+
+  return true;
+}
+
+static bool write_all(int fd, const char *bytes, size_t len)
+{
+  while (len > 0) {
+    ssize_t bytes_written = write(fd, bytes, len);
+    if (bytes_written == -1 && errno == EINTR)
+      continue;
+    if (bytes_written <= 0)
+      return false;
+
+    bytes += bytes_written;
+    len -= (size_t) bytes_written;
+  }
+
+  return true;
+}
+
+static bool write_response(int fd, bool is_ok, const char *body, size_t len)
+{
+  char header[32];
+  int header_len = snprintf(header, sizeof(header), "%s %zu\n",
+      is_ok ? "ok" : "error", len);
+
+  return write_all(fd, header, (size_t) header_len)
+    && write_all(fd, body, len);
+}
+
+// Serves the requests of one connection, writing the error messages of
+// a failed request into the messages file, which stands in for the
+// standard error output.
+static void serve_connection(struct wisp_state *w, struct connection *c,
+    int messages_fd)
+{
+  struct printer p;
+  printer_init(&p, NULL, true);
+
+  // The bytes allocated after the last collection.
+  size_t allocated = w->bytes_allocated;
+  size_t start;
+  size_t len;
+
+  while (!is_stopping && read_request(c, &start, &len)) {
+    // The source is terminated in place, and the byte it overwrites
+    // restored afterwards, as it may start the next request.
+    size_t end = start + len;
+    char next = c->buffer[end];
+    c->buffer[end] = '\0';
+
+    p.len = 0;
+    bool is_ok = server_eval(w, c->buffer + start, &p);
+    c->buffer[end] = next;
+
+    if (!is_ok) {
+      fflush(stderr);
+      off_t size = lseek(messages_fd, 0, SEEK_CUR);
+
+      if (size > 0) {
+        p.len = 0;
+        char chunk[4096];
+        ssize_t bytes_read;
+
+        lseek(messages_fd, 0, SEEK_SET);
+        while ((bytes_read = read(messages_fd, chunk, sizeof(chunk))) > 0)
+          printer_write(&p, chunk, (size_t) bytes_read);
+
+        lseek(messages_fd, 0, SEEK_SET);
+        if (ftruncate(messages_fd, 0) == -1)
+          break;
+      }
+    }
+
+    if (!write_response(c->fd, is_ok, p.buffer, p.len))
+      break;
+
+    memmove(c->buffer, c->buffer + end, c->len - end);
+    c->len -= end;
+
+    // The garbage of the request is collected while the client processes
+    // the response, rather than during a later request.
+    if (w->bytes_allocated > allocated) {
+      server_collect(w);
+      allocated = w->bytes_allocated;
+    }
+  }
+
+  printer_free(&p);
+}
+
+// Removes a socket left over at the path by an earlier server. Anything
+// other than a socket is kept, and makes binding fail.
+static void remove_socket(const char *path)
+{
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+}
+
+bool server_run(struct wisp_state *w, const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "The socket path '%s' is too long\n", path);
+    return false;
+  }
+
+  strcpy(addr.sun_path, path);
+  remove_socket(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+      || listen(fd, SOMAXCONN) == -1) {
+    fprintf(stderr, "Cannot listen on '%s': %s\n", path, strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return false;
+  }
+
+  // Error messages are written into a file while serving, so they can be
+  // sent back to the client whose request failed.
+  FILE *messages = tmpfile();
+  int stderr_fd = dup(STDERR_FILENO);
+
+  if (messages == NULL || stderr_fd == -1) {
+    fprintf(stderr, "Cannot redirect the error messages\n");
+    if (messages != NULL)
+      fclose(messages);
+    if (stderr_fd != -1)
+      close(stderr_fd);
+    close(fd);
+    unlink(path);
+    return false;
+  }
+
+  // Interrupting the server stops it once the current request is served.
+  // A client closing its connection early must not stop it at all.
+  struct sigaction action;
+  struct sigaction old_int;
+  struct sigaction old_term;
+  struct sigaction old_pipe;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, &old_int);
+  sigaction(SIGTERM, &action, &old_term);
+  action.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &action, &old_pipe);
+
+  fflush(stderr);
+  dup2(fileno(messages), STDERR_FILENO);
+
+  struct connection c;
+  c.buffer = NULL;
+  c.len = 0;
+  c.capacity = 0;
+  reserve(&c, HEADER_SIZE_MAX);
+
+  bool is_ok = true;
+  int error = 0;
+  is_stopping = 0;
+
+  while (!is_stopping) {
+    c.fd = accept(fd, NULL, NULL);
+    if (c.fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      is_ok = false;
+      error = errno;
+      break;
+    }
+
+    serve_connection(w, &c, fileno(messages));
+    close(c.fd);
+    c.len = 0;
+  }
+
+  fflush(stderr);
+  dup2(stderr_fd, STDERR_FILENO);
+  close(stderr_fd);
+  fclose(messages);
+
+  sigaction(SIGINT, &old_int, NULL);
+  sigaction(SIGTERM, &old_term, NULL);
+  sigaction(SIGPIPE, &old_pipe, NULL);
+
+  if (!is_ok)
+    fprintf(stderr, "Cannot accept a connection: %s\n", strerror(error));
+
+  free(c.buffer);
+  close(fd);
+  unlink(path);
+  return is_ok;
+}
@@ -0,0 +1,27 @@
+#ifndef WISP_SERVER_H
+#define WISP_SERVER_H
+
+#include "common.h"
+#include "printer.h"
+#include "value.h"
+
+// Compiles and executes the source of a request, printing the value of its
+// last form. The source does not outlive the request, so its lambda bodies
+// are never compiled lazily.
+bool server_eval(struct wisp_state *, const char *, struct printer *);
+
+// Collects the garbage left by a request. Only the young objects are
+// collected, unless the heap has grown past the next full collection, which
+// compacts the heap as well once fragmented, if the state is set to.
+void server_collect(struct wisp_state *);
+
+// Serves evaluation requests on a Unix domain socket at the path, one
+// connection at a time, until the process is interrupted or terminated.
+// A request is its length in bytes as a decimal number, a newline and the
+// source. The response is "ok" or "error", its length and a newline,
+// followed by the printed value or the error messages. Garbage is collected
+// by server_collect after a response is sent, so it is not left over from
+// one request to the next.
+bool server_run(struct wisp_state *, const char *);
+
+#endif
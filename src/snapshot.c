@@ -0,0 +1,796 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "natives.h"
+#include "serialize.h"
+#include "snapshot.h"
+#include "state.h"
+#include "strpool.h"
+
+// Identifies wisp heap snapshots.
+#define SNAPSHOT_MAGIC "WISPSNAP"
+
+// Bumped whenever the layout of any object changes, which makes the
+// snapshots written by earlier versions stale.
+#define SNAPSHOT_VERSION 4
+
+// Snapshots are written in the native byte order, and only read back in it.
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+// Every object and array of a snapshot is aligned, so that it can be used in
+// place.
+#define ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+// Writes an offset in the snapshot into a pointer field.
+#define OFFSET(type, offset) ((type) (uintptr_t) (offset))
+
+// A snapshot is a header, followed by the objects laid out exactly as in
+// memory, each followed by the arrays it owns, and by the global variables
+// laid out as table nodes. All pointers are written as offsets from the
+// start of the snapshot, with 0 standing for NULL.
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+
+  // Size of the whole snapshot.
+  uint64_t size;
+
+  // Number of the objects, which start right after the header.
+  uint64_t object_count;
+
+  // Offset of the global variables.
+  uint64_t globals;
+
+  // Number of the global variables.
+  uint64_t global_count;
+};
+
+// Any object, as written into the snapshot.
+union record {
+  struct obj obj;
+  struct obj_string atom;
+  struct obj_closure closure;
+  struct obj_lambda lambda;
+  struct obj_native native;
+  struct obj_upvalue upvalue;
+  struct obj_pair pair;
+  struct obj_mapping mapping;
+  struct obj_bytes bytes;
+};
+
+struct snapshot_writer {
+  struct wisp_state *w;
+  FILE *file;
+
+  // Indices of the objects written, in the 'objs' array.
+  struct obj_index index;
+
+  // The objects written, in the order they are laid out in. The objects
+  // still to be walked for references to other objects end the array.
+  struct obj **objs;
+
+  // Offsets of the objects in the snapshot.
+  uint64_t *offsets;
+
+  // Number of the objects.
+  uint32_t count;
+
+  // Capacity of the 'objs' and 'offsets' arrays.
+  uint32_t capacity;
+
+  // Whether an object cannot be written.
+  bool has_failed;
+};
+
+struct restorer {
+  // Start of the mapped snapshot.
+  char *base;
+
+  // Size of the snapshot.
+  size_t size;
+
+  // Whether all offsets so far have been within the snapshot.
+  bool is_valid;
+};
+
+// Adds the aligned size of an array to the size of a record, saturating
+// instead of overflowing, so that corrupt counts are caught.
+static size_t add_array(size_t size, size_t count, size_t elem_size)
+{
+  if (size == SIZE_MAX || count > (SIZE_MAX / 2 - size) / elem_size)
+    return SIZE_MAX;
+
+  return size + ALIGN(count * elem_size);
+}
+
+// Size of the object itself.
+static size_t object_size(enum obj_type type)
+{
+  switch (type) {
+  case OBJ_ATOM:
+    return sizeof(struct obj_string);
+  case OBJ_CLOSURE:
+    return sizeof(struct obj_closure);
+  case OBJ_LAMBDA:
+    return sizeof(struct obj_lambda);
+  case OBJ_NATIVE:
+    return sizeof(struct obj_native);
+  case OBJ_UPVALUE:
+    return sizeof(struct obj_upvalue);
+  case OBJ_PAIR:
+    return sizeof(struct obj_pair);
+  case OBJ_MAPPING:
+    return sizeof(struct obj_mapping);
+  case OBJ_BYTES:
+    return sizeof(struct obj_bytes);
+  }
+
+  return SIZE_MAX;
+}
+
+// Size of the object with its arrays. The name of a native function is not
+// counted, as its length is only known from the name itself.
+static size_t record_size(struct obj *obj)
+{
+  size_t size = ALIGN(object_size(obj->type));
+
+  switch (obj->type) {
+  case OBJ_ATOM: {
+    size_t len = ((struct obj_string *) obj)->len;
+    return len >= SIZE_MAX / 2 ? SIZE_MAX : add_array(size, len + 1, 1);
+  }
+  case OBJ_CLOSURE:
+    return add_array(size,
+        (size_t) ((struct obj_closure *) obj)->upvalue_count,
+        sizeof(struct obj_upvalue *));
+  case OBJ_LAMBDA: {
+    struct chunk *chunk = &((struct obj_lambda *) obj)->chunk;
+    size = add_array(size, (size_t) chunk->count, 1);
+    size = add_array(size, (size_t) chunk->line_count,
+        sizeof(struct line_run));
+    return add_array(size, (size_t) chunk->constants.count, sizeof(Value));
+  }
+  case OBJ_MAPPING:
+    return add_array(size, ((struct obj_mapping *) obj)->size, 1);
+  default:
+    return size;
+  }
+}
+
+static void visit(struct snapshot_writer *s, struct obj *obj)
+{
+  if (obj == NULL)
+    return;
+
+  uint32_t count = s->index.count;
+  obj_index_get_or_add(&s->index, obj, count);
+  if (s->index.count == count)
+    return;
+
+  if (s->count >= s->capacity) {
+    s->capacity = GROW_CAPACITY(s->capacity);
+    s->objs = realloc(s->objs, sizeof(struct obj *) * s->capacity);
+    s->offsets = realloc(s->offsets, sizeof(uint64_t) * s->capacity);
+    if (s->objs == NULL || s->offsets == NULL)
+      exit(1);
+  }
+
+  s->objs[s->count++] = obj;
+}
+
+static void visit_value(struct snapshot_writer *s, Value val)
+{
+  if (IS_OBJ(val))
+    visit(s, AS_OBJ(val));
+}
+
+static void visit_references(struct snapshot_writer *s, struct obj *obj)
+{
+  switch (obj->type) {
+  case OBJ_ATOM:
+  case OBJ_NATIVE:
+  case OBJ_MAPPING:
+    break;
+  case OBJ_CLOSURE: {
+    struct obj_closure *closure = (struct obj_closure *) obj;
+    visit(s, (struct obj *) closure->lambda);
+
+    for (int i = 0; i < closure->upvalue_count; ++i)
+      visit(s, (struct obj *) closure->upvalues[i]);
+    break;
+  }
+  case OBJ_LAMBDA: {
+    struct obj_lambda *lambda = (struct obj_lambda *) obj;
+
+    // The lambda is reachable from the globals, so it survives any garbage
+    // collection while its body is compiled.
+    if (lambda->lazy != NULL && !compile_lazy(s->w, lambda)) {
+      s->has_failed = true;
+      break;
+    }
+
+    for (int i = 0; i < lambda->chunk.constants.count; ++i)
+      visit_value(s, lambda->chunk.constants.values[i]);
+    break;
+  }
+  case OBJ_UPVALUE: {
+    struct obj_upvalue *upvalue = (struct obj_upvalue *) obj;
+
+    // Nothing is executing, so all upvalues are closed.
+    if (upvalue->location != &upvalue->closed)
+      s->has_failed = true;
+
+    visit_value(s, upvalue->closed);
+    break;
+  }
+  case OBJ_PAIR:
+    visit_value(s, ((struct obj_pair *) obj)->car);
+    visit_value(s, ((struct obj_pair *) obj)->cdr);
+    break;
+  case OBJ_BYTES:
+    visit(s, (struct obj *) ((struct obj_bytes *) obj)->mapping);
+    break;
+  }
+}
+
+static uint64_t offset_of(struct snapshot_writer *s, struct obj *obj)
+{
+  if (obj == NULL)
+    return 0;
+
+  return s->offsets[obj_index_get_or_add(&s->index, obj, 0)];
+}
+
+static Value translate(struct snapshot_writer *s, Value val)
+{
+  if (IS_OBJ(val))
+    val.as.obj = OFFSET(struct obj *, offset_of(s, AS_OBJ(val)));
+
+  return val;
+}
+
+static void write_padding(struct snapshot_writer *s, size_t size)
+{
+  static const uint8_t padding[8] = {0};
+  fwrite(padding, 1, ALIGN(size) - size, s->file);
+}
+
+static void write_padded(struct snapshot_writer *s, const void *bytes,
+    size_t size)
+{
+  if (size > 0)
+    fwrite(bytes, 1, size, s->file);
+
+  write_padding(s, size);
+}
+
+// Writes the object itself, as static, since the restored objects stay in
+// the mapped snapshot.
+static void write_record(struct snapshot_writer *s, union record *record,
+    size_t size)
+{
+  record->obj.is_remembered = false;
+  record->obj.is_large = false;
+  record->obj.is_static = true;
+  write_padded(s, record, size);
+}
+
+static void write_object(struct snapshot_writer *s, uint32_t i)
+{
+  struct obj *obj = s->objs[i];
+  uint64_t offset = s->offsets[i];
+  union record record;
+
+  switch (obj->type) {
+  case OBJ_ATOM: {
+    struct obj_string *atom = (struct obj_string *) obj;
+    record.atom = *atom;
+    record.atom.chars = OFFSET(char *,
+        offset + ALIGN(sizeof(struct obj_string)));
+
+    write_record(s, &record, sizeof(struct obj_string));
+    write_padded(s, atom->chars, atom->len + 1);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    struct obj_closure *closure = (struct obj_closure *) obj;
+    record.closure = *closure;
+    record.closure.lambda = OFFSET(struct obj_lambda *,
+        offset_of(s, (struct obj *) closure->lambda));
+    record.closure.upvalues = closure->upvalue_count == 0
+      ? NULL
+      : OFFSET(struct obj_upvalue **,
+          offset + ALIGN(sizeof(struct obj_closure)));
+
+    write_record(s, &record, sizeof(struct obj_closure));
+    for (int j = 0; j < closure->upvalue_count; ++j) {
+      struct obj_upvalue *upvalue = OFFSET(struct obj_upvalue *,
+          offset_of(s, (struct obj *) closure->upvalues[j]));
+      fwrite(&upvalue, sizeof(upvalue), 1, s->file);
+    }
+
+    write_padding(s, sizeof(struct obj_upvalue *)
+        * (size_t) closure->upvalue_count);
+    break;
+  }
+  case OBJ_LAMBDA: {
+    struct obj_lambda *lambda = (struct obj_lambda *) obj;
+    struct chunk *chunk = &record.lambda.chunk;
+    uint64_t code = offset + ALIGN(sizeof(struct obj_lambda));
+    uint64_t lines = code + ALIGN((size_t) lambda->chunk.count);
+    uint64_t constants = lines
+      + ALIGN(sizeof(struct line_run) * (size_t) lambda->chunk.line_count);
+
+    record.lambda = *lambda;
+    record.lambda.image = NULL;
+    chunk->code = OFFSET(uint8_t *, code);
+    chunk->capacity = chunk->count;
+    chunk->lines = OFFSET(struct line_run *, lines);
+    chunk->line_capacity = chunk->line_count;
+    chunk->constants.values = chunk->constants.count == 0
+      ? NULL
+      : OFFSET(Value *, constants);
+    chunk->constants.capacity = chunk->constants.count;
+
+    write_record(s, &record, sizeof(struct obj_lambda));
+    write_padded(s, lambda->chunk.code, (size_t) lambda->chunk.count);
+    write_padded(s, lambda->chunk.lines,
+        sizeof(struct line_run) * (size_t) lambda->chunk.line_count);
+
+    for (int j = 0; j < lambda->chunk.constants.count; ++j) {
+      Value constant = translate(s, lambda->chunk.constants.values[j]);
+      fwrite(&constant, sizeof(constant), 1, s->file);
+    }
+
+    write_padding(s, sizeof(Value) * (size_t) lambda->chunk.constants.count);
+    break;
+  }
+  case OBJ_NATIVE: {
+    struct obj_native *native = (struct obj_native *) obj;
+    record.native = *native;
+    record.native.function = NULL;
+    record.native.name = OFFSET(const char *,
+        offset + ALIGN(sizeof(struct obj_native)));
+
+    write_record(s, &record, sizeof(struct obj_native));
+    write_padded(s, native->name, strlen(native->name) + 1);
+    break;
+  }
+  case OBJ_UPVALUE: {
+    struct obj_upvalue *upvalue = (struct obj_upvalue *) obj;
+    record.upvalue = *upvalue;
+    record.upvalue.location = OFFSET(Value *,
+        offset + offsetof(struct obj_upvalue, closed));
+    record.upvalue.closed = translate(s, upvalue->closed);
+    record.upvalue.next = NULL;
+
+    write_record(s, &record, sizeof(struct obj_upvalue));
+    break;
+  }
+  case OBJ_PAIR: {
+    struct obj_pair *pair = (struct obj_pair *) obj;
+    record.pair = *pair;
+    record.pair.car = translate(s, pair->car);
+    record.pair.cdr = translate(s, pair->cdr);
+
+    write_record(s, &record, sizeof(struct obj_pair));
+    break;
+  }
+  case OBJ_MAPPING: {
+    struct obj_mapping *mapping = (struct obj_mapping *) obj;
+    record.mapping = *mapping;
+    record.mapping.start = mapping->size == 0
+      ? NULL
+      : OFFSET(void *, offset + ALIGN(sizeof(struct obj_mapping)));
+
+    // The mapped bytes are copied, so the snapshot does not depend on the
+    // file staying unchanged.
+    write_record(s, &record, sizeof(struct obj_mapping));
+    write_padded(s, mapping->start, mapping->size);
+    break;
+  }
+  case OBJ_BYTES: {
+    struct obj_bytes *vector = (struct obj_bytes *) obj;
+    struct obj_mapping *mapping = vector->mapping;
+
+    record.bytes = *vector;
+    record.bytes.mapping = OFFSET(struct obj_mapping *,
+        offset_of(s, (struct obj *) mapping));
+    record.bytes.bytes = mapping->start == NULL
+      ? NULL
+      : OFFSET(const uint8_t *, offset_of(s, (struct obj *) mapping)
+          + ALIGN(sizeof(struct obj_mapping))
+          + (uint64_t) (vector->bytes - (const uint8_t *) mapping->start));
+
+    write_record(s, &record, sizeof(struct obj_bytes));
+    break;
+  }
+  }
+}
+
+// Writes the snapshot of the state into the file.
+static bool write_snapshot(struct wisp_state *w, FILE *file)
+{
+  if (w->frame_count > 0 || w->compiler != NULL)
+    return false;
+
+  struct snapshot_writer s;
+  s.w = w;
+  s.file = file;
+  obj_index_init(&s.index);
+  s.objs = NULL;
+  s.offsets = NULL;
+  s.count = 0;
+  s.capacity = 0;
+  s.has_failed = false;
+
+  // Only the objects reachable from the globals are written. The array of
+  // objects doubles as the work list of objects to walk.
+  uint64_t global_count = 0;
+  for (int i = 0; i < w->globals.capacity; ++i)
+    if (w->globals.ht[i].key != NULL) {
+      visit(&s, (struct obj *) w->globals.ht[i].key);
+      visit_value(&s, w->globals.ht[i].val);
+      global_count++;
+    }
+
+  for (uint32_t i = 0; i < s.count; ++i)
+    visit_references(&s, s.objs[i]);
+
+  uint64_t offset = sizeof(struct snapshot_header);
+  for (uint32_t i = 0; i < s.count; ++i) {
+    s.offsets[i] = offset;
+    offset += record_size(s.objs[i]);
+
+    if (s.objs[i]->type == OBJ_NATIVE)
+      offset += ALIGN(strlen(((struct obj_native *) s.objs[i])->name) + 1);
+  }
+
+  struct snapshot_header header;
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.object_count = s.count;
+  header.globals = offset;
+  header.global_count = global_count;
+  header.size = offset + global_count * sizeof(struct table_node);
+
+  if (!s.has_failed) {
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (uint32_t i = 0; i < s.count; ++i)
+      write_object(&s, i);
+
+    for (int i = 0; i < w->globals.capacity; ++i)
+      if (w->globals.ht[i].key != NULL) {
+        struct table_node node;
+        node.key = OFFSET(struct obj_string *,
+            offset_of(&s, (struct obj *) w->globals.ht[i].key));
+        node.val = translate(&s, w->globals.ht[i].val);
+        fwrite(&node, sizeof(node), 1, file);
+      }
+  }
+
+  obj_index_free(&s.index);
+  free(s.objs);
+  free(s.offsets);
+  return !s.has_failed && !ferror(file);
+}
+
+bool wisp_state_snapshot(struct wisp_state *w, const char *path)
+{
+  // Written under a temporary name, and renamed once complete.
+  size_t path_len = strlen(path);
+  char *temp_path = malloc(path_len + sizeof(".XXXXXX"));
+  if (temp_path == NULL)
+    exit(1);
+
+  memcpy(temp_path, path, path_len);
+  memcpy(temp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  int fd = mkstemp(temp_path);
+  FILE *file = fd == -1 ? NULL : fdopen(fd, "wb");
+
+  if (fd != -1 && file == NULL) {
+    close(fd);
+    unlink(temp_path);
+  }
+
+  bool is_written = file != NULL;
+  if (is_written) {
+    is_written = write_snapshot(w, file);
+    is_written = fclose(file) == 0 && is_written;
+    is_written = is_written && rename(temp_path, path) == 0;
+
+    if (!is_written)
+      unlink(temp_path);
+  }
+
+  free(temp_path);
+  return is_written;
+}
+
+// Turns an offset in the snapshot into a pointer, checking that the given
+// number of bytes at the offset lies within the snapshot.
+static void *relocate(struct restorer *r, const void *ptr, size_t size)
+{
+  uintptr_t offset = (uintptr_t) ptr;
+
+  if (offset == 0)
+    return NULL;
+
+  if (offset > r->size || r->size - offset < size) {
+    r->is_valid = false;
+    return NULL;
+  }
+
+  return r->base + offset;
+}
+
+static Value relocate_value(struct restorer *r, Value val)
+{
+  if (IS_OBJ(val))
+    val.as.obj = relocate(r, val.as.obj, sizeof(struct obj));
+
+  return val;
+}
+
+// Relocates the pointers of the object, returning the size of its record,
+// or 0 if the record does not fit into the rest of the snapshot.
+static size_t restore_object(struct restorer *r, struct obj *obj,
+    size_t rest)
+{
+  if ((unsigned) obj->type > OBJ_BYTES
+      || ALIGN(object_size(obj->type)) > rest)
+    return 0;
+
+  size_t size = record_size(obj);
+  if (size > rest)
+    return 0;
+
+  switch (obj->type) {
+  case OBJ_ATOM: {
+    struct obj_string *atom = (struct obj_string *) obj;
+    atom->chars = relocate(r, atom->chars, atom->len + 1);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    struct obj_closure *closure = (struct obj_closure *) obj;
+    closure->lambda = relocate(r, closure->lambda, sizeof(struct obj_lambda));
+    closure->upvalues = relocate(r, closure->upvalues,
+        sizeof(struct obj_upvalue *) * (size_t) closure->upvalue_count);
+
+    for (int i = 0; r->is_valid && i < closure->upvalue_count; ++i)
+      closure->upvalues[i] = relocate(r, closure->upvalues[i],
+          sizeof(struct obj_upvalue));
+    break;
+  }
+  case OBJ_LAMBDA: {
+    struct obj_lambda *lambda = (struct obj_lambda *) obj;
+    struct chunk *chunk = &lambda->chunk;
+    chunk->code = relocate(r, chunk->code, (size_t) chunk->count);
+    chunk->lines = relocate(r, chunk->lines,
+        sizeof(struct line_run) * (size_t) chunk->line_count);
+    chunk->constants.values = relocate(r, chunk->constants.values,
+        sizeof(Value) * (size_t) chunk->constants.count);
+
+    if (lambda->lazy != NULL || lambda->image != NULL)
+      r->is_valid = false;
+
+    for (int i = 0; r->is_valid && i < chunk->constants.count; ++i)
+      chunk->constants.values[i] = relocate_value(r,
+          chunk->constants.values[i]);
+    break;
+  }
+  case OBJ_NATIVE: {
+    struct obj_native *native = (struct obj_native *) obj;
+    native->name = relocate(r, native->name, 1);
+
+    // The name follows the native, and its length gives the record size.
+    const char *end = native->name == NULL ? NULL : memchr(native->name,
+        '\0', (size_t) (r->base + r->size - native->name));
+    if (end == NULL)
+      return 0;
+
+    size += ALIGN((size_t) (end - native->name) + 1);
+    native->function = natives_find(native->name, native->arity);
+
+    if (native->function == NULL || size > rest)
+      return 0;
+    break;
+  }
+  case OBJ_UPVALUE: {
+    struct obj_upvalue *upvalue = (struct obj_upvalue *) obj;
+    upvalue->location = relocate(r, upvalue->location, sizeof(Value));
+    upvalue->closed = relocate_value(r, upvalue->closed);
+    upvalue->next = NULL;
+    break;
+  }
+  case OBJ_PAIR: {
+    struct obj_pair *pair = (struct obj_pair *) obj;
+    pair->car = relocate_value(r, pair->car);
+    pair->cdr = relocate_value(r, pair->cdr);
+    break;
+  }
+  case OBJ_MAPPING: {
+    struct obj_mapping *mapping = (struct obj_mapping *) obj;
+    mapping->start = relocate(r, mapping->start, mapping->size);
+    break;
+  }
+  case OBJ_BYTES: {
+    struct obj_bytes *vector = (struct obj_bytes *) obj;
+    vector->mapping = relocate(r, vector->mapping,
+        sizeof(struct obj_mapping));
+    vector->bytes = relocate(r, vector->bytes, vector->len);
+    break;
+  }
+  }
+
+  return r->is_valid ? size : 0;
+}
+
+void shared_heap_free(struct shared_heap *heap)
+{
+  munmap(heap->base, heap->size);
+  free(heap->atoms);
+  free(heap);
+}
+
+// Maps the snapshot in the file into memory and relocates its pointers,
+// returning NULL if the snapshot is not valid.
+static struct shared_heap *shared_heap_load(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+      || (size_t) st.st_size < sizeof(struct snapshot_header))
+    return NULL;
+
+  // Mapped privately, so that relocating the pointers never changes the
+  // file.
+  struct restorer r;
+  r.size = (size_t) st.st_size;
+  r.base = mmap(NULL, r.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  r.is_valid = true;
+
+  if (r.base == MAP_FAILED)
+    return NULL;
+
+  struct snapshot_header header;
+  memcpy(&header, r.base, sizeof(header));
+
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+      || header.version != SNAPSHOT_VERSION
+      || header.byte_order != SNAPSHOT_BYTE_ORDER
+      || header.size != r.size || header.globals > r.size
+      || header.globals < sizeof(header) || header.globals % 8 != 0
+      || header.global_count > (r.size - header.globals)
+         / sizeof(struct table_node))
+    r.is_valid = false;
+
+  struct shared_heap *heap = malloc(sizeof(struct shared_heap));
+  if (heap == NULL)
+    exit(1);
+
+  heap->base = r.base;
+  heap->size = r.size;
+  heap->atoms = NULL;
+  heap->atom_count = 0;
+  heap->globals = (struct table_node *) (r.base + header.globals);
+  heap->global_count = (size_t) header.global_count;
+
+  size_t atom_capacity = 0;
+  size_t offset = sizeof(header);
+
+  for (uint64_t i = 0; r.is_valid && i < header.object_count; ++i) {
+    struct obj *obj = (struct obj *) (r.base + offset);
+    size_t size = header.globals - offset < sizeof(struct obj)
+      ? 0
+      : restore_object(&r, obj, header.globals - offset);
+
+    if (size == 0) {
+      r.is_valid = false;
+      break;
+    }
+
+    // The objects are static, so that the collector never writes into them
+    // nor walks them, as they only refer to each other.
+    obj->is_remembered = false;
+    obj->is_large = false;
+    obj->is_static = true;
+    offset += size;
+
+    if (obj->type != OBJ_ATOM)
+      continue;
+
+    if (heap->atom_count == atom_capacity) {
+      atom_capacity = GROW_CAPACITY(atom_capacity);
+      heap->atoms = realloc(heap->atoms,
+          sizeof(struct obj_string *) * atom_capacity);
+      if (heap->atoms == NULL)
+        exit(1);
+    }
+
+    heap->atoms[heap->atom_count++] = (struct obj_string *) obj;
+  }
+
+  for (size_t i = 0; r.is_valid && i < heap->global_count; ++i) {
+    heap->globals[i].key = relocate(&r, heap->globals[i].key,
+        sizeof(struct obj_string));
+    heap->globals[i].val = relocate_value(&r, heap->globals[i].val);
+  }
+
+  if (!r.is_valid || mprotect(r.base, r.size, PROT_READ) == -1) {
+    shared_heap_free(heap);
+    return NULL;
+  }
+
+  return heap;
+}
+
+// Makes the objects of the heap available to the state, by interning its
+// atoms and defining its globals.
+static void use_shared_heap(struct wisp_state *w, struct shared_heap *heap,
+    bool owns_heap)
+{
+  w->snapshot = heap;
+  w->owns_snapshot = owns_heap;
+
+  for (size_t i = 0; i < heap->atom_count; ++i)
+    str_pool_add(w, heap->atoms[i]);
+
+  for (size_t i = 0; i < heap->global_count; ++i)
+    table_set(w, &w->globals, heap->globals[i].key, heap->globals[i].val);
+}
+
+bool wisp_state_restore(struct wisp_state *w, const char *path)
+{
+  if (pool_next_page(&w->pool, NULL) != NULL || w->pool.large != NULL
+      || w->snapshot != NULL)
+    return false;
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  struct shared_heap *heap = shared_heap_load(fd);
+  close(fd);
+
+  if (heap == NULL)
+    return false;
+
+  use_shared_heap(w, heap, true);
+  return true;
+}
+
+bool wisp_state_clone(struct wisp_state *clone, struct wisp_state *template)
+{
+  // The template is frozen on its first clone, by taking its snapshot into
+  // a temporary file, which is only ever read from memory.
+  if (template->shared == NULL) {
+    FILE *file = tmpfile();
+    if (file == NULL)
+      return false;
+
+    if (write_snapshot(template, file) && fflush(file) == 0)
+      template->shared = shared_heap_load(fileno(file));
+
+    fclose(file);
+    if (template->shared == NULL)
+      return false;
+  }
+
+  wisp_state_init(clone);
+  clone->lazy_compile = template->lazy_compile;
+  use_shared_heap(clone, template->shared, false);
+  return true;
+}
@@ -0,0 +1,56 @@
+#ifndef WISP_SNAPSHOT_H
+#define WISP_SNAPSHOT_H
+
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+// Objects of a snapshot mapped into memory, whose pointers have been
+// relocated. The objects only refer to each other, and are read-only, so any
+// number of states can use them in place at the same time.
+struct shared_heap {
+  // Start of the mapped snapshot.
+  char *base;
+
+  // Size of the snapshot.
+  size_t size;
+
+  // The atoms of the snapshot, interned by each state using it.
+  struct obj_string **atoms;
+
+  // Number of the atoms.
+  size_t atom_count;
+
+  // The global variables of the snapshot, defined by each state using it.
+  struct table_node *globals;
+
+  // Number of the global variables.
+  size_t global_count;
+};
+
+// Writes all objects reachable from the global variables, the global
+// variables and the interned atoms into a file, so that the state can be
+// restored later without executing anything. Lambda bodies whose
+// compilation has been deferred are compiled first. The state must not be
+// executing or compiling anything.
+bool wisp_state_snapshot(struct wisp_state *, const char *);
+
+// Restores a state from a snapshot, which is mapped into memory and whose
+// objects are used in place, after their pointers are relocated. The state
+// must be freshly initialized, before any native functions are defined.
+// The snapshot is trusted, much like a compiled image, so only its layout
+// is checked, not the types of the objects it refers to.
+bool wisp_state_restore(struct wisp_state *, const char *);
+
+// Initializes a state with the global variables of the template. On its
+// first clone, the template is frozen into a snapshot, whose objects its
+// clones share without copying them, so a clone only starts with its own
+// tables of atoms and globals. Redefining a global in a clone thus leaves
+// the template and the other clones alone. Changes made to the template
+// after it is frozen are not seen by the clones, and the template must
+// outlive them.
+bool wisp_state_clone(struct wisp_state *, struct wisp_state *);
+
+void shared_heap_free(struct shared_heap *);
+
+#endif
@@ -1,26 +1,74 @@
 #include "memory.h"
+#include "reader.h"
+#include "snapshot.h"
 #include "state.h"
 #include "vm.h"
 
 void wisp_state_init(struct wisp_state *w)
 {
   vm_stack_reset(w);
-  w->objects = NULL;
+  w->remembered = NULL;
+  w->remembered_count = 0;
+  w->remembered_capacity = 0;
+  pool_init(&w->pool);
   str_pool_init(w);
   table_init(&w->globals);
   w->bytes_allocated = 0;
   w->next_gc = 1024 * 1024;
+  w->nursery_size = 256 * 1024;
+  w->next_young_gc = w->nursery_size;
   w->gray_count = 0;
   w->gray_capacity = 0;
   w->gray_stack = NULL;
+  w->gc_threads = 1;
+  w->max_gc_pause = 0;
+  w->compact_idle = false;
+  w->gc_phase = GC_IDLE;
+  w->gc_cursor = NULL;
+  w->sweep_large = NULL;
+  w->lazy_compile = false;
+  w->compiler = NULL;
+  arena_init(&w->compile_arena);
+  w->pending_forms = NULL;
+  w->reader = NULL;
+  w->input = NULL;
+  w->files = NULL;
+  w->snapshot = NULL;
+  w->owns_snapshot = false;
+  w->shared = NULL;
 }
 
 void wisp_state_free(struct wisp_state *w)
 {
   wisp_free_objs(w);
+  pool_free(&w->pool);
   free(w->gray_stack);
+  free(w->remembered);
   table_free(w, &w->globals);
   str_pool_free(w);
+  arena_free(&w->compile_arena);
+
+  if (w->input != NULL) {
+    reader_free(w->input);
+    free(w->input);
+  }
+
+  while (w->files != NULL) {
+    struct file_input *next = w->files->next;
+    fclose(w->files->reader->file);
+    reader_free(w->files->reader);
+    free(w->files->reader);
+    free(w->files->path);
+    free(w->files);
+    w->files = next;
+  }
+
+  if (w->owns_snapshot)
+    shared_heap_free(w->snapshot);
+
+  if (w->shared != NULL)
+    shared_heap_free(w->shared);
+
   wisp_state_init(w);
   vm_stack_reset(w);
 }
@@ -1,7 +1,9 @@
 #ifndef WISP_STATE_H
 #define WISP_STATE_H
 
+#include "arena.h"
 #include "common.h"
+#include "pool.h"
 #include "strpool.h"
 #include "table.h"
 #include "value.h"
@@ -9,6 +11,37 @@
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+struct compiler;
+struct reader;
+struct shared_heap;
+
+// A file read by the 'read-file' function.
+struct file_input {
+  // Path the file was opened at.
+  char *path;
+
+  // Reader of the file, kept from one call to the next.
+  struct reader *reader;
+
+  // The next file read (or NULL).
+  struct file_input *next;
+};
+
+// Phases of an incremental collection.
+enum gc_phase {
+  // No incremental collection is in progress.
+  GC_IDLE,
+
+  // The old objects are being unmarked.
+  GC_CLEAR,
+
+  // The reachable objects are being marked.
+  GC_MARK,
+
+  // The unmarked objects are being freed.
+  GC_SWEEP,
+};
+
 struct call_frame {
   // Currently executed closure.
   struct obj_closure *closure;
@@ -36,8 +69,18 @@ struct wisp_state {
   // List of upvalues pointing to local variables still on the stack.
   struct obj_upvalue *open_upvalues;
 
-  // List of all collectable objects.
-  struct obj *objects;
+  // Old objects that may refer to young ones, marked again by the next
+  // minor collection.
+  struct obj **remembered;
+
+  // Number of the remembered objects.
+  int remembered_count;
+
+  // Capacity of the 'remembered' array.
+  int remembered_capacity;
+
+  // Holds all collectable objects, along with their mark bits.
+  struct pool pool;
 
   // TODO: When strings are implemented, consider whether they should be
   // TODO: interned or not. If not, the implementation of strings, atoms and
@@ -57,6 +100,12 @@ struct wisp_state {
   // Once 'bytes_allocated' exceeds this number, do a GC run.
   size_t next_gc;
 
+  // Once 'bytes_allocated' exceeds this number, collect the young objects.
+  size_t next_young_gc;
+
+  // Number of bytes allocated between the collections of young objects.
+  size_t nursery_size;
+
   // Number of gray objects currently in 'gray_stack'.
   int gray_count;
 
@@ -65,6 +114,69 @@ struct wisp_state {
 
   // Contains all collectable objects marked gray in the current GC run.
   struct obj **gray_stack;
+
+  // Number of threads marking objects in a full collection, which is not
+  // incremental.
+  int gc_threads;
+
+  // Longest pause of a slice of an incremental full collection, in
+  // microseconds, or 0 if full collections are done all at once.
+  int max_gc_pause;
+
+  // Whether the heap is compacted when the state is idle and the heap is
+  // fragmented, rather than only having its garbage collected.
+  bool compact_idle;
+
+  // Phase of the incremental collection in progress.
+  enum gc_phase gc_phase;
+
+  // The next page to unmark while clearing, or to sweep.
+  struct pool_page *gc_cursor;
+
+  // The next large object to sweep, the ones allocated while sweeping
+  // being listed before it.
+  struct pool_large *sweep_large;
+
+  // Whether to defer the compilation of lambda bodies until their first call.
+  // The compiled source must then outlive the state.
+  bool lazy_compile;
+
+  // The innermost compiler currently running (or NULL when not compiling).
+  // The lambdas of the whole compiler chain are GC roots.
+  struct compiler *compiler;
+
+  // Holds the buffers of the running compilers, released when the outermost
+  // one finishes. Compiled chunks are copied out of it at their exact size.
+  struct arena compile_arena;
+
+  // Top-level forms compiled ahead of their execution (or NULL), held as
+  // the constants of a lambda, which is a GC root.
+  struct obj_lambda *pending_forms;
+
+  // The reader currently reading a datum (or NULL). The lists it has not
+  // finished reading yet are GC roots.
+  struct reader *reader;
+
+  // Reader of the standard input for the 'read' function, created on its
+  // first call (or NULL).
+  struct reader *input;
+
+  // Files read by the 'read-file' function, each opened on the first call
+  // for its path.
+  struct file_input *files;
+
+  // The heap snapshot whose objects the state uses in place (or NULL),
+  // either restored from a file or shared with the template the state was
+  // cloned from. Its objects are never collected.
+  struct shared_heap *snapshot;
+
+  // Whether the snapshot is freed with the state, rather than by the
+  // template.
+  bool owns_snapshot;
+
+  // Snapshot of the state shared with its clones, taken on the first clone
+  // (or NULL).
+  struct shared_heap *shared;
 };
 
 void wisp_state_init(struct wisp_state *);
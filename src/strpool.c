@@ -34,8 +34,9 @@ static void adjust_capacity(struct wisp_state *w)
 
   int new_count = 0;
   int new_exp = GROW_EXP_CAPACITY(pool->exp);
-  struct obj_string **new_ht = wisp_calloc(w, old_capacity,
-      (size_t) CAPACITY(new_exp), sizeof(struct obj_string *));
+  // The old array is accounted for as freed below.
+  struct obj_string **new_ht = wisp_calloc(w, 0, (size_t) CAPACITY(new_exp),
+      sizeof(struct obj_string *));
 
   if (pool->ht != NULL) {
     for (int p = 0; p < CAPACITY(pool->exp); ++p) {
@@ -67,11 +68,12 @@ void str_pool_init(struct wisp_state *w)
   struct str_pool *pool = &w->str_pool;
 
   // The placeholder value is allocated on the stack and initialized
-  // to marked = true. That way, it is never collected, and can be
+  // as static. That way, it is never collected, and can be
   // referenced from the table when an element is removed.
   pool->gravestone.obj.type = OBJ_ATOM;
-  pool->gravestone.obj.is_marked = true;
-  pool->gravestone.obj.next = NULL;
+  pool->gravestone.obj.is_remembered = false;
+  pool->gravestone.obj.is_large = false;
+  pool->gravestone.obj.is_static = true;
   pool->gravestone.chars = "<deleted>";
   pool->gravestone.len = strlen(pool->gravestone.chars);
   pool->gravestone.hash = (uint64_t) 0;
@@ -81,6 +83,23 @@ void str_pool_init(struct wisp_state *w)
   pool->exp = 1;
   pool->count = 0;
   pool->ht = NULL;
+  pool->young = NULL;
+  pool->young_count = 0;
+  pool->young_capacity = 0;
+}
+
+static void add_young(struct str_pool *pool, struct obj_string *str)
+{
+  if (pool->young_count >= pool->young_capacity) {
+    pool->young_capacity = GROW_CAPACITY(pool->young_capacity);
+    pool->young = realloc(pool->young,
+        sizeof(struct obj_string *) * pool->young_capacity);
+
+    if (pool->young == NULL)
+      exit(1);
+  }
+
+  pool->young[pool->young_count++] = str;
 }
 
 struct obj_string *str_pool_intern(struct wisp_state *w, const char *str,
@@ -109,6 +128,7 @@ struct obj_string *str_pool_intern(struct wisp_state *w, const char *str,
 
       // TODO: Once strings are implemented, change the object type.
       *dest = string_copy(w, OBJ_ATOM, str, len, hash);
+      add_young(pool, *dest);
       return *dest;
     } else if (dest == NULL && pool->ht[i] == &pool->gravestone) {
       dest = &pool->ht[i];
@@ -119,6 +139,25 @@ struct obj_string *str_pool_intern(struct wisp_state *w, const char *str,
   }
 }
 
+void str_pool_add(struct wisp_state *w, struct obj_string *str)
+{
+  struct str_pool *pool = &w->str_pool;
+
+  if (pool->count + 1 == CAPACITY(pool->exp - 1))
+    // Resize at 50% load.
+    adjust_capacity(w);
+
+  for (int32_t i = str->hash;;) {
+    i = ht_lookup(str->hash, pool->exp, i);
+
+    if (pool->ht[i] == NULL || pool->ht[i] == &pool->gravestone) {
+      pool->count += pool->ht[i] == NULL;
+      pool->ht[i] = str;
+      return;
+    }
+  }
+}
+
 void str_pool_unintern(struct wisp_state *w, struct obj_string *str)
 {
   struct str_pool *pool = &w->str_pool;
@@ -142,19 +181,34 @@ void str_pool_remove_white(struct wisp_state *w)
 {
   struct str_pool *pool = &w->str_pool;
 
+  pool->young_count = 0;
+
   if (pool->ht == NULL)
     return;
 
   for (int i = 0; i < CAPACITY(pool->exp); ++i) {
-    if (pool->ht[i] != NULL && !pool->ht[i]->obj.is_marked)
+    if (pool->ht[i] != NULL && !obj_is_marked(&pool->ht[i]->obj))
       str_pool_unintern(w, pool->ht[i]);
   }
 }
 
+void str_pool_remove_young(struct wisp_state *w)
+{
+  struct str_pool *pool = &w->str_pool;
+
+  // The old atoms stay marked until the next full collection.
+  for (int i = 0; i < pool->young_count; ++i)
+    if (!obj_is_marked(&pool->young[i]->obj))
+      str_pool_unintern(w, pool->young[i]);
+
+  pool->young_count = 0;
+}
+
 void str_pool_free(struct wisp_state *w)
 {
   struct str_pool *pool = &w->str_pool;
   size_t old_capacity = (size_t) (pool->ht == NULL ? 0 : CAPACITY(pool->exp));
   FREE_ARRAY(w, struct obj_string *, pool->ht, old_capacity);
+  free(pool->young);
   str_pool_init(w);
 }
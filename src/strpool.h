@@ -18,16 +18,33 @@ struct str_pool {
 
   // Placeholder value for a deleted element.
   struct obj_string gravestone;
+
+  // Atoms interned since the last collection, the only ones a collection of
+  // the young objects can find unmarked.
+  struct obj_string **young;
+
+  // Number of the young atoms.
+  int young_count;
+
+  // Capacity of the 'young' array.
+  int young_capacity;
 };
 
 void str_pool_init(struct wisp_state *);
 
 struct obj_string *str_pool_intern(struct wisp_state *, const char *, size_t);
 
+// Interns an existing atom, which must not be interned yet.
+void str_pool_add(struct wisp_state *, struct obj_string *);
+
 void str_pool_unintern(struct wisp_state *, struct obj_string *);
 
+// Removes the atoms not marked by a full collection.
 void str_pool_remove_white(struct wisp_state *);
 
+// Removes the young atoms not marked by a collection of the young objects.
+void str_pool_remove_young(struct wisp_state *);
+
 void str_pool_free(struct wisp_state *);
 
 #endif
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "memory.h"
+#include "printer.h"
 #include "state.h"
 #include "value.h"
 
@@ -10,17 +11,10 @@
 
 void value_print(Value val)
 {
-  switch (val.type) {
-  case VAL_NIL:
-    printf("nil");
-    break;
-  case VAL_NUM:
-    printf("%g", AS_NUM(val));
-    break;
-  case VAL_OBJ:
-    obj_print(AS_OBJ(val));
-    break;
-  }
+  struct printer p;
+  printer_init(&p, stdout, false);
+  printer_print(&p, val);
+  printer_free(&p);
 }
 
 void value_array_init(struct value_array *array)
@@ -58,25 +52,28 @@ void chunk_init(struct chunk *chunk)
   chunk->capacity = 0;
   chunk->count = 0;
   chunk->code = NULL;
+  chunk->line_capacity = 0;
+  chunk->line_count = 0;
   chunk->lines = NULL;
   value_array_init(&chunk->constants);
 }
 
-void chunk_write(struct wisp_state *w, struct chunk *chunk, uint8_t codepoint,
-    int line)
+int chunk_get_line(struct chunk *chunk, int offset)
 {
-  if (chunk->count >= chunk->capacity) {
-    int old_capacity = chunk->capacity;
-    chunk->capacity = GROW_CAPACITY(old_capacity);
-    chunk->code = GROW_ARRAY(w, uint8_t, chunk->code, old_capacity,
-        chunk->capacity);
-    chunk->lines = GROW_ARRAY(w, int, chunk->lines, old_capacity,
-        chunk->capacity);
+  // Find the last run starting at or before the offset.
+  int low = 0;
+  int high = chunk->line_count - 1;
+
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+
+    if (chunk->lines[mid].offset <= offset)
+      low = mid;
+    else
+      high = mid - 1;
   }
 
-  chunk->code[chunk->count] = codepoint;
-  chunk->lines[chunk->count] = line;
-  chunk->count++;
+  return chunk->lines[low].line;
 }
 
 int chunk_add_constant(struct wisp_state *w, struct chunk *chunk,
@@ -89,7 +86,7 @@ int chunk_add_constant(struct wisp_state *w, struct chunk *chunk,
 void chunk_free(struct wisp_state *w, struct chunk *chunk)
 {
   FREE_ARRAY(w, uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(w, int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(w, struct line_run, chunk->lines, chunk->line_capacity);
   value_array_free(w, &chunk->constants);
   chunk_init(chunk);
 }
@@ -103,11 +100,11 @@ void chunk_free(struct wisp_state *w, struct chunk *chunk)
 static struct obj *allocate_obj(struct wisp_state *w, size_t size,
     enum obj_type type)
 {
-  struct obj *obj = wisp_realloc(w, NULL, 0, size);
+  struct obj *obj = wisp_alloc_obj(w, size);
   obj->type = type;
-  obj->is_marked = false;
-  obj->next = w->objects;
-  w->objects = obj;
+  obj->is_remembered = false;
+  obj->is_large = size > POOL_SIZE_MAX;
+  obj->is_static = false;
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void *) obj, size, type);
 #endif
@@ -156,10 +153,23 @@ struct obj_lambda *lambda_new(struct wisp_state *w)
   lambda->arity = 0;
   lambda->upvalue_count = 0;
   lambda->has_param_list = false;
+  lambda->stack_size = 0;
   chunk_init(&lambda->chunk);
+  lambda->lazy = NULL;
+  lambda->image = NULL;
   return lambda;
 }
 
+struct obj_native *native_new(struct wisp_state *w, native_fn function,
+    int arity, const char *name)
+{
+  struct obj_native *native = ALLOCATE_OBJ(w, struct obj_native, OBJ_NATIVE);
+  native->function = function;
+  native->arity = arity;
+  native->name = name;
+  return native;
+}
+
 struct obj_upvalue *upvalue_new(struct wisp_state *w, Value *slot)
 {
   struct obj_upvalue *upvalue = ALLOCATE_OBJ(w, struct obj_upvalue,
@@ -178,40 +188,27 @@ struct obj_pair *pair_new(struct wisp_state *w, Value car, Value cdr)
   return pair;
 }
 
+struct obj_mapping *mapping_new(struct wisp_state *w, void *start,
+    size_t size)
+{
+  struct obj_mapping *mapping = ALLOCATE_OBJ(w, struct obj_mapping,
+      OBJ_MAPPING);
+  mapping->start = start;
+  mapping->size = size;
+  return mapping;
+}
+
+struct obj_bytes *bytes_new(struct wisp_state *w, struct obj_mapping *mapping,
+    const uint8_t *bytes, size_t len)
+{
+  struct obj_bytes *vector = ALLOCATE_OBJ(w, struct obj_bytes, OBJ_BYTES);
+  vector->mapping = mapping;
+  vector->bytes = bytes;
+  vector->len = len;
+  return vector;
+}
+
 void obj_print(struct obj *obj)
 {
-  switch (obj->type) {
-  case OBJ_ATOM:
-    printf("%s", ((struct obj_string *) obj)->chars);
-    break;
-  case OBJ_CLOSURE:
-    printf("closure");
-    break;
-  case OBJ_LAMBDA:
-    printf("lambda");
-    break;
-  case OBJ_UPVALUE:
-    printf("upvalue");
-    break;
-  case OBJ_PAIR: {
-    Value val = OBJ_VAL(obj);
-
-    for (putchar('(');; putchar(' ')) {
-      struct obj_pair *pair = AS_PAIR(val);
-      value_print(pair->car);
-      val = pair->cdr;
-
-      if (IS_NIL(val))
-        break;
-      else if (!IS_PAIR(val)) {
-        printf(" . ");
-        value_print(val);
-        break;
-      }
-    }
-
-    putchar(')');
-    break;
-  }
-  }
+  value_print(OBJ_VAL(obj));
 }
@@ -48,17 +48,31 @@ void value_array_free(struct wisp_state *, struct value_array *);
 // Chunk type.
 // ============================================================================
 
+// A run of bytecode compiled from the same source line.
+struct line_run {
+  // Offset of the first byte of the run.
+  int offset;
+
+  // The source line.
+  int line;
+};
+
 struct chunk {
   int capacity;
   int count;
   uint8_t *code;
-  int *lines;  // TODO: Use run-length encoding.
+
+  // Run-length encoded source lines of the bytecode, ordered by offset.
+  int line_capacity;
+  int line_count;
+  struct line_run *lines;
+
   struct value_array constants;
 };
 
 void chunk_init(struct chunk *);
 
-void chunk_write(struct wisp_state *, struct chunk *, uint8_t, int);
+int chunk_get_line(struct chunk *, int);
 
 int chunk_add_constant(struct wisp_state *, struct chunk *, Value);
 
@@ -70,14 +84,18 @@ void chunk_free(struct wisp_state *, struct chunk *);
 #define OBJ_TYPE(value)   (AS_OBJ(value)->type)
 
 #define IS_ATOM(value)    is_obj_type(value, OBJ_ATOM)
+#define IS_BYTES(value)   is_obj_type(value, OBJ_BYTES)
 #define IS_CLOSURE(value) is_obj_type(value, OBJ_CLOSURE)
 #define IS_LAMBDA(value)  is_obj_type(value, OBJ_LAMBDA)
+#define IS_NATIVE(value)  is_obj_type(value, OBJ_NATIVE)
 #define IS_UPVALUE(value) is_obj_type(value, OBJ_UPVALUE)
 #define IS_PAIR(value)    is_obj_type(value, OBJ_PAIR)
 
 #define AS_ATOM(value)    ((struct obj_string *)  AS_OBJ(value))
+#define AS_BYTES(value)   ((struct obj_bytes *)   AS_OBJ(value))
 #define AS_CLOSURE(value) ((struct obj_closure *) AS_OBJ(value))
 #define AS_LAMBDA(value)  ((struct obj_lambda *)  AS_OBJ(value))
+#define AS_NATIVE(value)  ((struct obj_native *)  AS_OBJ(value))
 #define AS_UPVALUE(value) ((struct obj_upvalue *) AS_OBJ(value))
 #define AS_PAIR(value)    ((struct obj_pair *)    AS_OBJ(value))
 
@@ -88,14 +106,28 @@ enum obj_type {
   OBJ_ATOM,
   OBJ_CLOSURE,
   OBJ_LAMBDA,
+  OBJ_NATIVE,
   OBJ_UPVALUE,
   OBJ_PAIR,
+  OBJ_MAPPING,
+  OBJ_BYTES,
 };
 
+// Header of every object. The mark bit of an object is kept apart from it,
+// and the objects are found by walking the pages of the pool of the state.
 struct obj {
   enum obj_type type;
-  bool is_marked;
-  struct obj *next;
+
+  // Whether the object is in the remembered set of the state.
+  bool is_remembered;
+
+  // Whether the object is too large for a pool page, its mark bit being
+  // kept in front of it.
+  bool is_large;
+
+  // Whether the object lives outside the heap, in a snapshot or in the
+  // state itself. It is never collected, and counts as marked.
+  bool is_static;
 };
 
 static inline bool is_obj_type(Value value, enum obj_type type)
@@ -130,6 +162,8 @@ struct obj_closure {
   int upvalue_count;  // TODO: Remove? Accessible from obj_lambda.
 };
 
+struct lazy_body;
+
 struct obj_lambda {
   struct obj obj;
 
@@ -144,8 +178,38 @@ struct obj_lambda {
   // collected in a list.
   bool has_param_list;
 
+  // Most stack slots a call of the lambda uses at once, including the called
+  // closure and the arguments.
+  int stack_size;
+
   // Bytecode of the lambda body.
   struct chunk chunk;
+
+  // Source of the lambda if the compilation of its body has been deferred
+  // until the first call, NULL once the body is compiled.
+  struct lazy_body *lazy;
+
+  // The compiled image the bytecode and lines of the chunk are mapped from,
+  // or NULL if the chunk owns them.
+  struct obj_mapping *image;
+};
+
+// A function implemented in C. It gets the arguments of the call, and stores
+// its result in the last parameter. If it fails, it reports a runtime error
+// and returns false.
+typedef bool (*native_fn)(struct wisp_state *, int, Value *, Value *);
+
+struct obj_native {
+  struct obj obj;
+
+  // The implementation of the function.
+  native_fn function;
+
+  // Number of arguments the function expects.
+  int arity;
+
+  // Name of the function, for printing.
+  const char *name;
 };
 
 struct obj_upvalue {
@@ -174,6 +238,34 @@ struct obj_pair {
   Value cdr;
 };
 
+// A region of a file mapped into memory. It is unmapped when the collector
+// frees it, which happens once no byte vector views it anymore. The mapped
+// bytes are not allocated on the heap, and do not count towards its size.
+struct obj_mapping {
+  struct obj obj;
+
+  // Start of the mapped region (or NULL if it is empty).
+  void *start;
+
+  // Size of the mapped region.
+  size_t size;
+};
+
+// An immutable vector of bytes, viewing a part of a mapping. Slicing it only
+// creates another view of the same mapping, so the bytes are never copied.
+struct obj_bytes {
+  struct obj obj;
+
+  // The mapping holding the bytes.
+  struct obj_mapping *mapping;
+
+  // The first byte of the vector.
+  const uint8_t *bytes;
+
+  // Number of bytes in the vector.
+  size_t len;
+};
+
 struct obj_string *string_copy(struct wisp_state *, enum obj_type,
     const char *, size_t, uint64_t);
 
@@ -181,10 +273,18 @@ struct obj_closure *closure_new(struct wisp_state *, struct obj_lambda *);
 
 struct obj_lambda *lambda_new(struct wisp_state *);
 
+struct obj_native *native_new(struct wisp_state *, native_fn, int,
+    const char *);
+
 struct obj_upvalue *upvalue_new(struct wisp_state *, Value *);
 
 struct obj_pair *pair_new(struct wisp_state *, Value, Value);
 
+struct obj_mapping *mapping_new(struct wisp_state *, void *, size_t);
+
+struct obj_bytes *bytes_new(struct wisp_state *, struct obj_mapping *,
+    const uint8_t *, size_t);
+
 void obj_print(struct obj *);
 
 #endif
@@ -1,15 +1,33 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "compiler.h"
 #include "opcodes.h"
 #include "state.h"
+#include "strpool.h"
 #include "table.h"
 #include "vm.h"
 
-#ifdef DEBUG_TRACE_EXECUTION
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_PROFILE_OPCODES)
 #include "debug.h"
 #endif
 
+// Stack slots left free above the frame of every call, for the values
+// natives keep on the stack while they allocate.
+#define NATIVE_SLOTS 8
+
+#ifdef DEBUG_PROFILE_OPCODES
+// How many times each opcode (second index) was executed right after another
+// one (first index) of the same chunk, accumulated over the whole process.
+static unsigned long opcode_pairs[UINT8_COUNT][UINT8_COUNT];
+
+void vm_profile_print(void)
+{
+  opcode_pairs_print(opcode_pairs);
+}
+#endif
+
 void vm_stack_reset(struct wisp_state *w)
 {
   w->frame_count = 0;
@@ -17,13 +35,13 @@ void vm_stack_reset(struct wisp_state *w)
   w->open_upvalues = NULL;
 }
 
-static void vm_stack_push(struct wisp_state *w, Value value)
+void vm_stack_push(struct wisp_state *w, Value value)
 {
   *w->stack_top = value;
   w->stack_top++;
 }
 
-static Value vm_stack_pop(struct wisp_state *w)
+Value vm_stack_pop(struct wisp_state *w)
 {
   w->stack_top--;
   return *w->stack_top;
@@ -34,7 +52,7 @@ static Value vm_stack_peek(struct wisp_state *w, int distance)
   return w->stack_top[-1 - distance];
 }
 
-static void runtime_error(struct wisp_state *w, const char *format, ...)
+void runtime_error(struct wisp_state *w, const char *format, ...)
 {
   va_list args;
   va_start(args, format);
@@ -46,7 +64,8 @@ static void runtime_error(struct wisp_state *w, const char *format, ...)
     struct call_frame *frame = &w->frames[i];
     struct obj_lambda *lambda = frame->closure->lambda;
     size_t instruction = frame->ip - lambda->chunk.code - 1;
-    fprintf(stderr, "[line %d]\n", lambda->chunk.lines[instruction]);
+    fprintf(stderr, "[line %d]\n",
+        chunk_get_line(&lambda->chunk, (int) instruction));
     // TODO: Output whether the error is in the script or the current function,
     // TODO: if it has a name.
   }
@@ -84,6 +103,7 @@ static void close_upvalues(struct wisp_state *w, Value *last)
     struct obj_upvalue *upvalue = w->open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    WRITE_BARRIER(w, &upvalue->obj);
     w->open_upvalues = upvalue->next;
   }
 }
@@ -118,6 +138,9 @@ static bool call(struct wisp_state *w, struct obj_closure *closure,
         vm_stack_push(w, OBJ_VAL(pair));
       }
     }
+
+    // The extra arguments have been collected into a single one.
+    arg_count = closure->lambda->arity;
   } else if (arg_count != closure->lambda->arity) {
     runtime_error(w, "Expected %" PRIu8 " arguments but got %" PRIu8,
         closure->lambda->arity, arg_count);
@@ -129,10 +152,45 @@ static bool call(struct wisp_state *w, struct obj_closure *closure,
     return false;
   }
 
+  if (closure->lambda->lazy != NULL && !compile_lazy(w, closure->lambda)) {
+    runtime_error(w, "Cannot compile the lambda body");
+    return false;
+  }
+
+  // The compiler knows how many slots the body uses at most, so its frame
+  // never outgrows the stack once it fits.
+  Value *slots = w->stack_top - arg_count - 1;
+  if (closure->lambda->stack_size
+      > w->stack + STACK_MAX - NATIVE_SLOTS - slots) {
+    runtime_error(w, "Stack overflow");
+    return false;
+  }
+
   struct call_frame *frame = &w->frames[w->frame_count++];
   frame->closure = closure;
   frame->ip = closure->lambda->chunk.code;
-  frame->slots = w->stack_top - arg_count - 1;
+  frame->slots = slots;
+  return true;
+}
+
+static bool call_native(struct wisp_state *w, struct obj_native *native,
+    uint8_t arg_count)
+{
+  if (arg_count != native->arity) {
+    runtime_error(w, "Expected %d arguments but got %" PRIu8, native->arity,
+        arg_count);
+    return false;
+  }
+
+  // The arguments stay on the stack, so they are reachable during the call.
+  Value *args = w->stack_top - arg_count;
+  Value result;
+
+  if (!native->function(w, arg_count, args, &result))
+    return false;
+
+  w->stack_top = args - 1;
+  vm_stack_push(w, result);
   return true;
 }
 
@@ -142,7 +200,8 @@ static bool call_value(struct wisp_state *w, Value callee, uint8_t arg_count)
     switch (OBJ_TYPE(callee)) {
     case OBJ_CLOSURE:
       return call(w, AS_CLOSURE(callee), arg_count);
-    // TODO: Native functions.
+    case OBJ_NATIVE:
+      return call_native(w, AS_NATIVE(callee), arg_count);
     default:
       break;
     }
@@ -158,10 +217,23 @@ static bool vm_run(struct wisp_state *w)
   // TODO: Implement optional direct threading.
   struct call_frame *frame = &w->frames[w->frame_count - 1];
 
+#ifdef DEBUG_PROFILE_OPCODES
+  // The previously executed opcode, or -1 after switching to another chunk.
+  int prev_instruction = -1;
+#endif
+
   #define READ_BYTE() (*frame->ip++)
+  #define READ_SHORT() \
+    (frame->ip += 2, (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
+  #define READ_LONG() \
+    (frame->ip += 3, \
+     (uint32_t) ((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
   #define READ_CONSTANT() \
     (frame->closure->lambda->chunk.constants.values[READ_BYTE()])
+  #define READ_CONSTANT_LONG() \
+    (frame->closure->lambda->chunk.constants.values[READ_LONG()])
   #define READ_ATOM() AS_ATOM(READ_CONSTANT())
+  #define READ_ATOM_LONG() AS_ATOM(READ_CONSTANT_LONG())
 
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
@@ -177,12 +249,34 @@ static bool vm_run(struct wisp_state *w)
 #endif
     uint8_t instruction = READ_BYTE();
 
+#ifdef DEBUG_PROFILE_OPCODES
+    if (prev_instruction != -1)
+      opcode_pairs[prev_instruction][instruction]++;
+
+    switch (instruction) {
+    case OP_CALL:
+    case OP_DOT_CALL:
+    case OP_RETURN:
+    case OP_GET_GLOBAL_CALL:
+      prev_instruction = -1;
+      break;
+    default:
+      prev_instruction = instruction;
+      break;
+    }
+#endif
+
     switch (instruction) {
     case OP_CONSTANT: {
       Value constant = READ_CONSTANT();
       vm_stack_push(w, constant);
       break;
     }
+    case OP_CONSTANT_LONG: {
+      Value constant = READ_CONSTANT_LONG();
+      vm_stack_push(w, constant);
+      break;
+    }
     case OP_NIL:
       vm_stack_push(w, NIL_VAL);
       break;
@@ -205,6 +299,13 @@ static bool vm_run(struct wisp_state *w)
       Value cdr = vm_stack_pop(w);
 
       do {
+        // The compiler leaves room for this many arguments.
+        if (arg_count == UINT8_MAX) {
+          runtime_error(w,
+              "Can't have more than " XSTR(UINT8_MAX) " arguments");
+          return false;
+        }
+
         struct obj_pair *pair = AS_PAIR(cdr);
         cdr = pair->cdr;
         vm_stack_push(w, pair->car);
@@ -222,17 +323,21 @@ static bool vm_run(struct wisp_state *w)
       frame = &w->frames[w->frame_count - 1];
       break;
     }
-    case OP_CLOSURE: {
-      struct obj_lambda *lambda = AS_LAMBDA(READ_CONSTANT());
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      struct obj_lambda *lambda = AS_LAMBDA(instruction == OP_CLOSURE
+                                          ? READ_CONSTANT()
+                                          : READ_CONSTANT_LONG());
       struct obj_closure *closure = closure_new(w, lambda);
       vm_stack_push(w, OBJ_VAL(closure));
 
       for (int i = 0; i < closure->upvalue_count; ++i) {
         uint8_t is_local = READ_BYTE();
-        uint8_t index = READ_BYTE();
+        uint16_t index = READ_SHORT();
         closure->upvalues[i] = is_local
                              ? capture_upvalue(w, frame->slots + index)
                              : frame->closure->upvalues[index];
+        WRITE_BARRIER(w, &closure->obj);
       }
       break;
     }
@@ -241,8 +346,10 @@ static bool vm_run(struct wisp_state *w)
       close_upvalues(w, frame->slots);
       w->frame_count--;
 
+      // The result of the top-level closure replaces it on the stack.
       if (w->frame_count == 0) {
-        vm_stack_pop(w);
+        w->stack_top = frame->slots;
+        vm_stack_push(w, result);
         return true;
       }
 
@@ -251,6 +358,9 @@ static bool vm_run(struct wisp_state *w)
       frame = &w->frames[w->frame_count - 1];
       break;
     }
+    case OP_POP:
+      vm_stack_pop(w);
+      break;
     case OP_CONS: {
       Value cdr = vm_stack_peek(w, 0);
       Value car = vm_stack_peek(w, 1);
@@ -277,8 +387,11 @@ static bool vm_run(struct wisp_state *w)
 
       vm_stack_push(w, AS_PAIR(vm_stack_pop(w))->cdr);
       break;
-    case OP_DEFINE_GLOBAL: {
-      struct obj_string *name = READ_ATOM();
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG: {
+      struct obj_string *name = instruction == OP_DEFINE_GLOBAL
+                              ? READ_ATOM()
+                              : READ_ATOM_LONG();
       table_set(w, &w->globals, name, vm_stack_peek(w, 0));
       vm_stack_pop(w);
       break;
@@ -293,8 +406,16 @@ static bool vm_run(struct wisp_state *w)
       vm_stack_push(w, *frame->closure->upvalues[slot]->location);
       break;
     }
-    case OP_GET_GLOBAL: {
-      struct obj_string *name = READ_ATOM();
+    case OP_GET_UPVALUE_LONG: {
+      uint16_t slot = READ_SHORT();
+      vm_stack_push(w, *frame->closure->upvalues[slot]->location);
+      break;
+    }
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG: {
+      struct obj_string *name = instruction == OP_GET_GLOBAL
+                              ? READ_ATOM()
+                              : READ_ATOM_LONG();
       Value val;
 
       if (!table_get(&w->globals, name, &val)) {
@@ -305,15 +426,94 @@ static bool vm_run(struct wisp_state *w)
       vm_stack_push(w, val);
       break;
     }
+    case OP_GET_LOCAL_CAR:
+    case OP_GET_LOCAL_CDR: {
+      Value local = frame->slots[READ_BYTE()];
+
+      if (!IS_PAIR(local)) {
+        runtime_error(w, "Operand must be a cons pair");
+        return false;
+      }
+
+      vm_stack_push(w, instruction == OP_GET_LOCAL_CAR
+                     ? AS_PAIR(local)->car
+                     : AS_PAIR(local)->cdr);
+      break;
+    }
+    case OP_CADR:
+    case OP_CDDR: {
+      Value pair = vm_stack_peek(w, 0);
+
+      if (!IS_PAIR(pair) || !IS_PAIR(AS_PAIR(pair)->cdr)) {
+        runtime_error(w, "Operand must be a cons pair");
+        return false;
+      }
+
+      pair = AS_PAIR(pair)->cdr;
+      w->stack_top[-1] = instruction == OP_CADR
+                       ? AS_PAIR(pair)->car
+                       : AS_PAIR(pair)->cdr;
+      break;
+    }
+    case OP_GET_GLOBAL_CALL: {
+      struct obj_string *name = READ_ATOM();
+      uint8_t arg_count = READ_BYTE();
+      Value callee;
+
+      if (!table_get(&w->globals, name, &callee)) {
+        runtime_error(w, "Undefined variable: '%s'", name->chars);
+        return false;
+      }
+
+      vm_stack_push(w, callee);
+
+      if (!call_value(w, vm_stack_peek(w, arg_count), arg_count))
+        return false;
+
+      frame = &w->frames[w->frame_count - 1];
+      break;
+    }
+    case OP_LIST: {
+      uint8_t count = READ_BYTE();
+      vm_stack_push(w, NIL_VAL);
+
+      // Keep the list built so far on the stack, as allocating a pair can
+      // trigger a GC.
+      for (; count > 0; --count) {
+        struct obj_pair *pair = pair_new(w, w->stack_top[-2],
+            w->stack_top[-1]);
+        w->stack_top--;
+        w->stack_top[-1] = OBJ_VAL(pair);
+      }
+      break;
+    }
     }
   }
 
+  #undef READ_ATOM_LONG
   #undef READ_ATOM
+  #undef READ_CONSTANT_LONG
   #undef READ_CONSTANT
+  #undef READ_LONG
+  #undef READ_SHORT
   #undef READ_BYTE
 }
 
-bool interpret(struct wisp_state *w, struct obj_lambda *lambda)
+void define_native(struct wisp_state *w, const char *name, native_fn function,
+    int arity)
+{
+  struct obj_string *atom = str_pool_intern(w, name, strlen(name));
+  vm_stack_push(w, OBJ_VAL(atom));
+
+  struct obj_native *native = native_new(w, function, arity, name);
+  vm_stack_push(w, OBJ_VAL(native));
+
+  table_set(w, &w->globals, atom, OBJ_VAL(native));
+  vm_stack_pop(w);
+  vm_stack_pop(w);
+}
+
+bool evaluate(struct wisp_state *w, struct obj_lambda *lambda, Value *value)
 {
   vm_stack_reset(w);
 
@@ -322,8 +522,16 @@ bool interpret(struct wisp_state *w, struct obj_lambda *lambda)
   vm_stack_pop(w);
   vm_stack_push(w, OBJ_VAL(closure));
 
-  call(w, closure, 0);
-  bool result = vm_run(w);
+  bool result = call(w, closure, 0) && vm_run(w);
+
+  if (result)
+    *value = vm_stack_pop(w);
 
   return result;
 }
+
+bool interpret(struct wisp_state *w, struct obj_lambda *lambda)
+{
+  Value value;
+  return evaluate(w, lambda, &value);
+}
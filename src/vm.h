@@ -7,6 +7,25 @@
 
 void vm_stack_reset(struct wisp_state *);
 
+void vm_stack_push(struct wisp_state *, Value);
+
+Value vm_stack_pop(struct wisp_state *);
+
+// Reports an error with the current call stack, and resets the stack.
+void runtime_error(struct wisp_state *, const char *, ...);
+
+// Makes the function available as a global variable of the given name.
+void define_native(struct wisp_state *, const char *, native_fn, int);
+
+// Executes the lambda, storing the value it evaluates to. The value is no
+// longer on the stack, so it is only safe until the next allocation.
+bool evaluate(struct wisp_state *, struct obj_lambda *, Value *);
+
 bool interpret(struct wisp_state *, struct obj_lambda *);
 
+#ifdef DEBUG_PROFILE_OPCODES
+// Prints the most frequent pairs of consecutively executed opcodes.
+void vm_profile_print(void);
+#endif
+
 #endif
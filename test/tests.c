@@ -1,13 +1,33 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "../src/common.h"
+#include "../src/compact.h"
+#include "../src/compiler.h"
+#include "../src/image.h"
+#include "../src/loader.h"
 #include "../src/memory.h"
+#include "../src/natives.h"
+#include "../src/opcodes.h"
+#include "../src/pool.h"
+#include "../src/printer.h"
+#include "../src/reader.h"
 #include "../src/scanner.h"
+#include "../src/serialize.h"
+#include "../src/server.h"
+#include "../src/snapshot.h"
 #include "../src/state.h"
 #include "../src/strpool.h"
+#include "../src/table.h"
 #include "../src/value.h"
+#include "../src/vm.h"
 
 static int count_fail = 0;
 static int count_pass = 0;
@@ -245,6 +265,64 @@ static void test_scanner_skip_comment(void)
   }
 }
 
+static void test_scanner_long_runs(void)
+{
+  // Identifiers, whitespace and comments of all lengths up to a few blocks
+  // of the vectorized scanner, at every alignment of the source.
+  enum { RUNS = 48, ALIGNMENTS = 16 };
+
+  static char buffer[ALIGNMENTS + 8 * 1024];
+  char source[8 * 1024];
+  int starts[RUNS];
+  int lines[RUNS];
+  int len = 0;
+  int line = 1;
+
+  for (int i = 0; i < RUNS; ++i) {
+    int n = i + 1;
+
+    for (int j = 0; j < n; ++j) {
+      char c = " \t\r\n"[(i + j) % 4];
+      line += c == '\n';
+      source[len++] = c;
+    }
+
+    if (i % 3 == 0) {
+      source[len++] = ';';
+      for (int j = 0; j < n; ++j)
+        source[len++] = "( .')"[j % 5];
+      source[len++] = '\n';
+      line++;
+    }
+
+    starts[i] = len;
+    lines[i] = line;
+    for (int j = 0; j < n; ++j)
+      source[len++] = "x-+*/<=>!?_1"[j % 12];
+  }
+
+  source[len] = '\0';
+  int mismatches = 0;
+
+  for (int offset = 0; offset < ALIGNMENTS; ++offset) {
+    char *s = memcpy(buffer + offset, source, len + 1);
+    struct scanner sc;
+    scanner_init(&sc, s);
+
+    for (int i = 0; i < RUNS; ++i) {
+      struct token tok = scanner_next(&sc);
+      if (tok.type != TOKEN_IDENTIFIER || tok.start != s + starts[i]
+          || tok.len != i + 1 || tok.line != lines[i])
+        mismatches++;
+    }
+
+    if (scanner_next(&sc).type != TOKEN_EOF)
+      mismatches++;
+  }
+
+  TEST(mismatches == 0, "long runs, %d mismatched tokens", mismatches);
+}
+
 static void test_scanner_compound(void)
 {
   {
@@ -622,20 +700,2286 @@ static void test_interning_uninterning()
   wisp_state_free(&w);
 }
 
-int main(void)
+static bool global_get(struct wisp_state *w, const char *name, Value *val)
 {
-  // Scanner tests.
-  test_scanner_simple();
-  test_scanner_identifier();
-  test_scanner_number();
-  test_scanner_skip_comment();
-  test_scanner_compound();
+  struct obj_string *key = str_pool_intern(w, name, strlen(name));
+  return table_get(&w->globals, key, val);
+}
 
-  // String pool tests.
-  test_interning_unique();
-  test_interning_non_unique();
-  test_interning_identity();
-  test_interning_uninterning();
+static void test_compiler_wide_operands(void)
+{
+  // Enough globals to overflow single-byte constant operands.
+  size_t cap = 64 * 1024;
+  char *source = malloc(cap);
+  int len = 0;
+
+  for (int i = 0; i < 300; ++i)
+    len += snprintf(source + len, cap - len, "(define g%d '%d)\n", i, i);
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct obj_lambda *lambda = compile(&w, source);
+  TEST1(lambda != NULL, "wide constants, compilation");
+  TEST(lambda->chunk.constants.count == 600,
+      "wide constants, %d constants", lambda->chunk.constants.count);
+  TEST1(interpret(&w, lambda), "wide constants, interpretation");
+
+  Value val;
+  bool found = global_get(&w, "g0", &val);
+  TEST1(found && IS_NUM(val) && AS_NUM(val) == 0, "wide constants, first");
+  found = global_get(&w, "g299", &val);
+  TEST1(found && IS_NUM(val) && AS_NUM(val) == 299, "wide constants, last");
+
+  wisp_state_free(&w);
+
+  // Enough closed over variables to overflow single-byte upvalue operands.
+  len = snprintf(source, cap, "(define make (lambda (");
+  for (int i = 0; i < 150; ++i)
+    len += snprintf(source + len, cap - len, " a%d", i);
+  len += snprintf(source + len, cap - len, ") (lambda (");
+  for (int i = 0; i < 150; ++i)
+    len += snprintf(source + len, cap - len, " b%d", i);
+  len += snprintf(source + len, cap - len, ") (lambda () ");
+  for (int i = 0; i < 300; ++i)
+    len += snprintf(source + len, cap - len, "(cons %c%d ",
+        i < 150 ? 'a' : 'b', i % 150);
+  len += snprintf(source + len, cap - len, "'()");
+  for (int i = 0; i < 300; ++i)
+    len += snprintf(source + len, cap - len, ")");
+  len += snprintf(source + len, cap - len, "))))\n(define r (((make");
+  for (int i = 0; i < 150; ++i)
+    len += snprintf(source + len, cap - len, " %d", i);
+  len += snprintf(source + len, cap - len, ")");
+  for (int i = 150; i < 300; ++i)
+    len += snprintf(source + len, cap - len, " %d", i);
+  snprintf(source + len, cap - len, ")))\n");
+
+  wisp_state_init(&w);
+
+  lambda = compile(&w, source);
+  TEST1(lambda != NULL, "wide upvalues, compilation");
+  TEST1(interpret(&w, lambda), "wide upvalues, interpretation");
+
+  int elements = 0;
+  found = global_get(&w, "r", &val);
+
+  for (; found && IS_PAIR(val); val = AS_PAIR(val)->cdr, ++elements)
+    if (!IS_NUM(AS_PAIR(val)->car) || AS_NUM(AS_PAIR(val)->car) != elements)
+      break;
+
+  TEST(found && IS_NIL(val) && elements == 300,
+      "wide upvalues, %d list elements", elements);
+
+  wisp_state_free(&w);
+
+  // As many parameters as allowed, the last one in the highest slot a byte
+  // operand can address.
+  len = snprintf(source, cap, "(define r ((lambda (");
+  for (int i = 0; i < UINT8_MAX; ++i)
+    len += snprintf(source + len, cap - len, " p%d", i);
+  len += snprintf(source + len, cap - len, ") p%d)", UINT8_MAX - 1);
+  for (int i = 0; i < UINT8_MAX; ++i)
+    len += snprintf(source + len, cap - len, " %d", i);
+  snprintf(source + len, cap - len, "))");
+
+  wisp_state_init(&w);
+
+  lambda = compile(&w, source);
+  TEST1(lambda != NULL && interpret(&w, lambda)
+      && global_get(&w, "r", &val) && IS_NUM(val)
+      && AS_NUM(val) == UINT8_MAX - 1, "most parameters, last one");
+
+  len = snprintf(source, cap, "(lambda (");
+  for (int i = 0; i <= UINT8_MAX; ++i)
+    len += snprintf(source + len, cap - len, " p%d", i);
+  snprintf(source + len, cap - len, ") p0)");
+
+  TEST1(compile(&w, source) == NULL, "most parameters, one too many");
+
+  wisp_state_free(&w);
+  free(source);
+}
+
+static void test_compiler_constant_deduplication(void)
+{
+  const char *source =
+    "(define x '1) (define y x) (cons 'a (cons 1 (cons x (cons y 'a))))";
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct obj_lambda *lambda = compile(&w, source);
+  TEST1(lambda != NULL, "constant deduplication, compilation");
+  TEST(lambda->chunk.constants.count == 4,
+      "constant deduplication, %d constants", lambda->chunk.constants.count);
+
+  wisp_state_free(&w);
+}
+
+static void test_compiler_gc(void)
+{
+  size_t cap = 256 * 1024;
+  char *source = malloc(cap);
+  int len = 0;
+
+  for (int i = 0; i < 2000; ++i)
+    len += snprintf(source + len, cap - len,
+        "(define f%d (lambda (x) (cons x '(atom%d))))\n", i, i);
+  snprintf(source + len, cap - len, "(define r (f1999 'y))\n");
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // Collect garbage as early and as often as the heap growth allows, so that
+  // collections happen in the middle of the compilation.
+  w.next_gc = 0;
+
+  struct obj_lambda *lambda = compile(&w, source);
+  TEST1(lambda != NULL, "compilation under GC, compilation");
+  TEST1(interpret(&w, lambda), "compilation under GC, interpretation");
+
+  Value val;
+  bool found = global_get(&w, "r", &val);
+  TEST1(found && IS_PAIR(val) && IS_ATOM(AS_PAIR(val)->car)
+      && strcmp(AS_ATOM(AS_PAIR(val)->car)->chars, "y") == 0,
+      "compilation under GC, car");
+  TEST1(found && IS_PAIR(val) && IS_PAIR(AS_PAIR(val)->cdr)
+      && strcmp(AS_ATOM(AS_PAIR(AS_PAIR(val)->cdr)->car)->chars,
+        "atom1999") == 0,
+      "compilation under GC, cdr");
+
+  wisp_state_free(&w);
+  free(source);
+}
+
+static void test_compiler_quoted_data(void)
+{
+  {
+    const char *source = "(define r '(1 (a . b) () . c))";
+
+    struct wisp_state w;
+    wisp_state_init(&w);
+
+    struct obj_lambda *lambda = compile(&w, source);
+    TEST1(lambda != NULL && interpret(&w, lambda), "quoted list, evaluation");
+
+    Value r;
+    bool found = global_get(&w, "r", &r);
+    TEST1(found && IS_PAIR(r) && IS_NUM(AS_PAIR(r)->car)
+        && AS_NUM(AS_PAIR(r)->car) == 1, "quoted list, first element");
+
+    Value rest = found && IS_PAIR(r) ? AS_PAIR(r)->cdr : NIL_VAL;
+    TEST1(IS_PAIR(rest) && IS_PAIR(AS_PAIR(rest)->car)
+        && IS_ATOM(AS_PAIR(AS_PAIR(rest)->car)->cdr),
+        "quoted list, dotted pair element");
+
+    rest = IS_PAIR(rest) ? AS_PAIR(rest)->cdr : NIL_VAL;
+    TEST1(IS_PAIR(rest) && IS_NIL(AS_PAIR(rest)->car),
+        "quoted list, empty list element");
+
+    rest = IS_PAIR(rest) ? AS_PAIR(rest)->cdr : NIL_VAL;
+    TEST1(IS_ATOM(rest) && strcmp(AS_ATOM(rest)->chars, "c") == 0,
+        "quoted list, dotted tail");
+
+    wisp_state_free(&w);
+  }
+
+  {
+    // Deep enough to overflow the C stack with a recursive parser.
+    int depth = 1000000;
+    char *source = malloc(2 * depth + 32);
+    int len = sprintf(source, "(define r '");
+
+    memset(source + len, '(', depth);
+    len += depth;
+    len += sprintf(source + len, "x");
+    memset(source + len, ')', depth);
+    len += depth;
+    sprintf(source + len, ")");
+
+    struct wisp_state w;
+    wisp_state_init(&w);
+
+    struct obj_lambda *lambda = compile(&w, source);
+    TEST1(lambda != NULL && interpret(&w, lambda),
+        "deeply nested quoted list, evaluation");
+
+    Value val;
+    bool found = global_get(&w, "r", &val);
+    int nesting = 0;
+
+    for (; found && IS_PAIR(val) && IS_NIL(AS_PAIR(val)->cdr); ++nesting)
+      val = AS_PAIR(val)->car;
+
+    TEST(nesting == depth && IS_ATOM(val),
+        "deeply nested quoted list, nesting %d", nesting);
+
+    wisp_state_free(&w);
+    free(source);
+  }
+
+  {
+    // Longer than the stack could hold if its elements were pushed on it.
+    int elements = 40000;
+    char *source = malloc(8 * elements + 32);
+    int len = sprintf(source, "(define r '(");
+
+    for (int i = 0; i < elements; ++i)
+      len += sprintf(source + len, "%d ", i);
+
+    sprintf(source + len, "))");
+
+    struct wisp_state w;
+    wisp_state_init(&w);
+
+    struct obj_lambda *lambda = compile(&w, source);
+    TEST1(lambda != NULL && interpret(&w, lambda),
+        "long quoted list, evaluation");
+
+    Value val;
+    bool found = global_get(&w, "r", &val);
+    int count = 0;
+
+    for (; found && IS_PAIR(val); val = AS_PAIR(val)->cdr, ++count)
+      if (!IS_NUM(AS_PAIR(val)->car) || AS_NUM(AS_PAIR(val)->car) != count)
+        break;
+
+    TEST(found && IS_NIL(val) && count == elements,
+        "long quoted list, %d elements", count);
+
+    wisp_state_free(&w);
+    free(source);
+  }
+}
+
+static void test_compiler_deep_nesting(void)
+{
+  {
+    // Deep enough to overflow the C stack with a recursive compiler.
+    int depth = 2000000;
+    char *source = malloc(8 * (size_t) depth + 32);
+    int len = sprintf(source, "(define r ");
+
+    for (int i = 0; i < depth; ++i)
+      len += sprintf(source + len, "(car ");
+
+    len += sprintf(source + len, "'");
+    memset(source + len, '(', depth);
+    len += depth;
+    len += sprintf(source + len, "x");
+    memset(source + len, ')', 2 * depth + 1);
+    source[len + 2 * depth + 1] = '\0';
+
+    struct wisp_state w;
+    wisp_state_init(&w);
+
+    struct obj_lambda *lambda = compile(&w, source);
+    TEST1(lambda != NULL && interpret(&w, lambda),
+        "deeply nested expression, evaluation");
+
+    Value val;
+    TEST1(global_get(&w, "r", &val) && IS_ATOM(val)
+        && strcmp(AS_ATOM(val)->chars, "x") == 0,
+        "deeply nested expression, value");
+
+    wisp_state_free(&w);
+    free(source);
+  }
+
+  {
+    // Each lambda closes over the parameter of the outermost one, and is
+    // called right after the one enclosing it returns it.
+    int depth = 200000;
+    char *source = malloc(32 * (size_t) depth + 32);
+    int len = sprintf(source, "(define f ");
+
+    for (int i = 0; i < depth; ++i)
+      len += sprintf(source + len, "(lambda (x%d) ", i);
+
+    len += sprintf(source + len, "x0");
+    memset(source + len, ')', depth);
+    len += depth;
+    len += sprintf(source + len, ")\n(define r ");
+    memset(source + len, '(', depth);
+    len += depth;
+    len += sprintf(source + len, "f");
+
+    for (int i = 0; i < depth; ++i)
+      len += sprintf(source + len, " %d)", i);
+
+    sprintf(source + len, ")");
+
+    struct wisp_state w;
+    wisp_state_init(&w);
+
+    struct obj_lambda *lambda = compile(&w, source);
+    TEST1(lambda != NULL && interpret(&w, lambda),
+        "deeply nested lambdas, evaluation");
+
+    Value val;
+    TEST1(global_get(&w, "r", &val) && IS_NUM(val) && AS_NUM(val) == 0,
+        "deeply nested lambdas, closed over variable");
+
+    wisp_state_free(&w);
+    free(source);
+  }
+}
+
+static void test_compiler_stack_size(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct obj_lambda *lambda = compile(&w,
+      "(define f (lambda (x y) (cons x (cons y (cons x y)))))");
+  TEST1(lambda != NULL && interpret(&w, lambda), "stack size, definition");
+
+  Value val;
+  TEST(global_get(&w, "f", &val) && IS_CLOSURE(val)
+      && AS_CLOSURE(val)->lambda->stack_size == 7,
+      "stack size, %d slots", IS_CLOSURE(val)
+        ? AS_CLOSURE(val)->lambda->stack_size : -1);
+
+  // More arguments spread by a dotted call than a call can take.
+  char *source = malloc(256 * 1024);
+  int len = sprintf(source, "((lambda args args) . '(");
+  for (int i = 0; i < 300; ++i)
+    len += sprintf(source + len, "%d ", i);
+  sprintf(source + len, "))");
+
+  lambda = compile(&w, source);
+  TEST1(lambda != NULL && !interpret(&w, lambda),
+      "stack size, too many spread arguments");
+
+  // Nested deeper than the stack can hold the pending arguments.
+  int depth = 20000;
+  len = 0;
+  for (int i = 0; i < depth; ++i)
+    len += sprintf(source + len, "(cons %d ", i);
+  len += sprintf(source + len, "'()");
+  memset(source + len, ')', depth);
+  source[len + depth] = '\0';
+
+  lambda = compile(&w, source);
+  TEST1(lambda != NULL && !interpret(&w, lambda), "stack size, overflow");
+
+  // The stack is still usable after the overflow.
+  lambda = compile(&w, "(define r (f 1 2))");
+  TEST1(lambda != NULL && interpret(&w, lambda)
+      && global_get(&w, "r", &val) && IS_PAIR(val)
+      && IS_NUM(AS_PAIR(val)->car) && AS_NUM(AS_PAIR(val)->car) == 1,
+      "stack size, evaluation after the overflow");
+
+  wisp_state_free(&w);
+  free(source);
+}
+
+static void test_compiler_lazy(void)
+{
+  const char *source =
+    "(define mk (lambda (a b)\n"
+    "  (lambda (c) (cons a (cons b (cons c '(a b c)))))))\n"
+    "(define r ((mk 1 2) 3))\n"
+    "(define unused (lambda (x) (car x)))\n";
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+  w.lazy_compile = true;
+
+  struct obj_lambda *lambda = compile(&w, source);
+  TEST1(lambda != NULL && interpret(&w, lambda), "lazy compilation, evaluation");
+
+  Value val;
+  bool found = global_get(&w, "mk", &val);
+  TEST1(found && IS_CLOSURE(val) && AS_CLOSURE(val)->lambda->lazy == NULL,
+      "lazy compilation, called lambda compiled");
+
+  found = global_get(&w, "unused", &val);
+  TEST1(found && IS_CLOSURE(val) && AS_CLOSURE(val)->lambda->lazy != NULL
+      && AS_CLOSURE(val)->lambda->chunk.count == 0,
+      "lazy compilation, uncalled lambda not compiled");
+
+  const char *expected[] = {NULL, NULL, NULL, "a", "b", "c"};
+  int elements = 0;
+  found = global_get(&w, "r", &val);
+
+  for (; found && IS_PAIR(val); val = AS_PAIR(val)->cdr, ++elements) {
+    Value car = AS_PAIR(val)->car;
+
+    if (elements < 3 && !(IS_NUM(car) && AS_NUM(car) == elements + 1))
+      break;
+
+    if (elements >= 3
+        && !(IS_ATOM(car) && strcmp(AS_ATOM(car)->chars, expected[elements]) == 0))
+      break;
+  }
+
+  TEST(found && IS_NIL(val) && elements == 6,
+      "lazy compilation, %d list elements", elements);
+
+  wisp_state_free(&w);
+}
+
+static void test_compiler_toplevel(void)
+{
+  const char *source =
+    "(define a '(1 2))\n"
+    "(define b (car a))\n"
+    "(car b c)\n"
+    "(define d '3)\n";
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct toplevel t;
+  toplevel_init(&t, source, 1);
+
+  struct obj_lambda *lambda;
+  int forms = 0;
+
+  while (compile_next(&w, &t, &lambda) && lambda != NULL) {
+    if (!interpret(&w, lambda))
+      break;
+
+    ++forms;
+  }
+
+  TEST(forms == 2 && lambda == NULL, "top-level forms, %d evaluated", forms);
+
+  Value val;
+  bool found = global_get(&w, "b", &val);
+  TEST1(found && IS_NUM(val) && AS_NUM(val) == 1,
+      "top-level forms, earlier definitions visible");
+
+  found = global_get(&w, "d", &val);
+  TEST1(!found, "top-level forms, stop at the first error");
+
+  wisp_state_free(&w);
+}
+
+static void test_compiler_superinstructions(void)
+{
+  {
+    const char *source =
+      "(define list (lambda args args))\n"
+      "(define caddr (lambda (x) (car (cdr (cdr x)))))\n"
+      "(define l (list 1 2 3))\n"
+      "(define r (caddr l))\n"
+      "(define s (car (cons 'a '())))\n";
+
+    struct wisp_state w;
+    wisp_state_init(&w);
+
+    struct obj_lambda *lambda = compile(&w, source);
+    TEST1(lambda != NULL && interpret(&w, lambda),
+        "superinstructions, evaluation");
+
+    Value val;
+    bool found = global_get(&w, "caddr", &val);
+    struct chunk *chunk = found && IS_CLOSURE(val)
+                        ? &AS_CLOSURE(val)->lambda->chunk
+                        : NULL;
+    TEST1(chunk != NULL && chunk->count == 4
+        && chunk->code[0] == OP_GET_LOCAL_CDR && chunk->code[1] == 1
+        && chunk->code[2] == OP_CADR && chunk->code[3] == OP_RETURN,
+        "superinstructions, fused accessors");
+
+    found = global_get(&w, "r", &val);
+    TEST1(found && IS_NUM(val) && AS_NUM(val) == 3,
+        "superinstructions, variadic call and accessors");
+
+    found = global_get(&w, "s", &val);
+    TEST1(found && IS_ATOM(val) && strcmp(AS_ATOM(val)->chars, "a") == 0,
+        "superinstructions, single element list");
+
+    wisp_state_free(&w);
+  }
+
+  {
+    // Longer than a single OP_LIST can build.
+    int elements = 600;
+    char *source = malloc(16 * elements + 32);
+    int len = sprintf(source, "(define r ");
+
+    for (int i = 0; i < elements; ++i)
+      len += sprintf(source + len, "(cons %d ", i);
+
+    len += sprintf(source + len, "'()");
+    memset(source + len, ')', elements + 1);
+    source[len + elements + 1] = '\0';
+
+    struct wisp_state w;
+    wisp_state_init(&w);
+
+    struct obj_lambda *lambda = compile(&w, source);
+    TEST1(lambda != NULL && interpret(&w, lambda),
+        "superinstructions, long list evaluation");
+
+    Value val;
+    bool found = global_get(&w, "r", &val);
+    int count = 0;
+
+    for (; found && IS_PAIR(val); val = AS_PAIR(val)->cdr, ++count)
+      if (!IS_NUM(AS_PAIR(val)->car) || AS_NUM(AS_PAIR(val)->car) != count)
+        break;
+
+    TEST(found && IS_NIL(val) && count == elements,
+        "superinstructions, long list of %d elements", count);
+
+    wisp_state_free(&w);
+    free(source);
+  }
+}
+
+static void test_compiler_lines(void)
+{
+  const char *source =
+    "(define f (lambda (x)\n"
+    "  (cons\n"
+    "    (car x)\n"
+    "    (cdr x))))\n";
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct obj_lambda *lambda = compile(&w, source);
+  TEST1(lambda != NULL && interpret(&w, lambda), "line runs, evaluation");
+
+  Value val;
+  bool found = global_get(&w, "f", &val);
+  struct chunk *chunk = found && IS_CLOSURE(val)
+                      ? &AS_CLOSURE(val)->lambda->chunk
+                      : NULL;
+
+  // OP_GET_LOCAL_CAR 1, OP_GET_LOCAL_CDR 1, OP_CONS, OP_RETURN
+  TEST1(chunk != NULL && chunk->count == 6 && chunk->line_count == 2,
+      "line runs, one run per line");
+  TEST1(chunk != NULL && chunk_get_line(chunk, 0) == 3
+      && chunk_get_line(chunk, 1) == 3 && chunk_get_line(chunk, 2) == 4
+      && chunk_get_line(chunk, 5) == 4, "line runs, lookup");
+  TEST1(chunk != NULL && chunk->capacity == chunk->count
+      && chunk->line_capacity == chunk->line_count, "line runs, trimmed");
+
+  wisp_state_free(&w);
+}
+
+static void test_compiler_arena(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct toplevel t;
+  toplevel_init(&t, "(cons 1 2) (cons 1 (lambda (x) (cons x x)))", 1);
+
+  // Nothing but the lambda and its exact-size chunk is accounted for.
+  size_t before = w.bytes_allocated;
+  struct obj_lambda *lambda;
+  bool compiled = compile_next(&w, &t, &lambda);
+
+  // OP_CONSTANT 0, OP_CONSTANT 1, OP_CONS, OP_RETURN
+  size_t expected = sizeof(struct obj_lambda) + 6 * sizeof(uint8_t)
+                  + sizeof(struct line_run) + 2 * sizeof(Value);
+  TEST(compiled && lambda != NULL && w.bytes_allocated - before == expected,
+      "compile arena, %zu bytes accounted, expected %zu",
+      w.bytes_allocated - before, expected);
+
+  compiled = compile_next(&w, &t, &lambda);
+  struct chunk *chunk = compiled && lambda != NULL ? &lambda->chunk : NULL;
+  TEST1(chunk != NULL && chunk->capacity == chunk->count
+      && chunk->line_capacity == chunk->line_count
+      && chunk->constants.capacity == chunk->constants.count,
+      "compile arena, exact-size chunk");
+
+  struct chunk *inner = chunk != NULL && chunk->constants.count == 2
+                      && IS_LAMBDA(chunk->constants.values[1])
+                      ? &AS_LAMBDA(chunk->constants.values[1])->chunk
+                      : NULL;
+  TEST1(inner != NULL && inner->capacity == inner->count && inner->count == 6
+      && inner->constants.capacity == 0, "compile arena, nested chunk");
+  TEST1(w.compiler == NULL && w.compile_arena.last == NULL,
+      "compile arena, reset after compilation");
+
+  wisp_state_free(&w);
+}
+
+static FILE *temp_file(const char *contents)
+{
+  FILE *f = tmpfile();
+  if (f == NULL)
+    return NULL;
+
+  fputs(contents, f);
+  rewind(f);
+  return f;
+}
+
+static bool is_atom(Value val, const char *name)
+{
+  return IS_ATOM(val) && strcmp(AS_ATOM(val)->chars, name) == 0;
+}
+
+static void test_reader_data(void)
+{
+  FILE *f = temp_file("(a (b . 1) 2.5) foo ; A comment.\n'bar ( . c)\n()");
+  if (f == NULL)
+    return;
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct reader r;
+  reader_init(&r, f);
+
+  Value val;
+  TEST1(reader_next(&w, &r, &val) == READ_OK && IS_PAIR(val)
+      && is_atom(AS_PAIR(val)->car, "a"), "reader, list");
+
+  Value rest = IS_PAIR(val) ? AS_PAIR(val)->cdr : NIL_VAL;
+  Value pair = IS_PAIR(rest) ? AS_PAIR(rest)->car : NIL_VAL;
+  TEST1(IS_PAIR(pair) && is_atom(AS_PAIR(pair)->car, "b")
+      && IS_NUM(AS_PAIR(pair)->cdr) && AS_NUM(AS_PAIR(pair)->cdr) == 1,
+      "reader, dotted pair");
+
+  rest = IS_PAIR(rest) ? AS_PAIR(rest)->cdr : NIL_VAL;
+  TEST1(IS_PAIR(rest) && IS_NUM(AS_PAIR(rest)->car)
+      && AS_NUM(AS_PAIR(rest)->car) == 2.5 && IS_NIL(AS_PAIR(rest)->cdr),
+      "reader, number");
+
+  TEST1(reader_next(&w, &r, &val) == READ_OK && is_atom(val, "foo"),
+      "reader, atom");
+  TEST1(reader_next(&w, &r, &val) == READ_OK && is_atom(val, "bar")
+      && r.line == 2, "reader, quoted atom");
+  TEST1(reader_next(&w, &r, &val) == READ_OK && is_atom(val, "c"),
+      "reader, dotted tail only");
+  TEST1(reader_next(&w, &r, &val) == READ_OK && IS_NIL(val),
+      "reader, empty list");
+  TEST1(reader_next(&w, &r, &val) == READ_END, "reader, end");
+
+  reader_free(&r);
+  wisp_state_free(&w);
+  fclose(f);
+}
+
+static void test_reader_errors(void)
+{
+  FILE *f = temp_file(") (a . b c) (a . ) (d)");
+  if (f == NULL)
+    return;
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct reader r;
+  reader_init(&r, f);
+
+  Value val;
+  TEST1(reader_next(&w, &r, &val) == READ_ERROR, "reader, unbalanced ')'");
+  TEST1(reader_next(&w, &r, &val) == READ_ERROR, "reader, two dotted tails");
+
+  // Skip the rest of the erroneous list.
+  reader_next(&w, &r, &val);
+  TEST1(reader_next(&w, &r, &val) == READ_ERROR, "reader, missing tail");
+  TEST1(reader_next(&w, &r, &val) == READ_OK && IS_PAIR(val)
+      && is_atom(AS_PAIR(val)->car, "d"), "reader, recovery");
+
+  reader_free(&r);
+  wisp_state_free(&w);
+  fclose(f);
+}
+
+static void test_reader_gc(void)
+{
+  FILE *f = tmpfile();
+  if (f == NULL)
+    return;
+
+  // A long list spanning many buffers, followed by a deeply nested one.
+  int length = 200000;
+  int depth = 100000;
+
+  fputc('(', f);
+  for (int i = 0; i < length; ++i)
+    fprintf(f, "atom%d %d.5 ", i % 1000, i);
+  fputs(")\n", f);
+
+  for (int i = 0; i < depth; ++i)
+    fputc('(', f);
+  fputs("x", f);
+  for (int i = 0; i < depth; ++i)
+    fputc(')', f);
+  rewind(f);
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // Collect garbage as often as the heap growth allows.
+  w.next_gc = 0;
+
+  struct reader r;
+  reader_init(&r, f);
+
+  Value val;
+  enum read_status status = reader_next(&w, &r, &val);
+  vm_stack_push(&w, val);
+
+  int count = 0;
+  Value last = NIL_VAL;
+  for (Value l = val; IS_PAIR(l); l = AS_PAIR(l)->cdr, ++count)
+    last = AS_PAIR(l)->car;
+
+  TEST(status == READ_OK && count == 2 * length && IS_NUM(last)
+      && AS_NUM(last) == length - 0.5,
+      "reader, long list of %d elements", count);
+
+  status = reader_next(&w, &r, &val);
+  count = 0;
+  for (; IS_PAIR(val); val = AS_PAIR(val)->car)
+    count++;
+
+  TEST(status == READ_OK && count == depth && is_atom(val, "x"),
+      "reader, list nested %d deep", count);
+
+  reader_free(&r);
+  wisp_state_free(&w);
+  fclose(f);
+}
+
+static void test_reader_native(void)
+{
+  FILE *f = temp_file("(1 2 3) nope");
+  if (f == NULL)
+    return;
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+  natives_define(&w);
+
+  // Read from the file instead of the standard input.
+  w.input = malloc(sizeof(struct reader));
+  reader_init(w.input, f);
+
+  struct obj_lambda *lambda = compile(&w,
+      "(define r (cdr (read))) (define s (read)) (define t (read))");
+  TEST1(lambda != NULL && interpret(&w, lambda), "read native, evaluation");
+
+  Value val;
+  bool found = global_get(&w, "r", &val);
+  TEST1(found && IS_PAIR(val) && IS_NUM(AS_PAIR(val)->car)
+      && AS_NUM(AS_PAIR(val)->car) == 2, "read native, first datum");
+  TEST1(global_get(&w, "s", &val) && is_atom(val, "nope"),
+      "read native, second datum");
+  TEST1(global_get(&w, "t", &val) && IS_NIL(val), "read native, end");
+
+  wisp_state_free(&w);
+  fclose(f);
+}
+
+static void test_read_file_native(void)
+{
+  char path[] = "/tmp/wispXXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1)
+    return;
+
+  const char contents[] = "(1 2 3) nope";
+  if (write(fd, contents, sizeof(contents) - 1) == -1) {
+    close(fd);
+    unlink(path);
+    return;
+  }
+
+  close(fd);
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+  natives_define(&w);
+
+  // The reads of the file carry on from one another, whatever the calls.
+  char source[512];
+  snprintf(source, sizeof(source),
+      "(define f (lambda () (read-file '%s)))\n"
+      "(define r (cdr (f))) (define s (f)) (define t (f))", path);
+
+  struct obj_lambda *lambda = compile(&w, source);
+  TEST1(lambda != NULL && interpret(&w, lambda),
+      "read-file native, evaluation");
+
+  Value val;
+  TEST1(global_get(&w, "r", &val) && IS_PAIR(val)
+      && IS_NUM(AS_PAIR(val)->car) && AS_NUM(AS_PAIR(val)->car) == 2,
+      "read-file native, first datum");
+  TEST1(global_get(&w, "s", &val) && is_atom(val, "nope"),
+      "read-file native, second datum");
+  TEST1(global_get(&w, "t", &val) && IS_NIL(val), "read-file native, end");
+
+  unlink(path);
+  lambda = compile(&w, "(define u (f))");
+  TEST1(lambda != NULL && interpret(&w, lambda)
+      && global_get(&w, "u", &val) && IS_NIL(val),
+      "read-file native, file kept open");
+
+  lambda = compile(&w, "(read-file '/nonexistent/wisp)");
+  TEST1(lambda != NULL && !interpret(&w, lambda),
+      "read-file native, missing file");
+
+  wisp_state_free(&w);
+}
+
+static int count_objs(struct wisp_state *w, enum obj_type type)
+{
+  int count = 0;
+  for (struct pool_page *page = pool_next_page(&w->pool, NULL);
+      page != NULL;
+      page = pool_next_page(&w->pool, page))
+    for (size_t i = 0; i < POOL_BITMAP_WORDS * 64; ++i)
+      if (page->allocated[i / 64] >> (i % 64) & 1)
+        count += ((struct obj *) POOL_OBJ(page, i))->type == type;
+
+  for (struct pool_large *large = w->pool.large; large != NULL;
+      large = large->next)
+    count += ((struct obj *) (large + 1))->type == type;
+
+  return count;
+}
+
+static int count_atoms(struct wisp_state *w)
+{
+  int count = 0;
+  for (int i = 0; i < 1 << w->str_pool.exp; ++i)
+    count += w->str_pool.ht[i] != NULL
+      && w->str_pool.ht[i] != &w->str_pool.gravestone;
+
+  return count;
+}
+
+// Makes the next allocation collect garbage, and allocates. The next
+// allocation finishes sweeping, as the heap has outgrown the limit.
+static void collect(struct wisp_state *w)
+{
+  w->next_gc = 0;
+  pair_new(w, NIL_VAL, NIL_VAL);
+  pair_new(w, NIL_VAL, NIL_VAL);
+}
+
+static void test_bytes_native(void)
+{
+  char path[] = "/tmp/wispXXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1)
+    return;
+
+  const char contents[] = "alpha\nbeta\n";
+  if (write(fd, contents, sizeof(contents) - 1) == -1) {
+    close(fd);
+    unlink(path);
+    return;
+  }
+
+  close(fd);
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+  natives_define(&w);
+
+  char source[512];
+  snprintf(source, sizeof(source),
+      "(define b (bytes-map '%s))\n"
+      "(define n (bytes-length b))\n"
+      "(define i (bytes-find b 10 0))\n"
+      "(define j (bytes-find b 10 6))\n"
+      "(define line (bytes-slice b 6 10))\n"
+      "(define k (bytes-find line 10 0))\n"
+      "(define r (bytes-ref line 1))\n"
+      "(define a (bytes-atom line))", path);
+
+  struct obj_lambda *lambda = compile(&w, source);
+  TEST1(lambda != NULL && interpret(&w, lambda), "bytes natives, evaluation");
+
+  Value b;
+  Value line;
+  Value val;
+  TEST1(global_get(&w, "b", &b) && IS_BYTES(b)
+      && global_get(&w, "n", &val) && IS_NUM(val) && AS_NUM(val) == 11,
+      "bytes natives, mapped file");
+  TEST1(global_get(&w, "i", &val) && IS_NUM(val) && AS_NUM(val) == 5
+      && global_get(&w, "j", &val) && IS_NUM(val) && AS_NUM(val) == 10,
+      "bytes natives, find");
+  TEST1(global_get(&w, "line", &line) && IS_BYTES(line) && IS_BYTES(b)
+      && AS_BYTES(line)->mapping == AS_BYTES(b)->mapping
+      && AS_BYTES(line)->bytes == AS_BYTES(b)->bytes + 6,
+      "bytes natives, slice shares the mapping");
+  TEST1(global_get(&w, "k", &val) && IS_NIL(val), "bytes natives, not found");
+  TEST1(global_get(&w, "r", &val) && IS_NUM(val) && AS_NUM(val) == 'e',
+      "bytes natives, ref");
+  TEST1(global_get(&w, "a", &val) && is_atom(val, "beta"),
+      "bytes natives, atom");
+
+  lambda = compile(&w, "(bytes-ref line 4)");
+  TEST1(lambda != NULL && !interpret(&w, lambda),
+      "bytes natives, index out of bounds");
+  lambda = compile(&w, "(bytes-slice line 3 2)");
+  TEST1(lambda != NULL && !interpret(&w, lambda),
+      "bytes natives, reversed slice");
+  lambda = compile(&w, "(bytes-map 'no/such/file)");
+  TEST1(lambda != NULL && !interpret(&w, lambda),
+      "bytes natives, missing file");
+
+  // The mapping lives as long as any of its views.
+  lambda = compile(&w, "(define b '())");
+  if (lambda != NULL)
+    interpret(&w, lambda);
+  collect(&w);
+  TEST1(count_objs(&w, OBJ_MAPPING) == 1,
+      "bytes natives, mapping kept by a slice");
+
+  lambda = compile(&w, "(define line '())");
+  if (lambda != NULL)
+    interpret(&w, lambda);
+  collect(&w);
+  TEST1(count_objs(&w, OBJ_MAPPING) == 0,
+      "bytes natives, mapping freed with the last view");
+
+  wisp_state_free(&w);
+  unlink(path);
+}
+
+// Prints the value into a buffer, and compares the output.
+static bool prints_as(Value val, bool detect_cycles, const char *expected)
+{
+  struct printer p;
+  printer_init(&p, NULL, detect_cycles);
+  printer_print(&p, val);
+
+  bool result = p.len == strlen(expected)
+    && memcmp(p.buffer, expected, p.len) == 0;
+  if (!result)
+    printf("     printed '%.*s'\n", (int) p.len, p.buffer);
+
+  printer_free(&p);
+  return result;
+}
+
+static void test_printer_numbers(void)
+{
+  struct {
+    double num;
+    const char *text;
+  } cases[] = {
+    {0, "0"}, {-0.0, "-0"}, {42, "42"}, {-1234567, "-1234567"},
+    {2.5, "2.5"}, {0.1, "0.1"}, {0.1 + 0.2, "0.30000000000000004"},
+    {1.0 / 3, "0.3333333333333333"}, {1e21, "1e+21"}, {1e-7, "1e-07"},
+    {123456789012345, "123456789012345"}, {5e-324, "5e-324"},
+  };
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    TEST(prints_as(NUM_VAL(cases[i].num), false, cases[i].text),
+        "printer, number %s", cases[i].text);
+}
+
+static void test_printer_lists(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // Nothing is collected while building the lists.
+  w.next_gc = SIZE_MAX;
+  w.next_young_gc = SIZE_MAX;
+
+  Value a = OBJ_VAL(str_pool_intern(&w, "a", 1));
+  Value b = OBJ_VAL(str_pool_intern(&w, "b", 1));
+  Value shared = OBJ_VAL(pair_new(&w, a, NIL_VAL));
+  Value list = OBJ_VAL(pair_new(&w, shared,
+        OBJ_VAL(pair_new(&w, shared, OBJ_VAL(pair_new(&w, NUM_VAL(1), b))))));
+
+  TEST1(prints_as(NIL_VAL, false, "nil"), "printer, nil");
+  TEST1(prints_as(list, false, "((a) (a) 1 . b)"), "printer, list");
+  TEST1(prints_as(list, true, "((a) (a) 1 . b)"),
+      "printer, shared structure is not a cycle");
+
+  // A million nested lists.
+  Value nested = a;
+  for (int i = 0; i < 1000000; ++i)
+    nested = OBJ_VAL(pair_new(&w, nested, NIL_VAL));
+
+  struct printer p;
+  printer_init(&p, NULL, true);
+  printer_print(&p, nested);
+  TEST1(p.len == 2000001 && p.buffer[0] == '(' && p.buffer[1000000] == 'a'
+      && p.buffer[2000000] == ')', "printer, deep nesting");
+  printer_free(&p);
+
+  struct obj_pair *cdr_cycle = pair_new(&w, a, NIL_VAL);
+  cdr_cycle->cdr = OBJ_VAL(pair_new(&w, b, OBJ_VAL(cdr_cycle)));
+  TEST1(prints_as(OBJ_VAL(cdr_cycle), true, "(a b . ...)"),
+      "printer, cycle through cdr");
+
+  struct obj_pair *car_cycle = pair_new(&w, NIL_VAL, NIL_VAL);
+  car_cycle->car = OBJ_VAL(pair_new(&w, a, OBJ_VAL(car_cycle)));
+  TEST1(prints_as(OBJ_VAL(car_cycle), true, "((a . ...))"),
+      "printer, cycle through car");
+
+  wisp_state_free(&w);
+}
+
+// Serializes the value into memory and reads it back.
+static enum read_status round_trip(struct wisp_state *w, Value val, Value *out)
+{
+  struct serializer s;
+  serializer_init(&s, NULL);
+  serialize(&s, val);
+
+  struct reader r;
+  reader_init_memory(&r, s.out.buffer, s.out.len);
+  enum read_status status = deserialize(w, &r, out);
+
+  reader_free(&r);
+  serializer_free(&s);
+  return status;
+}
+
+static void test_serializer_values(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // Nothing is collected while building the values.
+  w.next_gc = SIZE_MAX;
+  w.next_young_gc = SIZE_MAX;
+
+  double nums[] = {
+    0, -0.0, 1, -1, 63, -64, 64, 1e15, -9007199254740991.0,
+    9007199254740992.0, 0.1, 2.5, 1e300, 5e-324,
+  };
+
+  for (size_t i = 0; i < sizeof(nums) / sizeof(nums[0]); ++i) {
+    Value val;
+    TEST(round_trip(&w, NUM_VAL(nums[i]), &val) == READ_OK && IS_NUM(val)
+        && AS_NUM(val) == nums[i] && signbit(AS_NUM(val)) == signbit(nums[i]),
+        "serializer, number %g", nums[i]);
+  }
+
+  Value a = OBJ_VAL(str_pool_intern(&w, "a", 1));
+  Value b = OBJ_VAL(str_pool_intern(&w, "b", 1));
+  Value list = OBJ_VAL(pair_new(&w, a,
+        OBJ_VAL(pair_new(&w, NUM_VAL(1), b))));
+
+  Value val;
+  TEST1(round_trip(&w, NIL_VAL, &val) == READ_OK && IS_NIL(val),
+      "serializer, nil");
+  TEST1(round_trip(&w, a, &val) == READ_OK && AS_OBJ(val) == AS_OBJ(a),
+      "serializer, atom");
+  TEST1(round_trip(&w, list, &val) == READ_OK && IS_PAIR(val)
+      && prints_as(val, false, "(a 1 . b)"), "serializer, dotted list");
+
+  // The atom name is written once, later occurrences refer to it.
+  Value atoms = NIL_VAL;
+  for (int i = 0; i < 100; ++i)
+    atoms = OBJ_VAL(pair_new(&w, a, atoms));
+
+  struct serializer s;
+  serializer_init(&s, NULL);
+  serialize(&s, atoms);
+  TEST(s.out.len == 100 + 3 + 99 * 2 + 1,
+      "serializer, atom written once (%zu bytes)", s.out.len);
+  serializer_free(&s);
+
+  // The same pair twice, and a cycle.
+  Value shared = OBJ_VAL(pair_new(&w, b, NIL_VAL));
+  Value twice = OBJ_VAL(pair_new(&w, shared, OBJ_VAL(pair_new(&w, shared,
+            NIL_VAL))));
+  TEST1(round_trip(&w, twice, &val) == READ_OK
+      && prints_as(val, false, "((b) (b))")
+      && AS_OBJ(AS_PAIR(val)->car) == AS_OBJ(AS_PAIR(AS_PAIR(val)->cdr)->car)
+      && AS_PAIR(AS_PAIR(val)->car) != AS_PAIR(shared),
+      "serializer, shared pair");
+
+  struct obj_pair *cycle = pair_new(&w, a, NIL_VAL);
+  cycle->cdr = OBJ_VAL(cycle);
+  TEST1(round_trip(&w, OBJ_VAL(cycle), &val) == READ_OK && IS_PAIR(val)
+      && AS_OBJ(AS_PAIR(val)->cdr) == AS_OBJ(val), "serializer, cycle");
+
+  wisp_state_free(&w);
+}
+
+static void test_serializer_stream(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct obj_lambda *lambda = compile(&w, "(define f (lambda (x) x))");
+  Value f = NIL_VAL;
+  if (lambda != NULL && interpret(&w, lambda))
+    global_get(&w, "f", &f);
+
+  Value x = OBJ_VAL(str_pool_intern(&w, "x", 1));
+  Value val;
+
+  struct serializer s;
+  serializer_init(&s, NULL);
+
+  // A list written element by element shares its atoms.
+  serialize_list_begin(&s);
+  for (int i = 0; i < 3; ++i)
+    serialize_list_add(&s, x);
+  serialize_list_end(&s);
+
+  TEST1(!serialize(&s, f), "serializer, function rejected");
+
+  serialize_list_begin(&s);
+  serialize_list_add(&s, NUM_VAL(1));
+  TEST1(!serialize_list_add(&s, f) && !serialize_list_add(&s, NUM_VAL(2)),
+      "serializer, list with a function rejected");
+  serialize_list_end(&s);
+
+  serialize(&s, x);
+
+  struct reader r;
+  reader_init_memory(&r, s.out.buffer, s.out.len);
+  TEST1(deserialize(&w, &r, &val) == READ_OK
+      && prints_as(val, false, "(x x x)"), "serializer, streamed list");
+  TEST1(deserialize(&w, &r, &val) == READ_ERROR,
+      "deserializer, function is an error");
+  TEST1(deserialize(&w, &r, &val) == READ_ERROR,
+      "deserializer, list with a function is an error");
+  TEST1(deserialize(&w, &r, &val) == READ_OK && AS_OBJ(val) == AS_OBJ(x),
+      "deserializer, recovery");
+  TEST1(deserialize(&w, &r, &val) == READ_END, "deserializer, end");
+  reader_free(&r);
+
+  // Truncated and corrupt data.
+  const char truncated[] = {5, 3, 4, 'a'};
+  reader_init_memory(&r, truncated, sizeof(truncated));
+  TEST1(deserialize(&w, &r, &val) == READ_ERROR, "deserializer, truncated");
+  reader_free(&r);
+
+  const char dangling[] = {5, 4, 0, 0};
+  reader_init_memory(&r, dangling, sizeof(dangling));
+  TEST1(deserialize(&w, &r, &val) == READ_ERROR,
+      "deserializer, dangling reference");
+  reader_free(&r);
+
+  serializer_free(&s);
+  wisp_state_free(&w);
+}
+
+static void test_serializer_gc(void)
+{
+  FILE *f = tmpfile();
+  if (f == NULL)
+    return;
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  int length = 200000;
+  int depth = 100000;
+
+  // Written through a file, so that the values span many buffers.
+  struct serializer s;
+  serializer_init(&s, f);
+  serialize_list_begin(&s);
+
+  for (int i = 0; i < length; ++i) {
+    char name[16];
+    int len = snprintf(name, sizeof(name), "atom%d", i % 1000);
+    serialize_list_add(&s, OBJ_VAL(str_pool_intern(&w, name, len)));
+    serialize_list_add(&s, NUM_VAL(i + 0.5));
+  }
+
+  serialize_list_end(&s);
+
+  Value nested = OBJ_VAL(str_pool_intern(&w, "x", 1));
+  vm_stack_push(&w, nested);
+  for (int i = 0; i < depth; ++i) {
+    nested = OBJ_VAL(pair_new(&w, nested, NIL_VAL));
+    w.stack[0] = nested;
+  }
+
+  serialize(&s, nested);
+  vm_stack_pop(&w);
+  serializer_free(&s);
+  rewind(f);
+
+  // Collect garbage as often as the heap growth allows.
+  w.next_gc = 0;
+
+  struct reader r;
+  reader_init(&r, f);
+
+  Value val;
+  enum read_status status = deserialize(&w, &r, &val);
+  vm_stack_push(&w, val);
+
+  int count = 0;
+  Value last = NIL_VAL;
+  for (Value l = val; IS_PAIR(l); l = AS_PAIR(l)->cdr, ++count)
+    last = AS_PAIR(l)->car;
+
+  TEST(status == READ_OK && count == 2 * length && IS_NUM(last)
+      && AS_NUM(last) == length - 0.5,
+      "deserializer, long list of %d elements", count);
+
+  status = deserialize(&w, &r, &val);
+  count = 0;
+  for (; IS_PAIR(val); val = AS_PAIR(val)->car)
+    count++;
+
+  TEST(status == READ_OK && count == depth && is_atom(val, "x"),
+      "deserializer, list nested %d deep", count);
+
+  reader_free(&r);
+  wisp_state_free(&w);
+  fclose(f);
+}
+
+// Compiles the source into an image at the path, returning whether the
+// image was kept.
+static bool write_image(const char *path, const char *source, bool lazy)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+  w.lazy_compile = lazy;
+
+  struct image_writer iw;
+  if (!image_writer_open(&iw, path, image_hash(source, strlen(source)),
+        strlen(source))) {
+    wisp_state_free(&w);
+    return false;
+  }
+
+  struct toplevel t;
+  toplevel_init(&t, source, 1);
+
+  bool had_error = false;
+  struct obj_lambda *lambda;
+  while (compile_next(&w, &t, &lambda) && !had_error) {
+    if (lambda == NULL)
+      had_error = true;
+    else
+      image_write_form(&iw, lambda);
+  }
+
+  wisp_state_free(&w);
+  return image_writer_close(&iw, !had_error);
+}
+
+static void test_image(void)
+{
+  char path[] = "/tmp/wispXXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1)
+    return;
+
+  close(fd);
+
+  const char *source =
+    "(define f (lambda (x) (lambda (y) (cons x (cons y '(1.5 . a))))))\n"
+    "(define g (lambda args args))\n"
+    "(define r ((f 'p) 'q))\n"
+    "(define s (g 1 2 3))\n"
+    "(define t '(u (v . 2) () w))";
+  uint64_t hash = image_hash(source, strlen(source));
+
+  TEST1(write_image(path, source, false), "image, written");
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // Collect garbage as often as the heap growth allows.
+  w.next_gc = 0;
+
+  struct image img;
+  bool is_open = image_open(&img, &w, path, hash, strlen(source));
+  TEST1(is_open, "image, opened");
+
+  int forms = 0;
+  bool is_mapped = true;
+  struct obj_lambda *lambda;
+
+  while (is_open && image_next(&img, &lambda) && interpret(&w, lambda)) {
+    is_mapped = is_mapped && lambda->image != NULL
+      && (uint8_t *) lambda->chunk.code > (uint8_t *) lambda->image->start
+      && (uint8_t *) lambda->chunk.code
+         < (uint8_t *) lambda->image->start + lambda->image->size;
+    forms++;
+  }
+
+  if (is_open)
+    image_close(&img);
+
+  TEST(forms == 5, "image, %d forms executed", forms);
+  TEST1(is_mapped, "image, bytecode used in place");
+
+  Value val;
+  TEST1(global_get(&w, "r", &val)
+      && prints_as(val, false, "(p q 1.5 . a)"), "image, nested lambdas");
+  TEST1(global_get(&w, "s", &val) && prints_as(val, false, "(1 2 3)"),
+      "image, parameter list");
+  TEST1(global_get(&w, "t", &val)
+      && prints_as(val, false, "(u (v . 2) nil w)"), "image, quoted list");
+
+  // The mapping stays until the lambdas loaded from it are garbage.
+  collect(&w);
+  TEST1(count_objs(&w, OBJ_MAPPING) == 1, "image, mapping kept");
+  lambda = compile(&w, "(define f '()) (define g '())");
+  if (lambda != NULL)
+    interpret(&w, lambda);
+  collect(&w);
+  TEST1(count_objs(&w, OBJ_MAPPING) == 0, "image, mapping freed");
+
+  TEST1(!image_open(&img, &w, path, hash + 1, strlen(source)),
+      "image, stale hash rejected");
+
+  // A truncated image.
+  struct stat st;
+  if (stat(path, &st) == 0 && truncate(path, st.st_size - 4) == 0)
+    TEST1(!image_open(&img, &w, path, hash, strlen(source)),
+        "image, truncated image rejected");
+
+  wisp_state_free(&w);
+
+  TEST1(!write_image(path, "(define f (lambda (x) x))", true),
+      "image, lazy lambdas not written");
+  TEST1(!write_image(path, "(define f (lambda (x) x)) (define", false),
+      "image, not written on a compile error");
+
+  unlink(path);
+}
+
+// Whether the value is an object of the snapshot the state uses.
+static bool is_shared(struct wisp_state *w, Value val)
+{
+  return w->snapshot != NULL && IS_OBJ(val)
+    && (uintptr_t) AS_OBJ(val) - (uintptr_t) w->snapshot->base
+       < w->snapshot->size;
+}
+
+static void test_snapshot(void)
+{
+  char path[] = "/tmp/wispXXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1)
+    return;
+
+  close(fd);
+
+  char data[] = "/tmp/wispXXXXXX";
+  fd = mkstemp(data);
+  if (fd == -1) {
+    unlink(path);
+    return;
+  }
+
+  if (write(fd, "snapshot", 8) != 8) {
+    close(fd);
+    unlink(data);
+    unlink(path);
+    return;
+  }
+
+  close(fd);
+
+  char source[256];
+  snprintf(source, sizeof(source),
+    "(define mk (lambda (x) (lambda (y) (cons x (cons y '(1.5 . a))))))\n"
+    "(define f (mk 'p))\n"
+    "(define g (lambda (x) x))\n"
+    "(define s '(a b c))\n"
+    "(define b (bytes-slice (bytes-map '%s) 4 8))\n", data);
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+  natives_define(&w);
+  w.lazy_compile = true;
+
+  struct obj_lambda *lambda = compile(&w, source);
+  TEST1(lambda != NULL && interpret(&w, lambda), "snapshot, evaluation");
+  TEST1(wisp_state_snapshot(&w, path), "snapshot, written");
+  wisp_state_free(&w);
+  unlink(data);
+
+  wisp_state_init(&w);
+  TEST1(wisp_state_restore(&w, path), "snapshot, restored");
+  natives_define(&w);
+
+  // Collect garbage as often as the heap growth allows.
+  w.next_gc = 0;
+  collect(&w);
+
+  Value val;
+  TEST1(global_get(&w, "s", &val) && prints_as(val, false, "(a b c)")
+      && is_shared(&w, val),
+      "snapshot, objects used in place");
+
+  lambda = compile(&w,
+      "(define r (f 'q))\n"
+      "(define t (g (bytes-atom b)))");
+  TEST1(lambda != NULL && interpret(&w, lambda), "snapshot, restored calls");
+  TEST1(global_get(&w, "r", &val)
+      && prints_as(val, false, "(p q 1.5 . a)"), "snapshot, closure");
+  TEST1(global_get(&w, "t", &val) && is_atom(val, "shot"),
+      "snapshot, copied bytes");
+
+  // Atoms of the snapshot are interned, so names read later refer to them.
+  TEST1(global_get(&w, "s", &val) && IS_PAIR(val)
+      && AS_OBJ(AS_PAIR(val)->car)
+         == (struct obj *) str_pool_intern(&w, "a", 1),
+      "snapshot, atoms interned");
+
+  TEST1(!wisp_state_restore(&w, path), "snapshot, state not fresh");
+  wisp_state_free(&w);
+
+  // A corrupted snapshot.
+  struct stat st;
+  fd = open(path, O_WRONLY);
+  if (fd != -1 && pwrite(fd, "X", 1, 0) == 1) {
+    wisp_state_init(&w);
+    TEST1(!wisp_state_restore(&w, path), "snapshot, corrupted rejected");
+    wisp_state_free(&w);
+  }
+
+  if (fd != -1)
+    close(fd);
+
+  // A truncated snapshot.
+  wisp_state_init(&w);
+  natives_define(&w);
+  lambda = compile(&w, "(define g (lambda (x) x))");
+  if (lambda != NULL)
+    interpret(&w, lambda);
+  wisp_state_snapshot(&w, path);
+  wisp_state_free(&w);
+
+  if (stat(path, &st) == 0 && truncate(path, st.st_size - 8) == 0) {
+    wisp_state_init(&w);
+    TEST1(!wisp_state_restore(&w, path), "snapshot, truncated rejected");
+    wisp_state_free(&w);
+  }
+
+  unlink(path);
+}
+
+static void test_state_clone(void)
+{
+  const char *source =
+    "(define mk (lambda (x) (lambda (y) (cons x (cons y '(1.5 . a))))))\n"
+    "(define f (mk 'p))\n"
+    "(define s '(a b c))\n";
+
+  struct wisp_state template;
+  wisp_state_init(&template);
+  natives_define(&template);
+  template.lazy_compile = true;
+
+  struct obj_lambda *lambda = compile(&template, source);
+  TEST1(lambda != NULL && interpret(&template, lambda),
+      "clone, template evaluation");
+
+  struct wisp_state a;
+  struct wisp_state b;
+  TEST1(wisp_state_clone(&a, &template) && wisp_state_clone(&b, &template),
+      "clone, cloned");
+  TEST1(a.snapshot == b.snapshot && a.snapshot == template.shared
+      && pool_next_page(&a.pool, NULL) == NULL
+      && pool_next_page(&b.pool, NULL) == NULL,
+      "clone, objects shared");
+
+  // Collect garbage as often as the heap growth allows.
+  a.next_gc = 0;
+  b.next_gc = 0;
+
+  lambda = compile(&a, "(define r (f 'q)) (define s (cons 'x s))");
+  TEST1(lambda != NULL && interpret(&a, lambda), "clone, evaluation");
+  collect(&a);
+
+  Value val;
+  TEST1(global_get(&a, "r", &val) && prints_as(val, false, "(p q 1.5 . a)")
+      && !is_shared(&a, val), "clone, shared closure called");
+  TEST1(global_get(&a, "s", &val) && prints_as(val, false, "(x a b c)")
+      && IS_PAIR(val) && is_shared(&a, AS_PAIR(val)->cdr),
+      "clone, shared list extended");
+
+  // The atoms of the snapshot are interned in each clone.
+  TEST1(global_get(&b, "s", &val) && prints_as(val, false, "(a b c)")
+      && IS_PAIR(val) && AS_OBJ(AS_PAIR(val)->car)
+         == (struct obj *) str_pool_intern(&b, "a", 1),
+      "clone, globals of other clones unchanged");
+  TEST1(global_get(&template, "s", &val)
+      && prints_as(val, false, "(a b c)") && !is_shared(&template, val),
+      "clone, globals of the template unchanged");
+  TEST1(!global_get(&b, "r", &val), "clone, definitions not shared");
+
+  TEST1(global_get(&b, "bytes-length", &val) && IS_NATIVE(val)
+      && is_shared(&b, val), "clone, natives shared");
+
+  wisp_state_free(&a);
+  wisp_state_free(&b);
+  wisp_state_free(&template);
+}
+
+static void test_server_eval(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+  natives_define(&w);
+  w.lazy_compile = true;
+
+  struct printer p;
+  printer_init(&p, NULL, true);
+
+  TEST1(server_eval(&w, "(define f (lambda (x) (cons x x))) (f 'a)", &p)
+      && p.len == 7 && memcmp(p.buffer, "(a . a)", 7) == 0,
+      "server, value of the last form");
+
+  Value val;
+  TEST1(global_get(&w, "f", &val) && IS_CLOSURE(val)
+      && AS_CLOSURE(val)->lambda->lazy == NULL && w.lazy_compile,
+      "server, lambdas compiled eagerly");
+
+  p.len = 0;
+  TEST1(server_eval(&w, "", &p) && p.len == 3
+      && memcmp(p.buffer, "nil", 3) == 0, "server, empty request");
+
+  p.len = 0;
+  TEST1(!server_eval(&w, "(f 'a 'b)", &p) && p.len == 0,
+      "server, runtime error");
+  TEST1(!server_eval(&w, "(f 'a", &p) && p.len == 0,
+      "server, compile error");
+
+  // The garbage of the requests is collected, and the globals they define
+  // are kept.
+  collect_garbage(&w);
+  int pairs = count_objs(&w, OBJ_PAIR);
+  p.len = 0;
+  TEST1(server_eval(&w, "(define g (f (f (f 'b)))) (f (f 'c))", &p),
+      "server, request evaluated");
+  collect_garbage(&w);
+  TEST(count_objs(&w, OBJ_PAIR) == pairs + 3,
+      "server, %d pairs kept after the request",
+      count_objs(&w, OBJ_PAIR) - pairs);
+
+  // Only the young garbage is collected after a request, until the heap
+  // grows past the next full collection. The old garbage is then freed.
+  TEST1(server_eval(&w, "(define g '())", &p), "server, global reset");
+  w.next_gc = SIZE_MAX;
+  pairs = count_objs(&w, OBJ_PAIR);
+  TEST1(server_eval(&w, "(f (f 'd))", &p), "server, young request evaluated");
+  server_collect(&w);
+  TEST(count_objs(&w, OBJ_PAIR) == pairs,
+      "server, %d young pairs kept after a minor collection",
+      count_objs(&w, OBJ_PAIR) - pairs);
+
+  w.next_gc = 0;
+  server_collect(&w);
+  TEST(count_objs(&w, OBJ_PAIR) == pairs - 3,
+      "server, %d old pairs freed after a full collection",
+      pairs - count_objs(&w, OBJ_PAIR));
+
+  printer_free(&p);
+  wisp_state_free(&w);
+}
+
+static void test_pool(void)
+{
+  struct pool p;
+  pool_init(&p);
+
+  // Many more objects than fit on a page.
+  int count = 10000;
+  unsigned char **objs = malloc(sizeof(unsigned char *) * count);
+
+  for (int i = 0; i < count; ++i) {
+    objs[i] = pool_alloc(&p, 48);
+    memset(objs[i], i & 0xff, 48);
+  }
+
+  int intact = 0;
+  for (int i = 0; i < count; ++i)
+    intact += objs[i][0] == (i & 0xff) && objs[i][47] == (i & 0xff);
+
+  TEST(intact == count, "pool, %d objects intact", intact);
+
+  unsigned char *freed = objs[count / 2];
+  pool_dealloc(&p, freed, 48);
+  objs[count / 2] = pool_alloc(&p, 44);
+  TEST1(objs[count / 2] == freed, "pool, freed object reused");
+
+  for (int i = 0; i < count; ++i)
+    pool_dealloc(&p, objs[i], 48);
+
+  pool_trim(&p);
+  void *trimmed = p.free_pages;
+  TEST1(p.pages[(48 - 1) / POOL_GRANULE] == NULL && trimmed != NULL
+      && pool_next_page(&p, NULL) == NULL, "pool, empty pages trimmed");
+
+  void *small = pool_alloc(&p, 16);
+  TEST1((void *) p.pages[(16 - 1) / POOL_GRANULE] == trimmed
+      && pool_next_page(&p, NULL) == trimmed,
+      "pool, trimmed page reused by another size class");
+
+  // Objects allocated from another pool are freed into this one.
+  struct pool other;
+  pool_init(&other);
+  void *adopted = pool_alloc(&other, 48);
+  void *large = pool_alloc_large(&other, 128);
+  pool_adopt(&p, &other);
+  pool_dealloc(&p, adopted, 48);
+  TEST1(other.regions == NULL && pool_alloc(&p, 48) == adopted,
+      "pool, pages adopted");
+  TEST1(other.large == NULL && p.large == POOL_LARGE(large),
+      "pool, large objects adopted");
+
+  pool_dealloc_large(&p, large);
+
+  pool_dealloc(&p, small, 16);
+  pool_free(&p);
+  pool_free(&other);
+  free(objs);
+}
+
+static void test_gc_generations(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+  natives_define(&w);
+
+  // Collect the young objects on every allocation, and never all of them.
+  w.nursery_size = 0;
+  w.next_young_gc = 0;
+  w.next_gc = SIZE_MAX;
+
+  struct printer p;
+  printer_init(&p, NULL, true);
+
+  // The closures are old by the time their upvalues capture young pairs.
+  TEST1(server_eval(&w,
+        "(define mk (lambda (x) (lambda (y) (lambda (z)"
+        "  (cons x (cons y z))))))"
+        "(define f ((mk 'a) (cons 'b 'c)))"
+        "(define g (lambda (x) (car (cons x (cons x x)))))"
+        "(cons (f 1) (g (g (f 2))))", &p)
+      && p.len == 31
+      && memcmp(p.buffer, "((a (b . c) . 1) a (b . c) . 2)", 31) == 0,
+      "generations, closures survive minor collections");
+
+  // A deserialized list is old before its last pair is linked in.
+  Value val = NIL_VAL;
+  vm_stack_push(&w, val);
+  for (int i = 0; i < 100; ++i) {
+    val = OBJ_VAL(pair_new(&w, NUM_VAL(i), val));
+    w.stack[0] = val;
+  }
+
+  Value copy;
+  int count = 0;
+  if (round_trip(&w, val, &copy) == READ_OK)
+    for (; IS_PAIR(copy); copy = AS_PAIR(copy)->cdr, ++count) {
+      Value car = AS_PAIR(copy)->car;
+      if (!IS_NUM(car) || AS_NUM(car) != 99 - count)
+        break;
+    }
+
+  TEST(count == 100, "generations, %d elements deserialized", count);
+  vm_stack_reset(&w);
+
+  // The pairs the request allocated before its others became old, and are
+  // kept by minor collections once unreachable. The unreachable young pairs
+  // are freed by the next allocation.
+  int pairs = count_objs(&w, OBJ_PAIR);
+  p.len = 0;
+  TEST1(server_eval(&w, "(g (g (cons 1 2)))", &p),
+      "generations, request evaluated");
+  pair_new(&w, NIL_VAL, NIL_VAL);
+  pair_new(&w, NIL_VAL, NIL_VAL);
+  TEST(count_objs(&w, OBJ_PAIR) == pairs + 4,
+      "generations, %d pairs left after minor collections",
+      count_objs(&w, OBJ_PAIR) - pairs);
+
+  // Minor collections only unintern the young atoms, and only sweep the
+  // young large objects.
+  vm_stack_push(&w, OBJ_VAL(str_pool_intern(&w, "old-atom", 8)));
+  collect_garbage(&w);
+  vm_stack_reset(&w);
+  int atoms = count_atoms(&w);
+  int lambdas = count_objs(&w, OBJ_LAMBDA);
+  w.next_young_gc = SIZE_MAX;
+  str_pool_intern(&w, "young-atom", 10);
+  lambda_new(&w);
+  w.next_young_gc = 0;
+  TEST1(count_atoms(&w) == atoms + 1 && w.pool.young_large_count == 1,
+      "generations, young atom and lambda allocated");
+  pair_new(&w, NIL_VAL, NIL_VAL);
+  TEST(count_atoms(&w) == atoms && w.str_pool.young_count == 0
+      && w.pool.young_large_count == 0
+      && count_objs(&w, OBJ_LAMBDA) == lambdas,
+      "generations, %d atoms left after a minor collection",
+      count_atoms(&w) - atoms);
+
+  // A major collection frees the old garbage as well.
+  TEST1(server_eval(&w, "(define f '())", &p), "generations, global reset");
+  collect_garbage(&w);
+  TEST(count_objs(&w, OBJ_PAIR) < pairs,
+      "generations, %d pairs left after a major collection",
+      count_objs(&w, OBJ_PAIR));
+
+  printer_free(&p);
+  wisp_state_free(&w);
+}
+
+// Allocates garbage until the incremental collection reaches the phase.
+static void collect_until(struct wisp_state *w, enum gc_phase phase)
+{
+  for (int i = 0; i < 1000000 && w->gc_phase != phase; ++i)
+    pair_new(w, NIL_VAL, NIL_VAL);
+}
+
+static void test_gc_incremental(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+  natives_define(&w);
+
+  // Many live objects, so that a collection takes many slices.
+  int length = 10000;
+  Value list = NIL_VAL;
+  vm_stack_push(&w, list);
+  for (int i = 0; i < length; ++i) {
+    list = OBJ_VAL(pair_new(&w, NIL_VAL, list));
+    w.stack[0] = list;
+  }
+
+  struct obj_pair *holder = pair_new(&w, NIL_VAL, NIL_VAL);
+  vm_stack_push(&w, OBJ_VAL(holder));
+  collect_garbage(&w);
+
+  // Do a short slice of collection on every allocation. The collections
+  // start once anything is allocated, without finishing at once.
+  w.max_gc_pause = 1;
+  w.nursery_size = 0;
+  w.next_gc = w.bytes_allocated;
+  pair_new(&w, NIL_VAL, NIL_VAL);
+  TEST1(w.gc_phase == GC_CLEAR, "incremental, collection started");
+
+  collect_until(&w, GC_MARK);
+  TEST1(w.gc_phase == GC_MARK && obj_is_marked(&holder->obj),
+      "incremental, roots marked");
+
+  // A pair stored into the marked holder, without a slice in between.
+  w.next_young_gc = SIZE_MAX;
+  struct obj_pair *stored = pair_new(&w, NUM_VAL(42), NIL_VAL);
+  holder->car = OBJ_VAL(stored);
+  WRITE_BARRIER(&w, &holder->obj);
+  w.next_young_gc = 0;
+
+  collect_until(&w, GC_SWEEP);
+  collect_until(&w, GC_IDLE);
+  TEST1(w.gc_phase == GC_IDLE && w.gc_cursor == NULL
+      && IS_PAIR(holder->car) && AS_PAIR(holder->car) == stored
+      && obj_is_marked(&stored->obj) && IS_NUM(stored->car)
+      && AS_NUM(stored->car) == 42,
+      "incremental, stored pair kept by the write barrier");
+
+  // The garbage allocated before sweeping is freed.
+  int pairs = count_objs(&w, OBJ_PAIR) - length - 2;
+  TEST(pairs < length / 2, "incremental, %d garbage pairs left", pairs);
+
+  // A full collection abandons an incremental one.
+  w.next_gc = w.bytes_allocated;
+  collect_until(&w, GC_MARK);
+  collect_garbage(&w);
+  TEST1(w.gc_phase == GC_IDLE && w.gray_count == 0
+      && count_objs(&w, OBJ_PAIR) == length + 2,
+      "incremental, collection abandoned");
+
+  // Programs run through many incremental collections.
+  w.next_gc = w.bytes_allocated;
+  struct printer p;
+  printer_init(&p, NULL, true);
+  TEST1(server_eval(&w,
+        "(define mk (lambda (x) (lambda (y) (lambda (z)"
+        "  (cons x (cons y z))))))"
+        "(define f ((mk 'a) (cons 'b 'c)))"
+        "(define g (lambda (x) (car (cons x (cons x x)))))"
+        "(cons (f 1) (g (g (f 2))))", &p)
+      && p.len == 31
+      && memcmp(p.buffer, "((a (b . c) . 1) a (b . c) . 2)", 31) == 0,
+      "incremental, closures survive collections");
+
+  printer_free(&p);
+  wisp_state_free(&w);
+}
+
+static void test_gc_parallel(void)
+{
+  struct wisp_state template;
+  wisp_state_init(&template);
+  struct obj_lambda *lambda = compile(&template, "(define s '(a b c))");
+  TEST1(lambda != NULL && interpret(&template, lambda),
+      "parallel marking, template evaluation");
+
+  // The objects of the snapshot are read-only, so they must not be marked
+  // again.
+  struct wisp_state w;
+  TEST1(wisp_state_clone(&w, &template), "parallel marking, cloned");
+  w.gc_threads = 4;
+
+  Value shared;
+  global_get(&w, "s", &shared);
+
+  // A list of lists referring to the shared list, interleaved with garbage.
+  int length = 20000;
+  vm_stack_push(&w, NIL_VAL);
+
+  for (int i = 0; i < length; ++i) {
+    pair_new(&w, NIL_VAL, NIL_VAL);
+    vm_stack_push(&w, OBJ_VAL(pair_new(&w, shared, NUM_VAL(i))));
+    Value list = OBJ_VAL(pair_new(&w, w.stack[1], w.stack[0]));
+    vm_stack_pop(&w);
+    w.stack[0] = list;
+  }
+
+  collect_garbage(&w);
+
+  int count = 0;
+  for (Value l = w.stack[0]; IS_PAIR(l); l = AS_PAIR(l)->cdr, ++count) {
+    struct obj_pair *leaf = AS_PAIR(AS_PAIR(l)->car);
+    if (AS_OBJ(leaf->car) != AS_OBJ(shared) || !IS_NUM(leaf->cdr)
+        || AS_NUM(leaf->cdr) != length - 1 - count)
+      break;
+  }
+
+  TEST(count == length && count_objs(&w, OBJ_PAIR) == 2 * length
+      && is_shared(&w, shared),
+      "parallel marking, %d of %d elements kept", count, length);
+
+  wisp_state_free(&w);
+  wisp_state_free(&template);
+}
+
+static void test_gc_lazy_sweep(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // A live list, followed by as much garbage, once a collection started
+  // meanwhile is done.
+  int length = 20000;
+  vm_stack_push(&w, NIL_VAL);
+  for (int i = 0; i < length; ++i)
+    w.stack[0] = OBJ_VAL(pair_new(&w, NUM_VAL(i), w.stack[0]));
+
+  collect_garbage(&w);
+  w.next_gc = SIZE_MAX;
+  w.next_young_gc = SIZE_MAX;
+  for (int i = 0; i < length; ++i)
+    pair_new(&w, NIL_VAL, NIL_VAL);
+
+  // Sweep a slice on every allocation.
+  w.nursery_size = 0;
+  w.next_gc = w.bytes_allocated;
+  struct obj_pair *young = pair_new(&w, NIL_VAL, NIL_VAL);
+  vm_stack_push(&w, OBJ_VAL(young));
+  TEST1(w.gc_phase == GC_SWEEP && w.gc_cursor != NULL,
+      "lazy sweep, pages left to sweep");
+
+  int allocations = 0;
+  while (w.gc_phase == GC_SWEEP && allocations < length) {
+    pair_new(&w, NIL_VAL, NIL_VAL);
+    allocations++;
+  }
+
+  TEST(w.gc_phase == GC_IDLE && allocations > 1,
+      "lazy sweep, done in %d slices", allocations);
+
+  // The objects allocated while sweeping are kept.
+  TEST(count_objs(&w, OBJ_PAIR) == length + allocations + 1,
+      "lazy sweep, %d pairs kept",
+      count_objs(&w, OBJ_PAIR) - length);
+
+  int count = 0;
+  for (Value l = w.stack[0]; IS_PAIR(l); l = AS_PAIR(l)->cdr, ++count) {
+    Value car = AS_PAIR(l)->car;
+    if (!IS_NUM(car) || AS_NUM(car) != length - 1 - count)
+      break;
+  }
+
+  TEST(count == length, "lazy sweep, %d elements kept", count);
+  wisp_state_free(&w);
+}
+
+static void test_gc_mark_bits(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  TEST(sizeof(struct obj) <= 8, "mark bits, %zu byte object header",
+      sizeof(struct obj));
+
+  // Marking leaves the objects themselves alone.
+  struct obj_pair *kept = pair_new(&w, NUM_VAL(1), NIL_VAL);
+  vm_stack_push(&w, OBJ_VAL(kept));
+  unsigned char before[sizeof(struct obj_pair)];
+  memcpy(before, kept, sizeof(before));
+  collect_garbage(&w);
+  TEST1(obj_is_marked(&kept->obj)
+      && memcmp(before, kept, sizeof(before)) == 0,
+      "mark bits, marked object left alone");
+
+  // An object allocated in place of a freed one starts unmarked.
+  vm_stack_pop(&w);
+  collect_garbage(&w);
+  struct obj_pair *reused = pair_new(&w, NIL_VAL, NIL_VAL);
+  TEST1(reused == kept && !obj_is_marked(&reused->obj),
+      "mark bits, freed object cleared");
+
+  // Large objects are marked in their headers.
+  struct obj_lambda *lambda = lambda_new(&w);
+  vm_stack_push(&w, OBJ_VAL(lambda));
+  collect_garbage(&w);
+  TEST1(lambda->obj.is_large && obj_is_marked(&lambda->obj)
+      && count_objs(&w, OBJ_LAMBDA) == 1, "mark bits, large object kept");
+
+  vm_stack_pop(&w);
+  collect_garbage(&w);
+  TEST1(count_objs(&w, OBJ_LAMBDA) == 0, "mark bits, large object freed");
+
+  wisp_state_free(&w);
+}
+
+static void test_gc_sweep_allocation(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // Live pairs with sparse garbage, allocated without any collection.
+  int live = 50000;
+  w.next_gc = SIZE_MAX;
+  w.next_young_gc = SIZE_MAX;
+  vm_stack_push(&w, NIL_VAL);
+  for (int i = 0; i < live; ++i) {
+    w.stack[0] = OBJ_VAL(pair_new(&w, NUM_VAL(i), w.stack[0]));
+    if (i % 128 == 0)
+      pair_new(&w, NIL_VAL, NIL_VAL);
+  }
+
+  // A list built while the pages are swept, faster than the sweep frees
+  // room, so that its pairs alternate between the swept pages and the last
+  // page awaiting the sweep.
+  w.nursery_size = 8192;
+  w.next_gc = w.bytes_allocated;
+  vm_stack_push(&w, NIL_VAL);
+  pair_new(&w, NIL_VAL, NIL_VAL);
+  TEST1(w.gc_phase == GC_SWEEP, "sweep allocation, sweep started");
+
+  int length = 5000;
+  for (int i = 0; i < length; ++i)
+    w.stack[1] = OBJ_VAL(pair_new(&w, NUM_VAL(i), w.stack[1]));
+
+  // Minor collections, once the sweep is done.
+  for (int i = 0; i < 10000 || w.gc_phase != GC_IDLE; ++i)
+    pair_new(&w, NIL_VAL, NIL_VAL);
+
+  int count = 0;
+  for (Value l = w.stack[1]; IS_PAIR(l); l = AS_PAIR(l)->cdr, ++count) {
+    Value car = AS_PAIR(l)->car;
+    if (!IS_NUM(car) || AS_NUM(car) != length - 1 - count)
+      break;
+  }
+
+  TEST(count == length, "sweep allocation, %d elements kept", count);
+  wisp_state_free(&w);
+}
+
+static void test_compact(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+  natives_define(&w);
+
+  struct printer p;
+  printer_init(&p, NULL, true);
+
+  // A closure whose upvalue is closed, and a list of atoms.
+  TEST1(server_eval(&w,
+        "(define mk (lambda (x) (lambda (y) (cons x y))))"
+        "(define f (mk 'a))"
+        "(define l '(p q r))", &p),
+      "compaction, program evaluated");
+
+  // A list running backwards through memory, interleaved with garbage.
+  int length = 10000;
+  vm_stack_push(&w, NIL_VAL);
+  for (int i = 0; i < length; ++i) {
+    pair_new(&w, NIL_VAL, NIL_VAL);
+    w.stack[0] = OBJ_VAL(pair_new(&w, NUM_VAL(i), w.stack[0]));
+  }
+
+  w.frame_count = 1;
+  TEST1(!compact_heap(&w), "compaction, refused while executing");
+  w.frame_count = 0;
+
+  TEST1(compact_heap(&w), "compaction, done");
+
+  int count = 0;
+  int adjacent = 0;
+  for (Value l = w.stack[0]; IS_PAIR(l); l = AS_PAIR(l)->cdr, ++count) {
+    struct obj_pair *pair = AS_PAIR(l);
+    if (!IS_NUM(pair->car) || AS_NUM(pair->car) != length - 1 - count)
+      break;
+
+    adjacent += IS_PAIR(pair->cdr) && AS_PAIR(pair->cdr) == pair + 1;
+  }
+
+  TEST(count == length, "compaction, %d elements kept", count);
+
+  // Only the ends of the pages separate the pairs.
+  TEST(adjacent >= length - length / 100,
+      "compaction, %d of %d pairs adjacent", adjacent, length - 1);
+
+  p.len = 0;
+  TEST1(server_eval(&w, "(cons (f 'b) l)", &p) && p.len == 15
+      && memcmp(p.buffer, "((a . b) p q r)", 15) == 0,
+      "compaction, closure called");
+
+  Value val;
+  TEST1(global_get(&w, "l", &val) && IS_PAIR(val)
+      && AS_ATOM(AS_PAIR(val)->car) == str_pool_intern(&w, "p", 1),
+      "compaction, atoms interned");
+
+  printer_free(&p);
+  wisp_state_free(&w);
+}
+
+static void test_compact_fragmented(void)
+{
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  // Nothing is freed before the heap is compacted.
+  w.next_gc = SIZE_MAX;
+  w.next_young_gc = SIZE_MAX;
+
+  // A list filling its pages.
+  int length = 100000;
+  vm_stack_push(&w, NIL_VAL);
+  for (int i = 0; i < length; ++i)
+    w.stack[0] = OBJ_VAL(pair_new(&w, NUM_VAL(i), w.stack[0]));
+
+  TEST1(!compact_if_fragmented(&w), "fragmentation, dense heap kept");
+
+  // A list interleaved with three times as much garbage.
+  w.next_gc = SIZE_MAX;
+  w.next_young_gc = SIZE_MAX;
+  vm_stack_push(&w, NIL_VAL);
+  for (int i = 0; i < length; ++i) {
+    for (int j = 0; j < 3; ++j)
+      pair_new(&w, NIL_VAL, NIL_VAL);
+
+    w.stack[1] = OBJ_VAL(pair_new(&w, NUM_VAL(i), w.stack[1]));
+  }
+
+  TEST1(compact_if_fragmented(&w), "fragmentation, sparse heap compacted");
+  TEST1(!compact_if_fragmented(&w), "fragmentation, compacted heap kept");
+
+  int count = 0;
+  for (Value l = w.stack[1]; IS_PAIR(l); l = AS_PAIR(l)->cdr, ++count) {
+    Value car = AS_PAIR(l)->car;
+    if (!IS_NUM(car) || AS_NUM(car) != length - 1 - count)
+      break;
+  }
+
+  TEST(count == length, "fragmentation, %d elements kept", count);
+  wisp_state_free(&w);
+}
+
+static void test_loader(void)
+{
+  // Large enough to be split into several batches.
+  int forms = 4000;
+  size_t cap = 80 * forms;
+  char *source = malloc(cap);
+  int len = 0;
+
+  for (int i = 0; i < forms; ++i)
+    len += snprintf(source + len, cap - len,
+        "(define g%d (lambda (x) (cons x '(a%d . b))))\n"
+        "(define r%d (g%d %d))\n", i, i, i, i, i);
+
+  // An undefined variable in the middle of the source.
+  char *error = strstr(source, "(g3000 3000)");
+  memcpy(error, "(h3000", 6);
+
+  struct wisp_state w;
+  wisp_state_init(&w);
+
+  struct loader l;
+  loader_init(&l, &w, source, 4);
+
+  int executed = 0;
+  struct obj_lambda *lambda;
+
+  while (loader_next(&l, &lambda) && lambda != NULL && interpret(&w, lambda))
+    executed++;
+
+  loader_free(&l);
+  TEST(executed == 2 * 3000 + 1, "loader, %d forms executed", executed);
+
+  int correct = 0;
+
+  for (int i = 0; i < 3000; ++i) {
+    char name[16];
+    snprintf(name, sizeof(name), "r%d", i);
+
+    Value val;
+    if (!global_get(&w, name, &val) || !IS_PAIR(val))
+      break;
+
+    Value car = AS_PAIR(val)->car;
+    Value cdr = AS_PAIR(val)->cdr;
+    snprintf(name, sizeof(name), "a%d", i);
+    struct obj_string *atom = str_pool_intern(&w, name, strlen(name));
+
+    if (!IS_NUM(car) || AS_NUM(car) != i || !IS_PAIR(cdr)
+        || AS_OBJ(AS_PAIR(cdr)->car) != (struct obj *) atom)
+      break;
+
+    correct++;
+  }
+
+  TEST(correct == 3000, "loader, %d results with interned atoms", correct);
+
+  Value val;
+  TEST1(!global_get(&w, "r3000", &val) && !global_get(&w, "g3001", &val),
+      "loader, stop at the first error");
+
+  wisp_state_free(&w);
+
+  // A batch allocating past the point of a full collection, which may still
+  // be sweeping when the batch is adopted.
+  int elements = 200000;
+  cap = 8 * (size_t) elements + 80 * 1000;
+  source = realloc(source, cap);
+  len = snprintf(source, cap, "(define l '(");
+  for (int i = 0; i < elements; ++i)
+    len += snprintf(source + len, cap - len, "%d ", i);
+  len += snprintf(source + len, cap - len, "))\n");
+  for (int i = 0; i < 1000; ++i)
+    len += snprintf(source + len, cap - len,
+        "(define d%d (cons '(a%d) l))\n", i, i);
+
+  wisp_state_init(&w);
+
+  // The state is itself sweeping lazily when the batches are adopted.
+  vm_stack_push(&w, NIL_VAL);
+  for (int i = 0; i < 50000; ++i) {
+    pair_new(&w, NIL_VAL, NIL_VAL);
+    w.stack[0] = OBJ_VAL(pair_new(&w, NUM_VAL(i), w.stack[0]));
+  }
+
+  w.nursery_size = 8192;
+  w.next_gc = w.bytes_allocated;
+  pair_new(&w, NIL_VAL, NIL_VAL);
+  TEST1(w.gc_phase == GC_SWEEP, "loader, sweep started");
+
+  loader_init(&l, &w, source, 2);
+
+  executed = 0;
+  while (loader_next(&l, &lambda) && lambda != NULL && interpret(&w, lambda))
+    executed++;
+
+  loader_free(&l);
+  TEST(executed == 1001, "loader, %d forms after a collection", executed);
+
+  Value d;
+  bool found = global_get(&w, "d999", &d) && IS_PAIR(d)
+    && IS_PAIR(AS_PAIR(d)->car)
+    && is_atom(AS_PAIR(AS_PAIR(d)->car)->car, "a999");
+  int count = 0;
+
+  for (val = found ? AS_PAIR(d)->cdr : NIL_VAL; IS_PAIR(val);
+      val = AS_PAIR(val)->cdr, ++count)
+    if (!IS_NUM(AS_PAIR(val)->car) || AS_NUM(AS_PAIR(val)->car) != count)
+      break;
+
+  TEST(found && IS_NIL(val) && count == elements,
+      "loader, %d elements kept after a collection", count);
+
+  wisp_state_free(&w);
+  free(source);
+}
+
+int main(void)
+{
+  // Scanner tests.
+  test_scanner_simple();
+  test_scanner_identifier();
+  test_scanner_number();
+  test_scanner_skip_comment();
+  test_scanner_long_runs();
+  test_scanner_compound();
+
+  // String pool tests.
+  test_interning_unique();
+  test_interning_non_unique();
+  test_interning_identity();
+  test_interning_uninterning();
+
+  // Compiler tests.
+  test_compiler_wide_operands();
+  test_compiler_constant_deduplication();
+  test_compiler_gc();
+  test_compiler_quoted_data();
+  test_compiler_deep_nesting();
+  test_compiler_stack_size();
+  test_compiler_lazy();
+  test_compiler_toplevel();
+  test_compiler_superinstructions();
+  test_compiler_lines();
+  test_compiler_arena();
+
+  // Loader tests.
+  test_loader();
+
+  // Image tests.
+  test_image();
+
+  // Snapshot tests.
+  test_snapshot();
+  test_state_clone();
+
+  // Server tests.
+  test_server_eval();
+
+  // Reader tests.
+  test_reader_data();
+  test_reader_errors();
+  test_reader_gc();
+  test_reader_native();
+  test_read_file_native();
+
+  // Byte vector tests.
+  test_bytes_native();
+
+  // Printer tests.
+  test_printer_numbers();
+  test_printer_lists();
+
+  // Serializer tests.
+  test_serializer_values();
+  test_serializer_stream();
+  test_serializer_gc();
+
+  // Collector tests.
+  test_pool();
+  test_gc_generations();
+  test_gc_incremental();
+  test_gc_parallel();
+  test_gc_lazy_sweep();
+  test_gc_mark_bits();
+  test_gc_sweep_allocation();
+  test_compact();
+  test_compact_fragmented();
 
   printf("%d failed, %d passed\n", count_fail, count_pass);
   return count_fail != 0;